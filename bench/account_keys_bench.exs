@@ -0,0 +1,35 @@
+# Compares reading account keys natively with decoding libolm's JSON.
+#
+#     mix run bench/account_keys_bench.exs
+
+Code.require_file("bench_helper.exs", __DIR__)
+
+alias Olm.{Account, Bench, NIF}
+
+ops = 100_000
+
+account = Account.create()
+:ok = Account.generate_one_time_keys(account, 50)
+
+IO.puts("\nidentity keys")
+
+Bench.measure("Jason.decode!/2", ops, fn ->
+  for _ <- 1..ops do
+    {:ok, json} = NIF.account_identity_keys(account)
+    Jason.decode!(json, keys: :atoms)
+  end
+end)
+
+Bench.measure("Account.identity_keys/1", ops, fn ->
+  for _ <- 1..ops, do: Account.identity_keys(account)
+end)
+
+IO.puts("\n50 one time keys")
+
+Bench.measure("Account.one_time_keys/1", ops, fn ->
+  for _ <- 1..ops, do: Account.one_time_keys(account)
+end)
+
+Bench.measure("Account.one_time_keys_list/1", ops, fn ->
+  for _ <- 1..ops, do: Account.one_time_keys_list(account)
+end)
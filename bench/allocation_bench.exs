@@ -0,0 +1,62 @@
+# Counts binary allocations per call at the NIF boundary.
+#
+#     mix run bench/allocation_bench.exs
+#
+# Other processes allocate too, so counts are approximate on a busy node.
+
+Code.require_file("bench_helper.exs", __DIR__)
+
+alias Olm.{Account, Bench, Session, Utility}
+
+ops = 10_000
+
+binary_allocations = fn ->
+  for {:instance, _, info} <- :erlang.system_info({:allocator, :binary_alloc}),
+      {:calls, calls} <- info,
+      {:binary_alloc, giga_count, count} <- calls,
+      reduce: 0 do
+    total -> total + giga_count * 1_000_000_000 + count
+  end
+end
+
+# `fun` is expected to make `ops` calls.
+count = fn label, fun ->
+  before = binary_allocations.()
+  Bench.measure(label, ops, fun)
+  per_call = Float.round((binary_allocations.() - before) / ops, 2)
+
+  IO.puts("#{String.pad_trailing("", 40)} #{per_call} binary allocations/call")
+end
+
+{session, peer_account, id_key} = Bench.outbound_session()
+%{cyphertext: first, type: 0} = Session.encrypt_message(session, "first")
+inbound = Session.new_inbound(peer_account, first, id_key)
+
+account = Account.create()
+%{ed25519: key} = Account.identity_keys(account)
+signature = Account.sign(account, "message")
+pickled = Session.pickle(session, "key")
+
+IO.puts("")
+
+count.("Session.encrypt_message/2 (binary)", fn ->
+  for _ <- 1..ops, do: Session.encrypt_message(session, "message")
+end)
+
+count.("Session.encrypt_message/2 (iodata)", fn ->
+  for _ <- 1..ops, do: Session.encrypt_message(session, ["mess", "age"])
+end)
+
+messages = for _ <- 1..ops, do: Session.encrypt_message(session, "message")
+
+count.("Session.decrypt_message/3", fn ->
+  for message <- messages, do: Session.decrypt_message(inbound, message.type, message.cyphertext)
+end)
+
+count.("Session.unpickle/2", fn ->
+  for _ <- 1..ops, do: Session.unpickle(pickled, "key")
+end)
+
+count.("Utility.verify_ed25519/3", fn ->
+  for _ <- 1..ops, do: Utility.verify_ed25519(key, "message", signature)
+end)
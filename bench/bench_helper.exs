@@ -0,0 +1,37 @@
+defmodule Olm.Bench do
+  @moduledoc false
+
+  alias Olm.{Account, Session}
+
+  @doc """
+  Runs `fun` and prints how many operations per second it managed.
+
+  `fun` is expected to perform `ops` operations.
+  """
+  def measure(label, ops, fun) do
+    {micros, _} = :timer.tc(fun)
+    ops_per_sec = ops * 1_000_000 / max(micros, 1)
+
+    rate = :erlang.float_to_binary(ops_per_sec, decimals: 0)
+    IO.puts("#{String.pad_trailing(label, 40)} #{rate} ops/s")
+
+    ops_per_sec
+  end
+
+  @doc """
+  Returns an `{outbound_session, peer_account, id_key}` triple, ready for encryption.
+  """
+  def outbound_session() do
+    account = Account.create()
+    peer_account = Account.create()
+
+    %{curve25519: id_key} = Account.identity_keys(account)
+    %{curve25519: peer_id_key} = Account.identity_keys(peer_account)
+
+    %{curve25519: %{AAAAAQ: peer_one_time_key}} =
+      Account.generate_one_time_keys(peer_account, 1, true)
+
+    session = Session.new_outbound(account, peer_id_key, peer_one_time_key)
+    {session, peer_account, id_key}
+  end
+end
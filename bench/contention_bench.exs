@@ -0,0 +1,26 @@
+# Measures encrypt throughput when one session is shared by 1, 8 and 64
+# concurrent callers, each calling the NIF directly.
+#
+#     mix run bench/contention_bench.exs
+
+Code.require_file("bench_helper.exs", __DIR__)
+
+alias Olm.{Bench, Session}
+
+ops = 20_000
+plaintext = String.duplicate("a", 256)
+
+for callers <- [1, 8, 64] do
+  {session, _, _} = Bench.outbound_session()
+  per_caller = div(ops, callers)
+
+  Bench.measure("#{callers} callers", per_caller * callers, fn ->
+    1..callers
+    |> Enum.map(fn _ ->
+      Task.async(fn ->
+        for _ <- 1..per_caller, do: Session.encrypt_message(session, plaintext)
+      end)
+    end)
+    |> Enum.each(&Task.await(&1, :infinity))
+  end)
+end
@@ -0,0 +1,40 @@
+# Compares the per-message decrypt path with Olm.Session.decrypt_many/2.
+#
+#     mix run bench/decrypt_many_bench.exs
+
+Code.require_file("bench_helper.exs", __DIR__)
+
+alias Olm.{Bench, Session}
+
+plaintext = String.duplicate("a", 256)
+
+for batch <- [1, 16, 128, 1024] do
+  rounds = max(div(4_096, batch), 1)
+  ops = batch * rounds
+
+  IO.puts("\nbacklog of #{batch} x 256 bytes")
+
+  # Each run needs fresh sessions, as a message can only be decrypted once.
+  backlogs = fn ->
+    for _ <- 1..rounds do
+      {session, peer_account, id_key} = Bench.outbound_session()
+      messages = Session.encrypt_many(session, List.duplicate(plaintext, batch))
+      [{_, first} | _] = messages
+      {Session.new_inbound(peer_account, first, id_key), messages}
+    end
+  end
+
+  backlog = backlogs.()
+
+  Bench.measure("decrypt_message/3", ops, fn ->
+    for {inbound, messages} <- backlog, {type, cyphertext} <- messages do
+      Session.decrypt_message(inbound, type, cyphertext)
+    end
+  end)
+
+  backlog = backlogs.()
+
+  Bench.measure("decrypt_many/2", ops, fn ->
+    for {inbound, messages} <- backlog, do: Session.decrypt_many(inbound, messages)
+  end)
+end
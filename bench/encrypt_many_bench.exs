@@ -0,0 +1,29 @@
+# Compares the per-message encrypt path with Olm.Session.encrypt_many/2.
+#
+#     mix run bench/encrypt_many_bench.exs
+
+Code.require_file("bench_helper.exs", __DIR__)
+
+alias Olm.{Bench, Session}
+
+plaintext = String.duplicate("a", 256)
+
+for batch <- [1, 16, 128, 1024] do
+  plaintexts = List.duplicate(plaintext, batch)
+  rounds = max(div(10_000, batch), 1)
+  ops = batch * rounds
+
+  IO.puts("\nbatch of #{batch} x 256 bytes")
+
+  {session, _, _} = Bench.outbound_session()
+
+  Bench.measure("encrypt_message/2", ops, fn ->
+    for _ <- 1..rounds, p <- plaintexts, do: Session.encrypt_message(session, p)
+  end)
+
+  {session, _, _} = Bench.outbound_session()
+
+  Bench.measure("encrypt_many/2", ops, fn ->
+    for _ <- 1..rounds, do: Session.encrypt_many(session, plaintexts)
+  end)
+end
@@ -0,0 +1,35 @@
+# Compares encrypting one room key for each device, session by session, with
+# Olm.Session.encrypt_to_many/2, and prints the latency of a whole fan-out.
+#
+#     mix run bench/encrypt_to_many_bench.exs
+
+Code.require_file("bench_helper.exs", __DIR__)
+
+alias Olm.{Account, Bench, Session}
+
+plaintext = String.duplicate("a", 256)
+
+account = Account.create()
+peer_account = Account.create()
+%{curve25519: peer_id_key} = Account.identity_keys(peer_account)
+[{_key_id, one_time_key}] = Account.replenish_one_time_keys(peer_account, 1, 0)
+
+for devices <- [10, 100, 1000] do
+  sessions = for _ <- 1..devices, do: Session.new_outbound(account, peer_id_key, one_time_key)
+  rounds = max(div(20_000, devices), 10)
+  ops = devices * rounds
+
+  IO.puts("\n#{devices} devices x 256 bytes")
+
+  Bench.measure("encrypt_message/2 per session", ops, fn ->
+    for _ <- 1..rounds, session <- sessions, do: Session.encrypt_message(session, plaintext)
+  end)
+
+  ops_per_sec =
+    Bench.measure("encrypt_to_many/2", ops, fn ->
+      for _ <- 1..rounds, do: Session.encrypt_to_many(sessions, plaintext)
+    end)
+
+  latency = :erlang.float_to_binary(devices * 1_000_000 / ops_per_sec, decimals: 0)
+  IO.puts("#{String.pad_trailing("encrypt_to_many/2 fan-out latency", 40)} #{latency} us")
+end
@@ -0,0 +1,34 @@
+# Compares Megolm group encryption with 1:1 Olm encryption.
+#
+#     mix run bench/group_session_bench.exs
+
+Code.require_file("bench_helper.exs", __DIR__)
+
+alias Olm.{Bench, InboundGroupSession, OutboundGroupSession, Session}
+
+ops = 10_000
+
+for size <- [64, 1024, 16_384] do
+  plaintext = String.duplicate("a", size)
+
+  IO.puts("\n#{size} byte messages")
+
+  {session, _, _} = Bench.outbound_session()
+
+  Bench.measure("Session.encrypt_message/2", ops, fn ->
+    for _ <- 1..ops, do: Session.encrypt_message(session, plaintext)
+  end)
+
+  outbound = OutboundGroupSession.new()
+  inbound = outbound |> OutboundGroupSession.session_key() |> InboundGroupSession.new()
+
+  Bench.measure("OutboundGroupSession.encrypt_message/2", ops, fn ->
+    for _ <- 1..ops, do: OutboundGroupSession.encrypt_message(outbound, plaintext)
+  end)
+
+  messages = for _ <- 1..ops, do: OutboundGroupSession.encrypt_message(outbound, plaintext)
+
+  Bench.measure("InboundGroupSession.decrypt_message/2", ops, fn ->
+    for message <- messages, do: InboundGroupSession.decrypt_message(inbound, message)
+  end)
+end
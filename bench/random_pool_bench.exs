@@ -0,0 +1,25 @@
+# Measures encrypt throughput, which needs fresh randomness for every message.
+# Run it once with the per-scheduler random pool and once without it:
+#
+#     mix run bench/random_pool_bench.exs
+#     OLM_RANDOM_POOL=0 mix run bench/random_pool_bench.exs
+
+Code.require_file("bench_helper.exs", __DIR__)
+
+alias Olm.{Bench, OutboundGroupSession, Session}
+
+pool = if System.get_env("OLM_RANDOM_POOL") == "0", do: "without pool", else: "with pool"
+ops = 20_000
+plaintext = String.duplicate("a", 64)
+
+IO.puts("random bytes #{pool}")
+
+{session, _, _} = Bench.outbound_session()
+
+Bench.measure("Session.encrypt_message/2", ops, fn ->
+  for _ <- 1..ops, do: Session.encrypt_message(session, plaintext)
+end)
+
+Bench.measure("OutboundGroupSession.new/0", 2_000, fn ->
+  for _ <- 1..2_000, do: OutboundGroupSession.new()
+end)
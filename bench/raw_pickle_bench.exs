@@ -0,0 +1,26 @@
+# Compares the size of the base64 and raw session pickle formats, and the time the raw format's
+# extra base64 pass adds to pickling and unpickling.
+#
+#     mix run bench/raw_pickle_bench.exs
+
+Code.require_file("bench_helper.exs", __DIR__)
+
+alias Olm.{Bench, Session}
+
+ops = 20_000
+
+{session, _, _} = Bench.outbound_session()
+
+for format <- [:base64, :raw] do
+  pickled = Session.pickle(session, "key", format)
+
+  IO.puts("\n#{format}, #{byte_size(pickled)} bytes")
+
+  Bench.measure("Session.pickle/3", ops, fn ->
+    for _ <- 1..ops, do: Session.pickle(session, "key", format)
+  end)
+
+  Bench.measure("Session.unpickle/3", ops, fn ->
+    for _ <- 1..ops, do: Session.unpickle(pickled, "key", format)
+  end)
+end
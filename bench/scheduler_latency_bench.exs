@@ -0,0 +1,72 @@
+# Measures how responsive the VM stays while one time keys are generated on
+# every scheduler. A probe process pings another process in a loop and
+# records the round trip latency.
+#
+#     mix run bench/scheduler_latency_bench.exs
+
+alias Olm.Account
+
+defmodule Olm.Bench.Probe do
+  def start() do
+    parent = self()
+    echo = spawn(fn -> echo() end)
+    spawn(fn -> probe(parent, echo, []) end)
+  end
+
+  def stop(probe) do
+    send(probe, :stop)
+
+    receive do
+      {:latencies, latencies} -> latencies
+    end
+  end
+
+  defp echo() do
+    receive do
+      {:ping, from} ->
+        send(from, :pong)
+        echo()
+    end
+  end
+
+  defp probe(parent, echo, latencies) do
+    receive do
+      :stop -> send(parent, {:latencies, latencies})
+    after
+      0 ->
+        start = System.monotonic_time(:microsecond)
+        send(echo, {:ping, self()})
+
+        receive do
+          :pong -> :ok
+        end
+
+        latency = System.monotonic_time(:microsecond) - start
+        Process.sleep(1)
+        probe(parent, echo, [latency | latencies])
+    end
+  end
+end
+
+report = fn label, latencies ->
+  sorted = Enum.sort(latencies)
+  count = length(sorted)
+  p = fn q -> Enum.at(sorted, min(round(count * q), count - 1)) end
+
+  percentiles = "p50 #{p.(0.5)} µs  p99 #{p.(0.99)} µs  max #{List.last(sorted)} µs"
+  IO.puts("#{String.pad_trailing(label, 30)} #{percentiles}")
+end
+
+probe = Olm.Bench.Probe.start()
+Process.sleep(1_000)
+report.("idle", Olm.Bench.Probe.stop(probe))
+
+accounts = for _ <- 1..System.schedulers_online(), do: Account.create()
+
+probe = Olm.Bench.Probe.start()
+
+accounts
+|> Enum.map(&Task.async(fn -> Account.generate_one_time_keys(&1, 10_000) end))
+|> Enum.each(&Task.await(&1, :infinity))
+
+report.("generating 10k one time keys", Olm.Bench.Probe.stop(probe))
@@ -0,0 +1,38 @@
+# Rehydrates 100k pickled sessions, one call per session and in bulk, as on
+# node startup.
+#
+#     mix run bench/session_startup_bench.exs
+
+Code.require_file("bench_helper.exs", __DIR__)
+
+alias Olm.{Bench, Session}
+
+count = 100_000
+
+{session, _, _} = Bench.outbound_session()
+pickled = Session.pickle(session, "key")
+pickles = List.duplicate(pickled, count)
+
+IO.puts("\n#{count} sessions")
+
+Bench.measure("Session.unpickle/2", count, fn ->
+  for pickle <- pickles, do: Session.unpickle(pickle, "key")
+end)
+
+Bench.measure("Session.unpickle_many/2", count, fn ->
+  Session.unpickle_many(pickles, "key")
+end)
+
+Bench.measure("Session.unpickle_many/2 (stream)", count, fn ->
+  pickles |> Stream.map(& &1) |> Session.unpickle_many("key")
+end)
+
+sessions = for {:ok, session} <- Session.unpickle_many(pickles, "key"), do: session
+
+Bench.measure("Session.pickle/2", count, fn ->
+  for session <- sessions, do: Session.pickle(session, "key")
+end)
+
+Bench.measure("Session.pickle_many/2", count, fn ->
+  Session.pickle_many(sessions, "key")
+end)
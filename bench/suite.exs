@@ -0,0 +1,250 @@
+defmodule Olm.Bench.Suite do
+  @moduledoc false
+
+  # The benchmark suite run by `mix olm.bench`. Each scenario measures one NIF-backed
+  # operation and reports throughput, latency percentiles, scheduler utilisation, heap bytes
+  # allocated and the growth of the off-heap binary memory the NIFs return their output in.
+
+  alias Olm.{Account, Session, Utility}
+
+  @payload_sizes [16, 1024, 65_536]
+
+  def run(opts) do
+    scale = Keyword.get(opts, :scale, 1.0)
+    only = Keyword.get(opts, :only)
+
+    :erlang.system_flag(:scheduler_wall_time, true)
+
+    results =
+      for {name, ops, setup, fun} <- scenarios(),
+          only == nil or String.contains?(name, only) do
+        ops = max(round(ops * scale), 1)
+        result = measure(name, ops, setup, fun)
+        print(result)
+        result
+      end
+
+    :erlang.system_flag(:scheduler_wall_time, false)
+
+    %{
+      otp_release: to_string(:erlang.system_info(:otp_release)),
+      elixir: System.version(),
+      olm: Olm.version(),
+      schedulers: :erlang.system_info(:schedulers_online),
+      dirty_cpu_schedulers: :erlang.system_info(:dirty_cpu_schedulers_online),
+      results: results
+    }
+  end
+
+  # Each scenario is `{name, ops, setup, fun}`. `setup.(ops)` returns one input per operation,
+  # so operations that consume their input (like decrypting a message) get a fresh one each.
+  defp scenarios() do
+    [
+      {"Account.create/0", 200, &repeat(nil, &1), fn _ -> Account.create() end}
+    ] ++
+      for count <- [10, 100, 1000] do
+        {"Account.generate_one_time_keys/2 (#{count} keys)", div(20_000, count),
+         &repeat(Account.create(), &1),
+         fn account -> Account.generate_one_time_keys(account, count) end}
+      end ++
+      [
+        {"Session.new_outbound/3", 500, fn ops -> repeat(outbound_keys(), ops) end,
+         fn {account, id_key, one_time_key} ->
+           Session.new_outbound(account, id_key, one_time_key)
+         end},
+        {"Session.new_inbound/3", 500, &pre_key_messages/1,
+         fn {account, message, id_key} -> Session.new_inbound(account, message, id_key) end}
+      ] ++
+      for size <- @payload_sizes do
+        {"Session.encrypt_message/2 (#{size} bytes)", ops_for(size),
+         fn ops -> repeat({outbound_session(), payload(size)}, ops) end,
+         fn {session, plaintext} -> Session.encrypt_message(session, plaintext) end}
+      end ++
+      for size <- @payload_sizes do
+        {"Session.decrypt_message/3 (#{size} bytes)", ops_for(size),
+         &messages(&1, payload(size)),
+         fn {session, message} ->
+           Session.decrypt_message(session, message.type, message.cyphertext)
+         end}
+      end ++
+      for devices <- [10, 100, 1000] do
+        {"Session.encrypt_to_many/2 (#{devices} sessions)", div(20_000, devices),
+         fn ops -> repeat({outbound_sessions(devices), payload(1024)}, ops) end,
+         fn {sessions, plaintext} -> Session.encrypt_to_many(sessions, plaintext) end}
+      end ++
+      [
+        {"Session.pickle/2", 10_000, fn ops -> repeat(outbound_session(), ops) end,
+         &Session.pickle(&1, "key")},
+        {"Session.unpickle/2", 10_000,
+         fn ops -> repeat(Session.pickle(outbound_session(), "key"), ops) end,
+         &Session.unpickle(&1, "key")}
+      ] ++
+      for size <- @payload_sizes do
+        {"Utility.sha256/1 (#{size} bytes)", ops_for(size), &repeat(payload(size), &1),
+         &Utility.sha256/1}
+      end ++
+      [
+        {"Utility.verify_ed25519/3", 5_000, fn ops -> repeat(signed_message(), ops) end,
+         fn {key, message, signature} -> Utility.verify_ed25519(key, message, signature) end}
+      ]
+  end
+
+  defp measure(name, ops, setup, fun) do
+    inputs = setup.(ops)
+
+    :erlang.garbage_collect()
+    {:total_heap_size, heap_before} = :erlang.process_info(self(), :total_heap_size)
+    {_, reclaimed_before, _} = :erlang.statistics(:garbage_collection)
+    binary_before = :erlang.memory(:binary)
+    wall_time_before = :erlang.statistics(:scheduler_wall_time)
+    started = System.monotonic_time()
+
+    latencies =
+      for input <- inputs do
+        op_started = System.monotonic_time()
+        fun.(input)
+        System.monotonic_time() - op_started
+      end
+
+    elapsed = System.monotonic_time() - started
+    wall_time_after = :erlang.statistics(:scheduler_wall_time)
+    binary_after = :erlang.memory(:binary)
+    {_, reclaimed_after, _} = :erlang.statistics(:garbage_collection)
+    {:total_heap_size, heap_after} = :erlang.process_info(self(), :total_heap_size)
+
+    heap_words = reclaimed_after - reclaimed_before + heap_after - heap_before
+    sorted = latencies |> Enum.map(&to_micros/1) |> Enum.sort() |> List.to_tuple()
+
+    {normal, dirty_cpu} = utilization(wall_time_before, wall_time_after)
+
+    %{
+      name: name,
+      ops: ops,
+      ops_per_sec: ops * System.convert_time_unit(1, :second, :native) / max(elapsed, 1),
+      p50_us: percentile(sorted, 0.50),
+      p99_us: percentile(sorted, 0.99),
+      max_us: elem(sorted, tuple_size(sorted) - 1),
+      scheduler_utilization: normal,
+      dirty_cpu_utilization: dirty_cpu,
+      heap_bytes_per_op: max(heap_words, 0) * :erlang.system_info(:wordsize) / ops,
+      binary_bytes_per_op: max(binary_after - binary_before, 0) / ops
+    }
+  end
+
+  defp print(result) do
+    IO.puts(
+      String.pad_trailing(result.name, 48) <>
+        " #{round(result.ops_per_sec)} ops/s" <>
+        "  p50 #{format_micros(result.p50_us)}us  p99 #{format_micros(result.p99_us)}us" <>
+        "  sched #{percent(result.scheduler_utilization)}" <>
+        "  dirty #{percent(result.dirty_cpu_utilization)}" <>
+        "  #{round(result.heap_bytes_per_op)} B/op" <>
+        "  bin #{round(result.binary_bytes_per_op)} B/op"
+    )
+  end
+
+  # Normal schedulers come first in scheduler_wall_time, followed by the dirty CPU ones.
+  defp utilization(before, later) do
+    normal = :erlang.system_info(:schedulers)
+    dirty_cpu = :erlang.system_info(:dirty_cpu_schedulers)
+
+    deltas =
+      for {{id, active_before, total_before}, {id, active_after, total_after}} <-
+            Enum.zip(Enum.sort(before), Enum.sort(later)) do
+        {id, active_after - active_before, total_after - total_before}
+      end
+
+    {ratio(deltas, &(&1 <= normal)), ratio(deltas, &(&1 > normal and &1 <= normal + dirty_cpu))}
+  end
+
+  defp ratio(deltas, include?) do
+    {active, total} =
+      for {id, active, total} <- deltas, include?.(id), reduce: {0, 0} do
+        {a, t} -> {a + active, t + total}
+      end
+
+    if total == 0, do: 0.0, else: active / total
+  end
+
+  defp percentile(sorted, p) do
+    index = min(trunc(tuple_size(sorted) * p), tuple_size(sorted) - 1)
+    elem(sorted, index)
+  end
+
+  # Latencies are kept in native units until here, so sub-microsecond operations don't all
+  # round down to zero.
+  defp to_micros(native), do: native * 1_000_000 / System.convert_time_unit(1, :second, :native)
+
+  defp format_micros(micros), do: :erlang.float_to_binary(micros, decimals: 2)
+
+  defp percent(ratio), do: "#{round(ratio * 100)}%"
+
+  defp ops_for(size) when size > 16_384, do: 500
+  defp ops_for(_size), do: 10_000
+
+  defp repeat(input, ops), do: List.duplicate(input, ops)
+
+  defp payload(size) do
+    size |> :crypto.strong_rand_bytes() |> Base.encode64() |> binary_part(0, size)
+  end
+
+  defp outbound_keys() do
+    account = Account.create()
+    peer_account = Account.create()
+
+    %{curve25519: peer_id_key} = Account.identity_keys(peer_account)
+    [{_key_id, one_time_key}] = Account.replenish_one_time_keys(peer_account, 1, 0)
+
+    {account, peer_id_key, one_time_key}
+  end
+
+  defp outbound_session() do
+    {account, peer_id_key, one_time_key} = outbound_keys()
+    Session.new_outbound(account, peer_id_key, one_time_key)
+  end
+
+  # A room key goes to a session per device; here they're all with the same peer.
+  defp outbound_sessions(count) do
+    {account, peer_id_key, one_time_key} = outbound_keys()
+    for _ <- 1..count, do: Session.new_outbound(account, peer_id_key, one_time_key)
+  end
+
+  # Every inbound session needs its own pre key message, all for the same one time key.
+  defp pre_key_messages(ops) do
+    account = Account.create()
+    peer_account = Account.create()
+
+    %{curve25519: id_key} = Account.identity_keys(account)
+    %{curve25519: peer_id_key} = Account.identity_keys(peer_account)
+    [{_key_id, one_time_key}] = Account.replenish_one_time_keys(peer_account, 1, 0)
+
+    for _ <- 1..ops do
+      session = Session.new_outbound(account, peer_id_key, one_time_key)
+      %{cyphertext: message} = Session.encrypt_message(session, "message")
+      {peer_account, message, id_key}
+    end
+  end
+
+  # Messages are decrypted in the order they were encrypted, one per operation.
+  defp messages(ops, plaintext) do
+    account = Account.create()
+    peer_account = Account.create()
+
+    %{curve25519: id_key} = Account.identity_keys(account)
+    %{curve25519: peer_id_key} = Account.identity_keys(peer_account)
+    [{_key_id, one_time_key}] = Account.replenish_one_time_keys(peer_account, 1, 0)
+
+    outbound = Session.new_outbound(account, peer_id_key, one_time_key)
+    %{cyphertext: first} = Session.encrypt_message(outbound, "first")
+    inbound = Session.new_inbound(peer_account, first, id_key)
+
+    for _ <- 1..ops, do: {inbound, Session.encrypt_message(outbound, plaintext)}
+  end
+
+  defp signed_message() do
+    account = Account.create()
+    %{ed25519: key} = Account.identity_keys(account)
+
+    {key, "message", Account.sign(account, "message")}
+  end
+end
@@ -0,0 +1,29 @@
+# Measures signature verifications and hashes per second.
+#
+#     mix run bench/utility_bench.exs
+
+Code.require_file("bench_helper.exs", __DIR__)
+
+alias Olm.{Account, Bench, Utility}
+
+ops = 20_000
+
+account = Account.create()
+%{ed25519: key} = Account.identity_keys(account)
+signature = Account.sign(account, "message")
+
+IO.puts("")
+
+Bench.measure("Utility.verify_ed25519/3", ops, fn ->
+  for _ <- 1..ops, do: {:ok, _} = Utility.verify_ed25519(key, "message", signature)
+end)
+
+Bench.measure("Utility.sha256/1", ops, fn ->
+  for _ <- 1..ops, do: Utility.sha256("message")
+end)
+
+signatures = List.duplicate({key, "message", signature}, ops)
+
+Bench.measure("Utility.verify_ed25519_many/1", ops, fn ->
+  Utility.verify_ed25519_many(signatures)
+end)
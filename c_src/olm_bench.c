@@ -0,0 +1,325 @@
+// Standalone benchmark driver for the libolm calls behind the session NIFs.
+//
+// It makes the same calls in the same order as the NIF wrappers in
+// olm_nif.c, including the copies of arguments libolm decodes in place, but
+// without the BEAM, so perf sees only libolm and the wrapper overhead:
+//
+//     make bench
+//     perf record -g ./priv/native/olm_bench 100000 1024
+//     perf report
+
+#include "olm_common.h"
+
+#include <errno.h>
+#include <olm/olm.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Setup
+
+static void
+fail(const char *what, const char *error)
+{
+    fprintf(stderr, "%s failed: %s\n", what, error);
+    exit(1);
+}
+
+static void *
+checked_malloc(size_t size)
+{
+    void *memory = malloc(size);
+    if (memory == NULL) fail("malloc", strerror(errno));
+    return memory;
+}
+
+void *
+common_alloc(size_t size)
+{
+    return checked_malloc(size);
+}
+
+void
+common_free(void *memory)
+{
+    free(memory);
+}
+
+// Random bytes come out of a pool refilled in one go, like random_bytes in
+// olm_nif.c, so the syscall doesn't dominate the profile.
+static random_pool pool;
+
+static void *
+random_buffer(size_t length)
+{
+    void *buffer = checked_malloc(length ? length : 1);
+
+    if (!random_pool_take(&pool, buffer, length))
+        fail("system_random", strerror(errno));
+
+    return buffer;
+}
+
+// Wipes random bytes once libolm has made keys from them, like the NIF does.
+static void
+free_random(void *buffer, size_t length)
+{
+    wipe(buffer, length);
+    free(buffer);
+}
+
+// Returns the nth string in a JSON document. libolm's keys are base64, so
+// there's nothing to unescape.
+static const char *
+json_string(const char *json, int n, size_t *length)
+{
+    const char *start = json;
+
+    for (int i = 0; i <= n; i++) {
+        start = strchr(start, '"');
+        if (start == NULL) fail("json_string", "not enough strings");
+        start += 1;
+
+        const char *end = strchr(start, '"');
+        if (end == NULL) fail("json_string", "unterminated string");
+
+        if (i == n) {
+            *length = end - start;
+            return start;
+        }
+
+        start = end + 1;
+    }
+
+    return NULL;
+}
+
+static OlmAccount *
+create_account(void)
+{
+    OlmAccount *account     = olm_account(checked_malloc(olm_account_size()));
+    size_t      rand_length = olm_create_account_random_length(account);
+    void       *random      = random_buffer(rand_length);
+
+    if (olm_create_account(account, random, rand_length) == olm_error())
+        fail("olm_create_account", olm_account_last_error(account));
+
+    free_random(random, rand_length);
+    return account;
+}
+
+static char *
+identity_keys(OlmAccount *account)
+{
+    size_t length = olm_account_identity_keys_length(account);
+    char  *keys   = checked_malloc(length + 1);
+
+    if (olm_account_identity_keys(account, keys, length) == olm_error())
+        fail("olm_account_identity_keys", olm_account_last_error(account));
+
+    keys[length] = '\0';
+    return keys;
+}
+
+static char *
+one_time_key(OlmAccount *account)
+{
+    size_t rand_length =
+        olm_account_generate_one_time_keys_random_length(account, 1);
+    void *random = random_buffer(rand_length);
+
+    size_t result =
+        olm_account_generate_one_time_keys(account, 1, random, rand_length);
+
+    if (result == olm_error())
+        fail("olm_account_generate_one_time_keys",
+             olm_account_last_error(account));
+
+    free_random(random, rand_length);
+
+    size_t length = olm_account_one_time_keys_length(account);
+    char  *keys   = checked_malloc(length + 1);
+
+    if (olm_account_one_time_keys(account, keys, length) == olm_error())
+        fail("olm_account_one_time_keys", olm_account_last_error(account));
+
+    keys[length] = '\0';
+    return keys;
+}
+
+// Sessions
+
+typedef struct {
+    size_t type;
+    size_t length;
+    char  *message;
+} message;
+
+static OlmSession *
+new_session(void)
+{
+    return olm_session(checked_malloc(olm_session_size()));
+}
+
+static message
+encrypt(OlmSession *session, const char *plaintext, size_t length)
+{
+    message result;
+    size_t  rand_length = olm_encrypt_random_length(session);
+    void   *random      = random_buffer(rand_length);
+
+    result.type    = olm_encrypt_message_type(session);
+    result.length  = olm_encrypt_message_length(session, length);
+    result.message = checked_malloc(result.length);
+
+    if (olm_encrypt(session,
+                    plaintext,
+                    length,
+                    random,
+                    rand_length,
+                    result.message,
+                    result.length) == olm_error())
+        fail("olm_encrypt", olm_session_last_error(session));
+
+    free_random(random, rand_length);
+    return result;
+}
+
+// Timing
+
+static double
+now(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static void
+report(const char *name, long ops, double started)
+{
+    double elapsed = now() - started;
+    printf("%-24s %10.0f ops/s %10.0f ns/op\n",
+           name,
+           ops / elapsed,
+           elapsed * 1e9 / ops);
+}
+
+int
+main(int argc, char **argv)
+{
+    long   ops    = argc > 1 ? atol(argv[1]) : 10000;
+    size_t length = argc > 2 ? (size_t)atol(argv[2]) : 1024;
+
+    if (ops <= 0) fail("parsing arguments", "usage: olm_bench [ops] [bytes]");
+
+    OlmAccount *account      = create_account();
+    OlmAccount *peer_account = create_account();
+    char       *keys         = identity_keys(account);
+    char       *peer_keys    = identity_keys(peer_account);
+    char       *peer_otk     = one_time_key(peer_account);
+
+    size_t      id_key_length, peer_id_key_length, otk_length;
+    const char *id_key      = json_string(keys, 1, &id_key_length);
+    const char *peer_id_key = json_string(peer_keys, 1, &peer_id_key_length);
+    const char *otk         = json_string(peer_otk, 2, &otk_length);
+
+    OlmSession *outbound = new_session();
+
+    size_t rand_length = olm_create_outbound_session_random_length(outbound);
+    void  *random      = random_buffer(rand_length);
+
+    if (olm_create_outbound_session(outbound,
+                                    account,
+                                    peer_id_key,
+                                    peer_id_key_length,
+                                    otk,
+                                    otk_length,
+                                    random,
+                                    rand_length) == olm_error())
+        fail("olm_create_outbound_session", olm_session_last_error(outbound));
+
+    free_random(random, rand_length);
+
+    // The inbound session is created from a first message, copied because
+    // libolm decodes it in place.
+    message     first   = encrypt(outbound, "first", 5);
+    char       *copy    = checked_malloc(first.length);
+    OlmSession *inbound = new_session();
+
+    memcpy(copy, first.message, first.length);
+
+    if (olm_create_inbound_session_from(inbound,
+                                        peer_account,
+                                        id_key,
+                                        id_key_length,
+                                        copy,
+                                        first.length) == olm_error())
+        fail("olm_create_inbound_session_from",
+             olm_session_last_error(inbound));
+
+    free(copy);
+
+    char    *plaintext = random_buffer(length);
+    message *messages  = checked_malloc(ops * sizeof(message));
+    double   started   = now();
+
+    for (long i = 0; i < ops; i++)
+        messages[i] = encrypt(outbound, plaintext, length);
+
+    report("encrypt", ops, started);
+
+    // Like decrypt_message, the cyphertext is copied into a scratch buffer
+    // and the plaintext written into a buffer sized by MAX_PLAINTEXT_LENGTH.
+    size_t max_plaintext = MAX_PLAINTEXT_LENGTH(messages[0].length);
+    char  *scratch       = checked_malloc(messages[0].length);
+    char  *decrypted     = checked_malloc(max_plaintext);
+
+    started = now();
+
+    for (long i = 0; i < ops; i++) {
+        memcpy(scratch, messages[i].message, messages[i].length);
+
+        if (olm_decrypt(inbound,
+                        messages[i].type,
+                        scratch,
+                        messages[i].length,
+                        decrypted,
+                        max_plaintext) == olm_error())
+            fail("olm_decrypt", olm_session_last_error(inbound));
+    }
+
+    report("decrypt", ops, started);
+
+    size_t pickled_length = olm_pickle_session_length(inbound);
+    char  *pickled        = checked_malloc(pickled_length);
+    char  *unpickle_input = checked_malloc(pickled_length);
+
+    started = now();
+
+    for (long i = 0; i < ops; i++)
+        if (olm_pickle_session(inbound, "key", 3, pickled, pickled_length) ==
+            olm_error())
+            fail("olm_pickle_session", olm_session_last_error(inbound));
+
+    report("pickle", ops, started);
+
+    OlmSession *unpickled = new_session();
+
+    started = now();
+
+    for (long i = 0; i < ops; i++) {
+        memcpy(unpickle_input, pickled, pickled_length);
+
+        if (olm_unpickle_session(
+                unpickled, "key", 3, unpickle_input, pickled_length) ==
+            olm_error())
+            fail("olm_unpickle_session", olm_session_last_error(unpickled));
+    }
+
+    report("unpickle", ops, started);
+
+    return 0;
+}
@@ -0,0 +1,441 @@
+#include "olm_common.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/random.h>
+#include <unistd.h>
+
+// Memory
+
+// memset through a volatile pointer, which the compiler has to call, whereas a
+// plain memset of a buffer which is about to be freed or go out of scope can
+// be dropped as a dead store.
+static void *(*volatile wipe_memset)(void *, int, size_t) = memset;
+
+// Clears a buffer which held secrets, such as the random bytes handed to
+// libolm to make keys from.
+void
+wipe(void *buffer, size_t length)
+{
+    wipe_memset(buffer, 0, length);
+}
+
+// Randomness
+
+int
+system_random(uint8_t *buffer, size_t length)
+{
+    while (length > 0) {
+#if defined(__linux__)
+        ssize_t read = getrandom(buffer, length, 0);
+
+        if (read < 0) {
+            if (errno == EINTR) continue;
+            return 0;
+        }
+#else
+        // getentropy hands out at most 256 bytes per call.
+        size_t read = length < 256 ? length : 256;
+        if (getentropy(buffer, read) != 0) return 0;
+#endif
+
+        buffer += read;
+        length -= read;
+    }
+
+    return 1;
+}
+
+// Fills buffer with bytes from the pool, refilling it from the kernel when it
+// runs out. Returns 0 if the kernel couldn't provide them.
+int
+random_pool_take(random_pool *pool, void *buffer, size_t length)
+{
+    uint8_t *output = buffer;
+
+    while (length > 0) {
+        if (pool->available == 0) {
+            if (!system_random(pool->bytes, RANDOM_POOL_SIZE)) return 0;
+            pool->available = RANDOM_POOL_SIZE;
+        }
+
+        uint8_t *start = pool->bytes + RANDOM_POOL_SIZE - pool->available;
+        size_t   taken = length < pool->available ? length : pool->available;
+
+        // Bytes are wiped once handed out so they can't be handed out twice.
+        memcpy(output, start, taken);
+        memset(start, 0, taken);
+
+        pool->available -= taken;
+        output += taken;
+        length -= taken;
+    }
+
+    return 1;
+}
+
+// Hashing
+
+static uint64_t
+read_le64(const uint8_t *bytes)
+{
+    uint64_t value = 0;
+
+    for (int i = 7; i >= 0; i--) value = value << 8 | bytes[i];
+
+    return value;
+}
+
+static uint64_t
+rotate_left(uint64_t value, int bits)
+{
+    return value << bits | value >> (64 - bits);
+}
+
+static void
+sip_round(uint64_t *v)
+{
+    v[0] += v[1];
+    v[1] = rotate_left(v[1], 13) ^ v[0];
+    v[0] = rotate_left(v[0], 32);
+    v[2] += v[3];
+    v[3] = rotate_left(v[3], 16) ^ v[2];
+    v[0] += v[3];
+    v[3] = rotate_left(v[3], 21) ^ v[0];
+    v[2] += v[1];
+    v[1] = rotate_left(v[1], 17) ^ v[2];
+    v[2] = rotate_left(v[2], 32);
+}
+
+static void
+sip_compress(uint64_t *v, uint64_t word)
+{
+    v[3] ^= word;
+    sip_round(v);
+    sip_round(v);
+    v[0] ^= word;
+}
+
+// Hashes data with a key of SIPHASH_KEY_LENGTH bytes.
+uint64_t
+siphash(const uint8_t *key, const uint8_t *data, size_t length)
+{
+    uint64_t k0   = read_le64(key);
+    uint64_t k1   = read_le64(key + 8);
+    uint64_t v[4] = {k0 ^ 0x736f6d6570736575,
+                     k1 ^ 0x646f72616e646f6d,
+                     k0 ^ 0x6c7967656e657261,
+                     k1 ^ 0x7465646279746573};
+    size_t   i    = 0;
+
+    for (; i + 8 <= length; i += 8) sip_compress(v, read_le64(data + i));
+
+    // The last word holds the remaining bytes and the length in its top byte.
+    uint64_t last = (uint64_t)length << 56;
+
+    for (size_t j = 0; i + j < length; j++)
+        last |= (uint64_t)data[i + j] << (8 * j);
+
+    sip_compress(v, last);
+
+    v[2] ^= 0xff;
+    for (int round = 0; round < 4; round++) sip_round(v);
+
+    return v[0] ^ v[1] ^ v[2] ^ v[3];
+}
+
+// Base64
+
+static const char base64_alphabet[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+void
+base64_encode(const uint8_t *input, size_t length, uint8_t *output)
+{
+    size_t i = 0;
+
+    for (; i + 3 <= length; i += 3) {
+        uint32_t group = input[i] << 16 | input[i + 1] << 8 | input[i + 2];
+
+        *output++ = base64_alphabet[group >> 18];
+        *output++ = base64_alphabet[group >> 12 & 0x3f];
+        *output++ = base64_alphabet[group >> 6 & 0x3f];
+        *output++ = base64_alphabet[group & 0x3f];
+    }
+
+    if (length - i == 2) {
+        uint32_t group = input[i] << 16 | input[i + 1] << 8;
+
+        *output++ = base64_alphabet[group >> 18];
+        *output++ = base64_alphabet[group >> 12 & 0x3f];
+        *output++ = base64_alphabet[group >> 6 & 0x3f];
+    } else if (length - i == 1) {
+        uint32_t group = input[i] << 16;
+
+        *output++ = base64_alphabet[group >> 18];
+        *output++ = base64_alphabet[group >> 12 & 0x3f];
+    }
+}
+
+static int
+base64_value(uint8_t c)
+{
+    if (c >= 'A' && c <= 'Z') return c - 'A';
+    if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+    if (c >= '0' && c <= '9') return c - '0' + 52;
+    if (c == '+') return 62;
+    if (c == '/') return 63;
+    return -1;
+}
+
+// Decodes unpadded base64, which may be done in place. Returns 0 if the input
+// isn't valid.
+int
+base64_decode(const uint8_t *input, size_t length, uint8_t *output)
+{
+    if (length % 4 == 1) return 0;
+
+    for (size_t i = 0; i < length; i += 4) {
+        size_t   chunk = length - i < 4 ? length - i : 4;
+        uint32_t group = 0;
+
+        for (size_t j = 0; j < 4; j++) {
+            int value = j < chunk ? base64_value(input[i + j]) : 0;
+            if (value < 0) return 0;
+            group = group << 6 | value;
+        }
+
+        *output++ = group >> 16;
+        if (chunk > 2) *output++ = group >> 8;
+        if (chunk > 3) *output++ = group;
+    }
+
+    return 1;
+}
+
+// Pre key messages
+
+static const uint8_t *
+read_varint(const uint8_t *position, const uint8_t *end, uint64_t *value)
+{
+    *value = 0;
+
+    for (int shift = 0; position != end && shift < 64; shift += 7) {
+        uint8_t byte = *position++;
+
+        *value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return position;
+    }
+
+    return NULL;
+}
+
+// Reads the keys out of a decoded pre key message into id, in the order one
+// time key, base key, identity key. Fields are read the way libolm reads
+// them, skipping unknown ones. Returns 0 if any of the keys is missing.
+int
+read_pre_key_id(const uint8_t *message, size_t length, uint8_t *id)
+{
+    const uint8_t *position = message;
+    const uint8_t *end      = message + length;
+    int            found    = 0;
+
+    if (position == end || *position++ != PRE_KEY_MESSAGE_VERSION) return 0;
+
+    while (position != end && found != 7) {
+        uint64_t tag, size;
+
+        if (!(position = read_varint(position, end, &tag))) return 0;
+
+        switch (tag & 7) {
+        case 0:
+            if (!(position = read_varint(position, end, &size))) return 0;
+            continue;
+        case 2:
+            if (!(position = read_varint(position, end, &size))) return 0;
+            if (size > (uint64_t)(end - position)) return 0;
+            break;
+        default:
+            return 0;
+        }
+
+        // Tags 0x0a, 0x12 and 0x1a are fields 1 to 3.
+        uint64_t field = (tag >> 3) - 1;
+
+        if (field < 3) {
+            if (size != CURVE25519_KEY_LENGTH) return 0;
+
+            memcpy(id + field * CURVE25519_KEY_LENGTH, position, size);
+            found |= 1 << field;
+        }
+
+        position += size;
+    }
+
+    return found == 7;
+}
+
+// Reads the keys out of a base64 pre key message. Only the start of the
+// message is decoded, unless the keys aren't all in it.
+int
+parse_pre_key_id(const uint8_t *message, size_t length, uint8_t *id)
+{
+    uint8_t prefix[BASE64_DECODED_LENGTH(PRE_KEY_PREFIX_LENGTH)];
+
+    if (length > PRE_KEY_PREFIX_LENGTH) {
+        if (base64_decode(message, PRE_KEY_PREFIX_LENGTH, prefix) &&
+            read_pre_key_id(prefix, sizeof(prefix), id))
+            return 1;
+    }
+
+    size_t   decoded_length = BASE64_DECODED_LENGTH(length);
+    uint8_t *decoded        = decoded_length <= sizeof(prefix)
+                                  ? prefix
+                                  : common_alloc(decoded_length);
+    int      parsed         = base64_decode(message, length, decoded) &&
+                 read_pre_key_id(decoded, decoded_length, id);
+
+    if (decoded != prefix) common_free(decoded);
+
+    return parsed;
+}
+
+// Messages
+
+// Reads the ratchet key and chain index out of a decoded message of the given
+// length, of which only the first `available` bytes may be at hand. The MAC
+// at the end of the message isn't read as fields. Returns 0 if either is
+// missing.
+int
+read_message_header(const uint8_t  *message,
+                    size_t          length,
+                    size_t          available,
+                    message_header *header)
+{
+    if (length <= MESSAGE_MAC_LENGTH) return 0;
+    if (available > length - MESSAGE_MAC_LENGTH)
+        available = length - MESSAGE_MAC_LENGTH;
+
+    const uint8_t *position = message;
+    const uint8_t *end      = message + available;
+    int            found    = 0;
+
+    if (position == end || *position++ != MESSAGE_VERSION) return 0;
+
+    // The ratchet key is field 1 and the chain index field 2. The cyphertext
+    // after them is never reached unless they're missing.
+    while (position != end && found != 3) {
+        uint64_t tag, value;
+
+        if (!(position = read_varint(position, end, &tag))) return 0;
+        if (!(position = read_varint(position, end, &value))) return 0;
+
+        switch (tag & 7) {
+        case 0:
+            if (tag >> 3 == 2) {
+                header->chain_index = value;
+                found |= 2;
+            }
+            continue;
+        case 2:
+            if (value > (uint64_t)(end - position)) return 0;
+            break;
+        default:
+            return 0;
+        }
+
+        if (tag >> 3 == 1) {
+            if (value != CURVE25519_KEY_LENGTH) return 0;
+
+            memcpy(header->ratchet_key, position, value);
+            found |= 1;
+        }
+
+        position += value;
+    }
+
+    return found == 3;
+}
+
+// Reads the keys of a decoded pre key message and the header of the message
+// inside it, like read_message_header. The inner message is the last field
+// libolm writes, so it usually runs on past the bytes at hand.
+int
+read_pre_key_message_header(const uint8_t  *message,
+                            size_t          length,
+                            size_t          available,
+                            message_header *header)
+{
+    if (!read_pre_key_id(message, available, header->pre_key_id)) return 0;
+
+    const uint8_t *position = message + 1;
+    const uint8_t *end      = message + available;
+
+    while (position != end) {
+        uint64_t tag, value;
+
+        if (!(position = read_varint(position, end, &tag))) return 0;
+        if (!(position = read_varint(position, end, &value))) return 0;
+
+        if ((tag & 7) == 0) continue;
+        if ((tag & 7) != 2) return 0;
+
+        size_t offset = position - message;
+
+        if (tag >> 3 == 4) {
+            if (value > length - offset) return 0;
+
+            return read_message_header(
+                position, value, available - offset, header);
+        }
+
+        if (value > (uint64_t)(end - position)) return 0;
+        position += value;
+    }
+
+    return 0;
+}
+
+static int
+read_header(int             type,
+            const uint8_t  *message,
+            size_t          length,
+            size_t          available,
+            message_header *header)
+{
+    if (type == MESSAGE_TYPE_PRE_KEY)
+        return read_pre_key_message_header(message, length, available, header);
+
+    return read_message_header(message, length, available, header);
+}
+
+// Reads the header of a base64 message. Only the start of the message is
+// decoded, unless the header isn't all in it.
+int
+parse_message_header(int             type,
+                     const uint8_t  *message,
+                     size_t          length,
+                     message_header *header)
+{
+    uint8_t prefix[BASE64_DECODED_LENGTH(MESSAGE_PREFIX_LENGTH)];
+    size_t  decoded_length = BASE64_DECODED_LENGTH(length);
+
+    if (length % 4 == 1) return 0;
+
+    if (length > MESSAGE_PREFIX_LENGTH) {
+        if (base64_decode(message, MESSAGE_PREFIX_LENGTH, prefix) &&
+            read_header(type, prefix, decoded_length, sizeof(prefix), header))
+            return 1;
+    }
+
+    uint8_t *decoded = decoded_length <= sizeof(prefix)
+                           ? prefix
+                           : common_alloc(decoded_length);
+    int      parsed  = base64_decode(message, length, decoded) &&
+                 read_header(
+                     type, decoded, decoded_length, decoded_length, header);
+
+    if (decoded != prefix) common_free(decoded);
+
+    return parsed;
+}
@@ -0,0 +1,115 @@
+// Helpers shared by the NIF and the native benchmark and fuzzer, which don't
+// depend on the BEAM: the random pool, hashing, base64, and reading message
+// headers. Each program is built with olm_common.c, see the Makefile.
+
+#ifndef OLM_COMMON_H
+#define OLM_COMMON_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Memory
+
+// Every program provides its own allocator for the helpers which need one:
+// the NIF enif_alloc, the native drivers malloc.
+void *common_alloc(size_t size);
+void  common_free(void *memory);
+
+void wipe(void *buffer, size_t length);
+
+// Randomness
+
+#define RANDOM_POOL_SIZE 4096
+
+// Random bytes handed out from a buffer which is refilled from the kernel in
+// one go, instead of making a syscall for every call.
+typedef struct {
+    size_t  available;
+    uint8_t bytes[RANDOM_POOL_SIZE];
+} random_pool;
+
+int system_random(uint8_t *buffer, size_t length);
+int random_pool_take(random_pool *pool, void *buffer, size_t length);
+
+// Hashing
+//
+// SipHash-2-4, for hash tables keyed by bytes a peer chooses. Without the
+// secret key they can't pick inputs which collide.
+
+#define SIPHASH_KEY_LENGTH 16
+
+uint64_t siphash(const uint8_t *key, const uint8_t *data, size_t length);
+
+// Base64
+//
+// libolm pickles to unpadded base64. The raw pickle format stores the decoded
+// bytes instead, which are a quarter smaller.
+
+#define BASE64_ENCODED_LENGTH(length) (((length) * 4 + 2) / 3)
+#define BASE64_DECODED_LENGTH(length) ((length) * 3 / 4)
+
+void base64_encode(const uint8_t *input, size_t length, uint8_t *output);
+int  base64_decode(const uint8_t *input, size_t length, uint8_t *output);
+
+// Pre key messages
+//
+// A pre key message names the keys its session was created with: the
+// receiver's one time key, the sender's base key and the sender's identity
+// key. Together they identify the inbound session the message belongs to,
+// which is what olm_matches_inbound_session compares. They're read straight
+// out of the message so the session index can find that session by them.
+
+#define PRE_KEY_MESSAGE_VERSION 3
+#define CURVE25519_KEY_LENGTH   32
+#define PRE_KEY_ID_LENGTH       (3 * CURVE25519_KEY_LENGTH)
+
+// libolm writes the three keys right after the version byte, in front of the
+// inner message, so they're found in the first bytes of the message.
+#define PRE_KEY_PREFIX_LENGTH 140
+
+int read_pre_key_id(const uint8_t *message, size_t length, uint8_t *id);
+int parse_pre_key_id(const uint8_t *message, size_t length, uint8_t *id);
+
+// Messages
+//
+// Reads the header of a message without decrypting it or touching a session:
+// the ratchet key and chain index every message carries, and for a pre key
+// message the keys it names as well. Only the start of the message is
+// decoded, and nothing past the header is checked, so a message which reads
+// fine here can still fail to decrypt.
+
+#define MESSAGE_VERSION    3
+#define MESSAGE_MAC_LENGTH 8
+
+// The types encrypt_message returns.
+#define MESSAGE_TYPE_PRE_KEY 0
+#define MESSAGE_TYPE_NORMAL  1
+
+// Comfortably holds the keys of a pre key message and the header of the
+// message inside it.
+#define MESSAGE_PREFIX_LENGTH 256
+
+// Upper bound of the plaintext length for a base64 encoded message. The
+// decoded message is never shorter than the plaintext inside it.
+#define MAX_PLAINTEXT_LENGTH(length) ((length) / 4 * 3 + 3)
+
+typedef struct {
+    uint8_t  ratchet_key[CURVE25519_KEY_LENGTH];
+    uint64_t chain_index;
+    uint8_t  pre_key_id[PRE_KEY_ID_LENGTH];
+} message_header;
+
+int read_message_header(const uint8_t  *message,
+                        size_t          length,
+                        size_t          available,
+                        message_header *header);
+int read_pre_key_message_header(const uint8_t  *message,
+                                size_t          length,
+                                size_t          available,
+                                message_header *header);
+int parse_message_header(int             type,
+                         const uint8_t  *message,
+                         size_t          length,
+                         message_header *header);
+
+#endif
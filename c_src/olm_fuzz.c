@@ -0,0 +1,349 @@
+// libFuzzer harness for the inputs the session NIFs hand straight to libolm's
+// parsers, messages to decrypt and pickles to load, and for the NIF's own
+// message header readers in olm_common.c.
+//
+//     make fuzz
+//     ./priv/native/olm_fuzz -max_total_time=600 corpus/
+//
+// The first byte of each input picks the target, the rest is the payload:
+//
+//   0, 1  decrypt_message as a pre key (0) or normal (1) message
+//   2     unpickle_session with a base64 pickle
+//   3     unpickle_session_raw, which base64 encodes the payload first
+//   4, 5  inspect_message as a pre key (4) or normal (5) message, base64
+//         encoded first
+//   6     the session index reading the keys of a pre key message, base64
+//         encoded first
+//   7     both header readers on the payload as is, which is rarely valid
+//         base64
+
+#include "olm_common.h"
+
+#include <olm/olm.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Setup
+
+void *
+common_alloc(size_t size)
+{
+    return malloc(size);
+}
+
+void
+common_free(void *memory)
+{
+    free(memory);
+}
+
+static const char pickle_key[] = "key";
+
+// A pickle of an inbound session created from a pre key message. Every input
+// is decrypted by a fresh copy, so inputs can't affect each other.
+static char  *session_pickle;
+static size_t session_pickle_length;
+
+static void
+check(size_t result, const char *what, const char *error)
+{
+    if (result != olm_error()) return;
+
+    fprintf(stderr, "%s failed: %s\n", what, error);
+    abort();
+}
+
+// The fuzzer has to be reproducible, so setup uses a fixed seed instead of
+// real randomness.
+static void *
+fixed_random(size_t length, uint8_t seed)
+{
+    uint8_t *random = malloc(length ? length : 1);
+
+    for (size_t i = 0; i < length; i++)
+        random[i] = (uint8_t)(seed + i * 31);
+
+    return random;
+}
+
+// Returns the nth string in a JSON document.
+static const char *
+json_string(const char *json, int n, size_t *length)
+{
+    for (int i = 0; i <= n; i++) {
+        json = strchr(json, '"') + 1;
+
+        const char *end = strchr(json, '"');
+
+        if (i == n) {
+            *length = end - json;
+            return json;
+        }
+
+        json = end + 1;
+    }
+
+    return NULL;
+}
+
+static OlmAccount *
+create_account(uint8_t seed, char **keys)
+{
+    OlmAccount *account     = olm_account(malloc(olm_account_size()));
+    size_t      rand_length = olm_create_account_random_length(account);
+    void       *random      = fixed_random(rand_length, seed);
+
+    check(olm_create_account(account, random, rand_length),
+          "olm_create_account",
+          olm_account_last_error(account));
+    free(random);
+
+    size_t length = olm_account_identity_keys_length(account);
+
+    *keys = calloc(length + 1, 1);
+    check(olm_account_identity_keys(account, *keys, length),
+          "olm_account_identity_keys",
+          olm_account_last_error(account));
+
+    return account;
+}
+
+static void
+setup(void)
+{
+    char       *keys, *peer_keys;
+    OlmAccount *account      = create_account(1, &keys);
+    OlmAccount *peer_account = create_account(2, &peer_keys);
+
+    size_t rand_length =
+        olm_account_generate_one_time_keys_random_length(peer_account, 1);
+    void *random = fixed_random(rand_length, 3);
+
+    check(olm_account_generate_one_time_keys(
+              peer_account, 1, random, rand_length),
+          "olm_account_generate_one_time_keys",
+          olm_account_last_error(peer_account));
+    free(random);
+
+    size_t otks_length = olm_account_one_time_keys_length(peer_account);
+    char  *otks        = calloc(otks_length + 1, 1);
+
+    check(olm_account_one_time_keys(peer_account, otks, otks_length),
+          "olm_account_one_time_keys",
+          olm_account_last_error(peer_account));
+
+    size_t      id_key_length, peer_id_key_length, otk_length;
+    const char *id_key      = json_string(keys, 1, &id_key_length);
+    const char *peer_id_key = json_string(peer_keys, 1, &peer_id_key_length);
+    const char *otk         = json_string(otks, 2, &otk_length);
+
+    OlmSession *outbound = olm_session(malloc(olm_session_size()));
+
+    rand_length = olm_create_outbound_session_random_length(outbound);
+    random      = fixed_random(rand_length, 4);
+    check(olm_create_outbound_session(outbound,
+                                      account,
+                                      peer_id_key,
+                                      peer_id_key_length,
+                                      otk,
+                                      otk_length,
+                                      random,
+                                      rand_length),
+          "olm_create_outbound_session",
+          olm_session_last_error(outbound));
+    free(random);
+
+    rand_length           = olm_encrypt_random_length(outbound);
+    random                = fixed_random(rand_length, 5);
+    size_t message_length = olm_encrypt_message_length(outbound, 5);
+    char  *message        = malloc(message_length);
+
+    check(olm_encrypt(outbound,
+                      "first",
+                      5,
+                      random,
+                      rand_length,
+                      message,
+                      message_length),
+          "olm_encrypt",
+          olm_session_last_error(outbound));
+    free(random);
+
+    OlmSession *inbound = olm_session(malloc(olm_session_size()));
+
+    check(olm_create_inbound_session_from(inbound,
+                                          peer_account,
+                                          id_key,
+                                          id_key_length,
+                                          message,
+                                          message_length),
+          "olm_create_inbound_session_from",
+          olm_session_last_error(inbound));
+
+    session_pickle_length = olm_pickle_session_length(inbound);
+    session_pickle        = malloc(session_pickle_length);
+    check(olm_pickle_session(inbound,
+                             pickle_key,
+                             sizeof(pickle_key) - 1,
+                             session_pickle,
+                             session_pickle_length),
+          "olm_pickle_session",
+          olm_session_last_error(inbound));
+
+    free(message);
+    free(otks);
+    free(keys);
+    free(peer_keys);
+    olm_clear_session(inbound);
+    free(inbound);
+    olm_clear_session(outbound);
+    free(outbound);
+    olm_clear_account(account);
+    free(account);
+    olm_clear_account(peer_account);
+    free(peer_account);
+}
+
+// Targets
+
+static void
+fuzz_decrypt(size_t type, const uint8_t *data, size_t size)
+{
+    OlmSession *session = olm_session(malloc(olm_session_size()));
+    char       *pickle  = malloc(session_pickle_length);
+
+    memcpy(pickle, session_pickle, session_pickle_length);
+    check(olm_unpickle_session(session,
+                               pickle_key,
+                               sizeof(pickle_key) - 1,
+                               pickle,
+                               session_pickle_length),
+          "olm_unpickle_session",
+          olm_session_last_error(session));
+
+    // The same buffers decrypt_message uses: a copy of the message, and room
+    // for MAX_PLAINTEXT_LENGTH bytes of plaintext.
+    uint8_t *message   = malloc(size ? size : 1);
+    size_t   max       = MAX_PLAINTEXT_LENGTH(size);
+    uint8_t *plaintext = malloc(max);
+
+    memcpy(message, data, size);
+    olm_decrypt(session, type, message, size, plaintext, max);
+
+    free(plaintext);
+    free(message);
+    free(pickle);
+    olm_clear_session(session);
+    free(session);
+}
+
+static void
+fuzz_unpickle(const uint8_t *data, size_t size)
+{
+    OlmSession *session = olm_session(malloc(olm_session_size()));
+    uint8_t    *pickle  = malloc(size ? size : 1);
+
+    memcpy(pickle, data, size);
+    olm_unpickle_session(
+        session, pickle_key, sizeof(pickle_key) - 1, pickle, size);
+
+    free(pickle);
+    olm_clear_session(session);
+    free(session);
+}
+
+// Mirrors unpickle_session_raw, which re-encodes the raw pickle as unpadded
+// base64 before handing it to libolm.
+static void
+fuzz_unpickle_raw(const uint8_t *data, size_t size)
+{
+    uint8_t *encoded = malloc(BASE64_ENCODED_LENGTH(size) + 1);
+
+    base64_encode(data, size, encoded);
+    fuzz_unpickle(encoded, BASE64_ENCODED_LENGTH(size));
+    free(encoded);
+}
+
+// Runs parse_message_header like inspect_message. A pre key message's keys
+// must read the same as parse_pre_key_id reads them for the session index.
+static void
+fuzz_message_header(int type, const uint8_t *message, size_t length)
+{
+    message_header header;
+    uint8_t        id[PRE_KEY_ID_LENGTH];
+
+    if (!parse_message_header(type, message, length, &header)) return;
+    if (type != MESSAGE_TYPE_PRE_KEY) return;
+
+    if (!parse_pre_key_id(message, length, id) ||
+        memcmp(id, header.pre_key_id, PRE_KEY_ID_LENGTH) != 0) {
+        fprintf(stderr, "parse_pre_key_id disagrees with the header\n");
+        abort();
+    }
+}
+
+static void
+fuzz_pre_key_id(const uint8_t *message, size_t length)
+{
+    uint8_t id[PRE_KEY_ID_LENGTH];
+
+    parse_pre_key_id(message, length, id);
+}
+
+// The header readers are handed base64, and most of what a fuzzer makes up
+// isn't, so payloads are encoded first to reach the readers behind it.
+static void
+fuzz_encoded(int target, const uint8_t *data, size_t size)
+{
+    uint8_t *encoded = malloc(BASE64_ENCODED_LENGTH(size) + 1);
+    size_t   length  = BASE64_ENCODED_LENGTH(size);
+
+    base64_encode(data, size, encoded);
+
+    if (target == 6)
+        fuzz_pre_key_id(encoded, length);
+    else
+        fuzz_message_header(target - 4, encoded, length);
+
+    free(encoded);
+}
+
+int
+LLVMFuzzerInitialize(int *argc, char ***argv)
+{
+    setup();
+    return 0;
+}
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    if (size == 0) return 0;
+
+    switch (data[0] % 8) {
+    case 0:
+    case 1:
+        fuzz_decrypt(data[0] % 4, data + 1, size - 1);
+        break;
+    case 2:
+        fuzz_unpickle(data + 1, size - 1);
+        break;
+    case 3:
+        fuzz_unpickle_raw(data + 1, size - 1);
+        break;
+    case 4:
+    case 5:
+    case 6:
+        fuzz_encoded(data[0] % 8, data + 1, size - 1);
+        break;
+    case 7:
+        fuzz_message_header(MESSAGE_TYPE_PRE_KEY, data + 1, size - 1);
+        fuzz_message_header(MESSAGE_TYPE_NORMAL, data + 1, size - 1);
+        fuzz_pre_key_id(data + 1, size - 1);
+        break;
+    }
+
+    return 0;
+}
@@ -1,22 +1,749 @@
+#include "olm_common.h"
+
+#include <ctype.h>
 #include <erl_nif.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <olm/olm.h>
+#include <sched.h>
+#include <stdio.h>
 #include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Memory
+//
+// The helpers in olm_common.c allocate from the BEAM like the rest of the NIF.
+
+void *
+common_alloc(size_t size)
+{
+    return enif_alloc(size);
+}
+
+void
+common_free(void *memory)
+{
+    enif_free(memory);
+}
+
+// Atoms
+//
+// Every atom a NIF returns is made once, in nif_load. libolm's errors are
+// returned as lower case atoms named after the error code, such as
+// bad_message_mac.
+
+// Comfortably more than the number of error codes libolm defines.
+#define ERROR_ATOM_COUNT 32
+
+static ERL_NIF_TERM atom_ok;
+static ERL_NIF_TERM atom_error;
+static ERL_NIF_TERM atom_true;
+static ERL_NIF_TERM atom_false;
+static ERL_NIF_TERM atom_curve25519;
+static ERL_NIF_TERM atom_ed25519;
+static ERL_NIF_TERM atom_unknown_error;
+static ERL_NIF_TERM atom_not_inbound;
+static ERL_NIF_TERM atom_not_found;
+static ERL_NIF_TERM atom_unchanged;
+static ERL_NIF_TERM atom_closed;
+static ERL_NIF_TERM atom_bad_journal;
+static ERL_NIF_TERM atom_sessions;
+static ERL_NIF_TERM atom_live_bytes;
+static ERL_NIF_TERM atom_file_bytes;
+static ERL_NIF_TERM atom_errno;
+static ERL_NIF_TERM error_atoms[ERROR_ATOM_COUNT];
+
+// File errors are returned named like :file's. Anything else is returned as
+// {:errno, code}.
+static const struct {
+    int         code;
+    const char *name;
+} errno_names[] = {
+    {EIO, "eio"},
+    {EACCES, "eacces"},
+    {EAGAIN, "eagain"},
+    {EDQUOT, "edquot"},
+    {EISDIR, "eisdir"},
+    {EMFILE, "emfile"},
+    {ENOENT, "enoent"},
+    {ENOSPC, "enospc"},
+    {ENOTDIR, "enotdir"},
+    {EROFS, "erofs"},
+    {ENOMEM, "enomem"},
+};
+
+#define ERRNO_ATOM_COUNT (sizeof(errno_names) / sizeof(errno_names[0]))
+
+static ERL_NIF_TERM errno_atoms[ERRNO_ATOM_COUNT];
+
+static void
+make_atoms(ErlNifEnv *env)
+{
+    atom_ok            = enif_make_atom(env, "ok");
+    atom_error         = enif_make_atom(env, "error");
+    atom_true          = enif_make_atom(env, "true");
+    atom_false         = enif_make_atom(env, "false");
+    atom_curve25519    = enif_make_atom(env, "curve25519");
+    atom_ed25519       = enif_make_atom(env, "ed25519");
+    atom_unknown_error = enif_make_atom(env, "unknown_error");
+    atom_not_inbound   = enif_make_atom(env, "not_inbound");
+    atom_not_found     = enif_make_atom(env, "not_found");
+    atom_unchanged     = enif_make_atom(env, "unchanged");
+    atom_closed        = enif_make_atom(env, "closed");
+    atom_bad_journal   = enif_make_atom(env, "bad_journal");
+    atom_sessions      = enif_make_atom(env, "sessions");
+    atom_live_bytes    = enif_make_atom(env, "live_bytes");
+    atom_file_bytes    = enif_make_atom(env, "file_bytes");
+    atom_errno         = enif_make_atom(env, "errno");
+
+    for (size_t i = 0; i < ERRNO_ATOM_COUNT; i++)
+        errno_atoms[i] = enif_make_atom(env, errno_names[i].name);
+
+    for (int code = 0; code < ERROR_ATOM_COUNT; code++) {
+        const char *name = _olm_error_to_string(code);
+        char        lower_name[64];
+        size_t      i;
+
+        for (i = 0; name[i] != '\0' && i < sizeof(lower_name) - 1; i++)
+            lower_name[i] = tolower((unsigned char)name[i]);
+
+        lower_name[i]     = '\0';
+        error_atoms[code] = enif_make_atom(env, lower_name);
+    }
+}
+
+// Stats
+//
+// The NIFs count calls, bytes in and out for each kind of crypto operation,
+// and errors by code. Every thread counts into its own slots, which no other
+// thread writes to and which start on a cache line of their own, so counting
+// never contends. stats/0 adds up the slots of every thread.
+
+#define CACHE_LINE_SIZE 64
+
+typedef enum
+{
+    STATS_ENCRYPT,
+    STATS_DECRYPT,
+    STATS_GROUP_ENCRYPT,
+    STATS_GROUP_DECRYPT,
+    STATS_SIGN,
+    STATS_VERIFY,
+    STATS_SHA256,
+    STATS_PICKLE,
+    STATS_UNPICKLE,
+    STATS_OPERATION_COUNT
+} stats_operation;
+
+static const char *stats_operation_names[STATS_OPERATION_COUNT] = {
+    "encrypt",
+    "decrypt",
+    "group_encrypt",
+    "group_decrypt",
+    "sign",
+    "verify",
+    "sha256",
+    "pickle",
+    "unpickle",
+};
+
+typedef struct {
+    uint64_t calls;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+} stats_counters;
+
+typedef struct thread_stats {
+    stats_counters       operations[STATS_OPERATION_COUNT];
+    uint64_t             errors[ERROR_ATOM_COUNT];
+    struct thread_stats *next;
+} thread_stats;
+
+static ErlNifTSDKey  stats_key;
+static ErlNifMutex  *stats_lock;
+static thread_stats *all_stats;
+
+static ERL_NIF_TERM atom_calls;
+static ERL_NIF_TERM atom_bytes_in;
+static ERL_NIF_TERM atom_bytes_out;
+static ERL_NIF_TERM atom_errors;
+static ERL_NIF_TERM stats_operation_atoms[STATS_OPERATION_COUNT];
+
+static int
+stats_init(ErlNifEnv *env)
+{
+    if (enif_tsd_key_create("olm_stats", &stats_key) != 0) return 0;
+
+    stats_lock = enif_mutex_create("olm_stats");
+    if (stats_lock == NULL) return 0;
+
+    atom_calls     = enif_make_atom(env, "calls");
+    atom_bytes_in  = enif_make_atom(env, "bytes_in");
+    atom_bytes_out = enif_make_atom(env, "bytes_out");
+    atom_errors    = enif_make_atom(env, "errors");
+
+    for (int i = 0; i < STATS_OPERATION_COUNT; i++)
+        stats_operation_atoms[i] =
+            enif_make_atom(env, stats_operation_names[i]);
+
+    return 1;
+}
+
+// Returns the calling thread's slots, setting them up on first use. Slots are
+// never freed, like the threads they belong to.
+static thread_stats *
+current_stats(void)
+{
+    thread_stats *stats = enif_tsd_get(stats_key);
+    if (stats != NULL) return stats;
+
+    uint8_t  *memory  = enif_alloc(sizeof(thread_stats) + CACHE_LINE_SIZE);
+    uintptr_t aligned = ((uintptr_t) memory + CACHE_LINE_SIZE - 1) &
+                        ~(uintptr_t) (CACHE_LINE_SIZE - 1);
+
+    stats = (thread_stats *) aligned;
+    memset(stats, 0, sizeof(thread_stats));
+
+    enif_mutex_lock(stats_lock);
+    stats->next = all_stats;
+    all_stats   = stats;
+    enif_mutex_unlock(stats_lock);
+
+    enif_tsd_set(stats_key, stats);
+
+    return stats;
+}
+
+// Only the owning thread writes a counter, so a relaxed load and store is
+// enough and stats/0 never reads a torn value.
+static void
+stats_add(uint64_t *counter, uint64_t amount)
+{
+    __atomic_store_n(counter,
+                     __atomic_load_n(counter, __ATOMIC_RELAXED) + amount,
+                     __ATOMIC_RELAXED);
+}
+
+static void
+count_operation(stats_operation operation, size_t bytes_in, size_t bytes_out)
+{
+    stats_counters *counters = &current_stats()->operations[operation];
+
+    stats_add(&counters->calls, 1);
+    stats_add(&counters->bytes_in, bytes_in);
+    stats_add(&counters->bytes_out, bytes_out);
+}
+
+static void
+count_error(enum OlmErrorCode code)
+{
+    if (code < ERROR_ATOM_COUNT) stats_add(&current_stats()->errors[code], 1);
+}
+
+static ERL_NIF_TERM
+stats(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    stats_counters operations[STATS_OPERATION_COUNT] = {{0}};
+    uint64_t       errors[ERROR_ATOM_COUNT]          = {0};
+
+    enif_mutex_lock(stats_lock);
+
+    thread_stats *thread;
+
+    for (thread = all_stats; thread != NULL; thread = thread->next) {
+        for (int i = 0; i < STATS_OPERATION_COUNT; i++) {
+            stats_counters *counters = &thread->operations[i];
+
+            operations[i].calls +=
+                __atomic_load_n(&counters->calls, __ATOMIC_RELAXED);
+            operations[i].bytes_in +=
+                __atomic_load_n(&counters->bytes_in, __ATOMIC_RELAXED);
+            operations[i].bytes_out +=
+                __atomic_load_n(&counters->bytes_out, __ATOMIC_RELAXED);
+        }
+
+        for (int code = 0; code < ERROR_ATOM_COUNT; code++)
+            errors[code] +=
+                __atomic_load_n(&thread->errors[code], __ATOMIC_RELAXED);
+    }
+
+    enif_mutex_unlock(stats_lock);
+
+    ERL_NIF_TERM result       = enif_make_new_map(env);
+    ERL_NIF_TERM error_counts = enif_make_new_map(env);
+
+    for (int i = 0; i < STATS_OPERATION_COUNT; i++) {
+        stats_counters *totals = &operations[i];
+
+        ERL_NIF_TERM keys[]   = {atom_calls, atom_bytes_in, atom_bytes_out};
+        ERL_NIF_TERM values[] = {enif_make_uint64(env, totals->calls),
+                                 enif_make_uint64(env, totals->bytes_in),
+                                 enif_make_uint64(env, totals->bytes_out)};
+        ERL_NIF_TERM counters;
+
+        enif_make_map_from_arrays(env, keys, values, 3, &counters);
+        enif_make_map_put(
+            env, result, stats_operation_atoms[i], counters, &result);
+    }
+
+    // Only errors which have happened are listed.
+    for (int code = 0; code < ERROR_ATOM_COUNT; code++) {
+        if (errors[code] == 0) continue;
+
+        enif_make_map_put(env,
+                          error_counts,
+                          error_atoms[code],
+                          enif_make_uint64(env, errors[code]),
+                          &error_counts);
+    }
+
+    enif_make_map_put(env, result, atom_errors, error_counts, &result);
+
+    return enif_make_tuple2(env, atom_ok, result);
+}
+
+// Errors
+
+// Returns the atom for an error code, and counts the error in the stats.
+static ERL_NIF_TERM
+error_reason(enum OlmErrorCode code)
+{
+    count_error(code);
+
+    return code < ERROR_ATOM_COUNT ? error_atoms[code] : atom_unknown_error;
+}
+
+// Returns {:error, reason}.
+static ERL_NIF_TERM
+make_error(ErlNifEnv *env, enum OlmErrorCode code)
+{
+    return enif_make_tuple2(env, atom_error, error_reason(code));
+}
+
+// Returns {:error, reason} for an errno value.
+static ERL_NIF_TERM
+make_errno_error(ErlNifEnv *env, int code)
+{
+    for (size_t i = 0; i < ERRNO_ATOM_COUNT; i++)
+        if (errno_names[i].code == code)
+            return enif_make_tuple2(env, atom_error, errno_atoms[i]);
+
+    return enif_make_tuple2(
+        env,
+        atom_error,
+        enif_make_tuple2(env, atom_errno, enif_make_int(env, code)));
+}
+
+// Randomness
+
+// Every scheduler thread keeps a pool of random bytes which is refilled from
+// the kernel in one go, instead of making a syscall for each NIF call.
+static ErlNifTSDKey random_pool_key;
+static int          random_pool_enabled = 1;
+
+// Fills buffer with cryptographically secure random bytes. Returns 0 if the
+// kernel couldn't provide them, with whatever was filled in wiped.
+static int
+random_bytes(void *buffer, size_t length)
+{
+    random_pool *pool = NULL;
+
+    if (random_pool_enabled && length < RANDOM_POOL_SIZE) {
+        pool = enif_tsd_get(random_pool_key);
+
+        if (pool == NULL) {
+            pool            = enif_alloc(sizeof(random_pool));
+            pool->available = 0;
+            enif_tsd_set(random_pool_key, pool);
+        }
+    }
+
+    int filled = pool ? random_pool_take(pool, buffer, length)
+                      : system_random(buffer, length);
+
+    if (!filled) wipe(buffer, length);
+
+    return filled;
+}
+
+// Generations
+//
+// Every account and session starts at a generation of its own, so one read
+// from another resource, or from before the library was loaded, practically
+// never matches it. Starting generations are spread over 63 bits by mixing a
+// counter seeded at load, and are never 0, which stands for never pickled.
+static uint64_t generation_counter;
+
+static uint64_t
+new_generation(void)
+{
+    uint64_t z = __atomic_add_fetch(&generation_counter, 1, __ATOMIC_RELAXED);
+
+    // The splitmix64 finalizer, which is a bijection.
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    z ^= z >> 31;
+
+    return (z >> 1) + 1;
+}
+
+// Scratch buffers
+//
+// libolm decodes base64 arguments in place, so arguments it would destroy are
+// copied first. Small ones are copied onto the stack rather than the heap.
+
+#define SCRATCH_STACK_SIZE 2048
+
+typedef struct {
+    uint8_t *data;
+    size_t   size;
+    uint8_t  stack[SCRATCH_STACK_SIZE];
+} scratch_buffer;
+
+static void
+scratch_copy(scratch_buffer *scratch, const ErlNifBinary *input)
+{
+    scratch->size = input->size;
+    scratch->data = input->size <= SCRATCH_STACK_SIZE
+                        ? scratch->stack
+                        : enif_alloc(input->size);
+
+    memcpy(scratch->data, input->data, input->size);
+}
+
+static void
+scratch_release(scratch_buffer *scratch)
+{
+    if (scratch->data != scratch->stack) enif_free(scratch->data);
+}
 
 // Resource setup
+//
+// Every resource is a handle holding a lock next to the libolm object, which
+// lives in the same allocation right after the handle. Each NIF holds the
+// lock while it calls into libolm, so a resource can be shared between
+// processes. When an account and a session are both locked, the account is
+// locked first.
 
 static ErlNifResourceType *account_resource;
 static ErlNifResourceType *session_resource;
+static ErlNifResourceType *outbound_group_session_resource;
+static ErlNifResourceType *inbound_group_session_resource;
+static ErlNifResourceType *session_index_resource;
+static ErlNifResourceType *journal_resource;
+
+// Utilities keep no state between calls, so each thread sets one up once and
+// reuses it, see thread_utility.
+static ErlNifTSDKey utility_key;
+
+// Both identity keys are unpadded base64 of 32 bytes.
+#define IDENTITY_KEY_LENGTH 43
+
+typedef struct {
+    ErlNifMutex *lock;
+    OlmAccount  *olm;
+
+    // Identity keys never change once the account exists, so they're parsed
+    // out of libolm's JSON the first time they're asked for and kept here.
+    int     has_identity_keys;
+    uint8_t curve25519_key[IDENTITY_KEY_LENGTH];
+    uint8_t ed25519_key[IDENTITY_KEY_LENGTH];
+
+    // Bumped by every call which changes what a pickle of the account holds,
+    // under the lock, so a caller can tell whether it needs pickling again.
+    uint64_t generation;
+} account_handle;
+
+typedef struct {
+    ErlNifMutex *lock;
+    OlmSession  *olm;
+
+    // Bumped whenever the ratchet moves, like account_handle's generation.
+    uint64_t generation;
+
+    // The keys of the pre key messages an inbound session receives, read from
+    // the message that created it, see session_index_handle.
+    int     has_pre_key_id;
+    uint8_t pre_key_id[PRE_KEY_ID_LENGTH];
+} session_handle;
+
+typedef struct {
+    ErlNifMutex             *lock;
+    OlmOutboundGroupSession *olm;
+} outbound_group_session_handle;
+
+typedef struct {
+    ErlNifMutex            *lock;
+    OlmInboundGroupSession *olm;
+} inbound_group_session_handle;
+
+typedef struct {
+    uint8_t         id[PRE_KEY_ID_LENGTH];
+    session_handle *session;
+} session_index_entry;
+
+// Inbound sessions by the keys of their pre key messages, in an open
+// addressing table with linear probing. An empty slot has no session. The
+// index keeps a reference to every session in it. Keys are hashed with a
+// random seed of the index's own, since peers choose them.
+typedef struct {
+    ErlNifMutex         *lock;
+    session_index_entry *entries;
+    size_t               capacity;
+    size_t               count;
+    uint8_t              seed[SIPHASH_KEY_LENGTH];
+} session_index_handle;
+
+typedef struct {
+    uint8_t *id;
+    uint32_t id_length;
+    uint32_t size;
+    uint64_t hash;
+    uint64_t offset;
+    uint64_t generation;
+} journal_entry;
+
+// The latest record of each session in a journal is found through an open
+// addressing table like session_index_handle's, of entries with a copy of the
+// session id. An empty slot has no id. Ids are hashed with a random seed of
+// the journal's own, like the session index's keys, since the session cache
+// stores ids its callers choose.
+typedef struct {
+    ErlNifMutex *lock;
+    ErlNifCond  *sync_done;
+    char        *path;
+    int          fd;
+    uint8_t      seed[SIPHASH_KEY_LENGTH];
+
+    // The file is mapped with room to grow, and only read up to end.
+    const uint8_t *map;
+    size_t         map_size;
+    uint64_t       end;
+    uint64_t       live_bytes;
+
+    // Counted in bytes ever appended rather than file offsets, which change
+    // when the file is compacted.
+    uint64_t appended;
+    uint64_t synced;
+    int      syncing;
+
+    // Records are only indexed once they're synced, up to this offset. Once a
+    // sync fails its error is kept, and the journal can't be used until it's
+    // opened again.
+    uint64_t indexed;
+    int      error;
+
+    journal_entry *entries;
+    size_t         capacity;
+    size_t         count;
+} journal_handle;
+
+void
+account_dtor(ErlNifEnv *caller_env, void *resource)
+{
+    account_handle *account = resource;
+
+    olm_clear_account(account->olm);
+    if (account->lock) enif_mutex_destroy(account->lock);
+}
 
 void
-account_dtor(ErlNifEnv *caller_env, void *account)
+session_dtor(ErlNifEnv *caller_env, void *resource)
 {
-    olm_clear_account(account);
+    session_handle *session = resource;
+
+    olm_clear_session(session->olm);
+    if (session->lock) enif_mutex_destroy(session->lock);
+}
+
+void
+outbound_group_session_dtor(ErlNifEnv *caller_env, void *resource)
+{
+    outbound_group_session_handle *session = resource;
+
+    olm_clear_outbound_group_session(session->olm);
+    if (session->lock) enif_mutex_destroy(session->lock);
+}
+
+void
+inbound_group_session_dtor(ErlNifEnv *caller_env, void *resource)
+{
+    inbound_group_session_handle *session = resource;
+
+    olm_clear_inbound_group_session(session->olm);
+    if (session->lock) enif_mutex_destroy(session->lock);
+}
+
+void
+session_index_dtor(ErlNifEnv *caller_env, void *resource)
+{
+    session_index_handle *index = resource;
+
+    for (size_t i = 0; i < index->capacity; i++)
+        if (index->entries[i].session)
+            enif_release_resource(index->entries[i].session);
+
+    enif_free(index->entries);
+    if (index->lock) enif_mutex_destroy(index->lock);
 }
 
 void
-session_dtor(ErlNifEnv *caller_env, void *session)
+journal_dtor(ErlNifEnv *caller_env, void *resource)
+{
+    journal_handle *journal = resource;
+
+    if (journal->map) munmap((void *) journal->map, journal->map_size);
+    if (journal->fd != -1) close(journal->fd);
+
+    for (size_t i = 0; i < journal->capacity; i++)
+        if (journal->entries[i].id) enif_free(journal->entries[i].id);
+
+    enif_free(journal->entries);
+    enif_free(journal->path);
+    if (journal->sync_done) enif_cond_destroy(journal->sync_done);
+    if (journal->lock) enif_mutex_destroy(journal->lock);
+}
+
+// The alloc functions return NULL if the resource's lock couldn't be created,
+// which is reported as :enomem.
+static account_handle *
+alloc_account(void)
+{
+    account_handle *account = enif_alloc_resource(
+        account_resource, sizeof(account_handle) + olm_account_size());
+
+    account->lock              = enif_mutex_create("olm_account");
+    account->olm               = olm_account(account + 1);
+    account->has_identity_keys = 0;
+    account->generation        = new_generation();
+
+    if (account->lock == NULL) {
+        enif_release_resource(account);
+        return NULL;
+    }
+
+    return account;
+}
+
+static session_handle *
+alloc_session(void)
+{
+    session_handle *session = enif_alloc_resource(
+        session_resource, sizeof(session_handle) + olm_session_size());
+
+    session->lock           = enif_mutex_create("olm_session");
+    session->olm            = olm_session(session + 1);
+    session->has_pre_key_id = 0;
+    session->generation     = new_generation();
+
+    if (session->lock == NULL) {
+        enif_release_resource(session);
+        return NULL;
+    }
+
+    return session;
+}
+
+static outbound_group_session_handle *
+alloc_outbound_group_session(void)
+{
+    outbound_group_session_handle *session =
+        enif_alloc_resource(outbound_group_session_resource,
+                            sizeof(outbound_group_session_handle) +
+                                olm_outbound_group_session_size());
+
+    session->lock = enif_mutex_create("olm_outbound_group_session");
+    session->olm  = olm_outbound_group_session(session + 1);
+
+    if (session->lock == NULL) {
+        enif_release_resource(session);
+        return NULL;
+    }
+
+    return session;
+}
+
+static inbound_group_session_handle *
+alloc_inbound_group_session(void)
+{
+    inbound_group_session_handle *session =
+        enif_alloc_resource(inbound_group_session_resource,
+                            sizeof(inbound_group_session_handle) +
+                                olm_inbound_group_session_size());
+
+    session->lock = enif_mutex_create("olm_inbound_group_session");
+    session->olm  = olm_inbound_group_session(session + 1);
+
+    if (session->lock == NULL) {
+        enif_release_resource(session);
+        return NULL;
+    }
+
+    return session;
+}
+
+static int
+get_account(ErlNifEnv *env, ERL_NIF_TERM term, account_handle **account)
+{
+    return enif_get_resource(env, term, account_resource, (void **) account);
+}
+
+static int
+get_session(ErlNifEnv *env, ERL_NIF_TERM term, session_handle **session)
+{
+    return enif_get_resource(env, term, session_resource, (void **) session);
+}
+
+static int
+get_outbound_group_session(ErlNifEnv                      *env,
+                           ERL_NIF_TERM                    term,
+                           outbound_group_session_handle **session)
+{
+    return enif_get_resource(
+        env, term, outbound_group_session_resource, (void **) session);
+}
+
+static int
+get_inbound_group_session(ErlNifEnv                     *env,
+                          ERL_NIF_TERM                   term,
+                          inbound_group_session_handle **session)
+{
+    return enif_get_resource(
+        env, term, inbound_group_session_resource, (void **) session);
+}
+
+static int
+get_session_index(ErlNifEnv             *env,
+                  ERL_NIF_TERM           term,
+                  session_index_handle **index)
+{
+    return enif_get_resource(
+        env, term, session_index_resource, (void **) index);
+}
+
+static int
+get_journal(ErlNifEnv *env, ERL_NIF_TERM term, journal_handle **journal)
+{
+    return enif_get_resource(env, term, journal_resource, (void **) journal);
+}
+
+// Batches on a dirty scheduler give up the resource's lock after every chunk
+// of this many items, so a NIF on a normal scheduler waiting for it isn't
+// blocked for the whole batch.
+#define BATCH_CHUNK_SIZE 16
+
+static void
+yield_lock(ErlNifMutex *lock)
 {
-    olm_clear_session(session);
+    enif_mutex_unlock(lock);
+
+    // Mutexes aren't fair, so a waiter gets a chance to take it first.
+    sched_yield();
+
+    enif_mutex_lock(lock);
 }
 
 static int
@@ -24,12 +751,55 @@ nif_load(ErlNifEnv *env, void **priv_data, ERL_NIF_TERM load_info)
 {
     int flags = ERL_NIF_RT_CREATE | ERL_NIF_RT_TAKEOVER;
 
+    // OLM_RANDOM_POOL=0 reads from the kernel on every call instead, which is
+    // only useful to benchmark the pool.
+    char   pool_setting[8];
+    size_t pool_setting_size = sizeof(pool_setting);
+
+    if (enif_getenv("OLM_RANDOM_POOL", pool_setting, &pool_setting_size) == 0)
+        random_pool_enabled = strcmp(pool_setting, "0") != 0;
+
+    if (enif_tsd_key_create("olm_random_pool", &random_pool_key) != 0)
+        return 1;
+
+    if (enif_tsd_key_create("olm_utility", &utility_key) != 0) return 1;
+
+    if (!system_random((uint8_t *) &generation_counter,
+                       sizeof(generation_counter)))
+        return 1;
+
+    make_atoms(env);
+
+    if (!stats_init(env)) return 1;
+
     account_resource = enif_open_resource_type(
         env, NULL, "account", account_dtor, flags, NULL);
 
     session_resource = enif_open_resource_type(
         env, NULL, "session", session_dtor, flags, NULL);
 
+    outbound_group_session_resource =
+        enif_open_resource_type(env,
+                                NULL,
+                                "outbound_group_session",
+                                outbound_group_session_dtor,
+                                flags,
+                                NULL);
+
+    inbound_group_session_resource =
+        enif_open_resource_type(env,
+                                NULL,
+                                "inbound_group_session",
+                                inbound_group_session_dtor,
+                                flags,
+                                NULL);
+
+    session_index_resource = enif_open_resource_type(
+        env, NULL, "session_index", session_index_dtor, flags, NULL);
+
+    journal_resource = enif_open_resource_type(
+        env, NULL, "journal", journal_dtor, flags, NULL);
+
     return 0;
 }
 
@@ -47,36 +817,118 @@ version(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 
 // Accounts
 
+// libolm hands out keys as JSON objects of base64 strings, which never need
+// escaping, so finding the quotes is enough to read them.
+typedef struct {
+    const uint8_t *data;
+    size_t         size;
+} json_string;
+
+// Reads the next string at or after *position.
+static int
+next_json_string(const uint8_t *json,
+                 size_t         length,
+                 size_t        *position,
+                 json_string   *string)
+{
+    const uint8_t *start = memchr(json + *position, '"', length - *position);
+    if (start == NULL) return 0;
+
+    start++;
+    const uint8_t *end = memchr(start, '"', json + length - start);
+    if (end == NULL) return 0;
+
+    string->data = start;
+    string->size = end - start;
+    *position    = end - json + 1;
+
+    return 1;
+}
+
+// Reads the next {key_id, key} pair out of libolm's one time keys JSON, which
+// looks like {"curve25519":{"AAAAAQ":"<key>",...}}.
+static int
+next_one_time_key(const uint8_t *json,
+                  size_t         length,
+                  size_t        *position,
+                  json_string   *key_id,
+                  json_string   *key)
+{
+    // Skip the "curve25519" algorithm name.
+    if (*position == 0 && !next_json_string(json, length, position, key_id))
+        return 0;
+
+    return next_json_string(json, length, position, key_id) &&
+           next_json_string(json, length, position, key);
+}
+
+// libolm numbers one time keys in the order it generates them, and writes
+// the number as the key id, in unpadded base64 of four big endian bytes.
+static int
+read_key_number(json_string key_id, uint32_t *number)
+{
+    uint8_t bytes[4];
+
+    if (key_id.size != BASE64_ENCODED_LENGTH(sizeof(bytes)) ||
+        !base64_decode(key_id.data, key_id.size, bytes))
+        return 0;
+
+    *number = (uint32_t) bytes[0] << 24 | bytes[1] << 16 | bytes[2] << 8 |
+              bytes[3];
+
+    return 1;
+}
+
+// Writes the unpublished one time keys as JSON into a buffer the caller frees
+// with enif_free. Must be called with the account locked.
+static uint8_t *
+read_one_time_keys(account_handle *account, size_t *length)
+{
+    size_t   buffer_length = olm_account_one_time_keys_length(account->olm);
+    uint8_t *buffer        = enif_alloc(buffer_length);
+
+    *length =
+        olm_account_one_time_keys(account->olm, buffer, buffer_length);
+
+    if (*length == olm_error()) {
+        enif_free(buffer);
+        return NULL;
+    }
+
+    return buffer;
+}
+
 static ERL_NIF_TERM
 create_account(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-    size_t account_size = olm_account_size();
+    account_handle *account = alloc_account();
+    if (account == NULL) return make_errno_error(env, ENOMEM);
 
-    // Allocate memory based on account_size.
-    OlmAccount *memory  = enif_alloc_resource(account_resource, account_size);
-    OlmAccount *account = olm_account(memory);
-
-    size_t random_length = olm_create_account_random_length(account);
+    size_t random_length = olm_create_account_random_length(account->olm);
     char   bytes[random_length];
 
-    size_t result = olm_create_account(account, bytes, random_length);
+    if (!random_bytes(bytes, random_length)) {
+        enif_release_resource(account);
+
+        return make_error(env, OLM_NOT_ENOUGH_RANDOM);
+    }
+
+    size_t result = olm_create_account(account->olm, bytes, random_length);
+    wipe(bytes, random_length);
 
     // Return {:ok, account_ref} or {:error, last_error}.
     if (result == olm_error()) {
-        ERL_NIF_TERM error_atom    = enif_make_atom(env, "error");
-        ERL_NIF_TERM error_message = enif_make_string(
-            env, olm_account_last_error(account), ERL_NIF_LATIN1);
+        enum OlmErrorCode error = olm_account_last_error_code(account->olm);
 
         enif_release_resource(account);
 
-        return enif_make_tuple2(env, error_atom, error_message);
+        return make_error(env, error);
     }
 
-    ERL_NIF_TERM ok_atom = enif_make_atom(env, "ok");
-    ERL_NIF_TERM term    = enif_make_resource(env, account);
+    ERL_NIF_TERM term = enif_make_resource(env, account);
     enif_release_resource(account);
 
-    return enif_make_tuple2(env, ok_atom, term);
+    return enif_make_tuple2(env, atom_ok, term);
 }
 
 static ERL_NIF_TERM
@@ -85,699 +937,3608 @@ pickle_account(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
     ErlNifBinary key;
     ErlNifBinary pickled;
 
-    OlmAccount *account;
+    account_handle *account;
 
     // Read args.
-    enif_get_resource(env, argv[0], account_resource, (void **) &account);
-    enif_inspect_binary(env, argv[1], &key);
+    if (!get_account(env, argv[0], &account)) return enif_make_badarg(env);
+    if (!enif_inspect_iolist_as_binary(env, argv[1], &key))
+        return enif_make_badarg(env);
+
+    enif_mutex_lock(account->lock);
 
     // Allocate buffer for result.
-    size_t pickled_length = olm_pickle_account_length(account);
+    size_t pickled_length = olm_pickle_account_length(account->olm);
     enif_alloc_binary(pickled_length, &pickled);
 
-    size_t result = olm_pickle_account(
-        account, key.data, key.size, pickled.data, pickled_length);
+    size_t result = olm_pickle_account(
+        account->olm, key.data, key.size, pickled.data, pickled_length);
+    enum OlmErrorCode error = olm_account_last_error_code(account->olm);
+
+    enif_mutex_unlock(account->lock);
+
+    count_operation(STATS_PICKLE, 0, result == olm_error() ? 0 : result);
+
+    // Return {:ok, pickled} or {:error, last_error}.
+    if (result == olm_error()) {
+        enif_release_binary(&pickled);
+
+        return make_error(env, error);
+    }
+
+    ERL_NIF_TERM term = enif_make_binary(env, &pickled);
+
+    return enif_make_tuple2(env, atom_ok, term);
+}
+
+static ERL_NIF_TERM
+unpickle_account(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    ErlNifBinary   pickled_input;
+    scratch_buffer pickled;
+    ErlNifBinary   key;
+
+    // Read args.
+    if (!enif_inspect_iolist_as_binary(env, argv[0], &pickled_input))
+        return enif_make_badarg(env);
+    if (!enif_inspect_iolist_as_binary(env, argv[1], &key))
+        return enif_make_badarg(env);
+
+    scratch_copy(&pickled, &pickled_input);
+
+    // Initialise account memory.
+    account_handle *account = alloc_account();
+    if (account == NULL) {
+        scratch_release(&pickled);
+
+        return make_errno_error(env, ENOMEM);
+    }
+
+    size_t result = olm_unpickle_account(
+        account->olm, key.data, key.size, pickled.data, pickled.size);
+
+    count_operation(STATS_UNPICKLE, pickled.size, 0);
+
+    // Return {:ok, account_ref} or {:error, last_error}.
+    if (result == olm_error()) {
+        enum OlmErrorCode error = olm_account_last_error_code(account->olm);
+
+        enif_release_resource(account);
+        scratch_release(&pickled);
+
+        return make_error(env, error);
+    }
+
+    ERL_NIF_TERM term = enif_make_resource(env, account);
+
+    enif_release_resource(account);
+    scratch_release(&pickled);
+
+    return enif_make_tuple2(env, atom_ok, term);
+}
+
+static ERL_NIF_TERM
+account_generation(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    account_handle *account;
+    if (!get_account(env, argv[0], &account)) return enif_make_badarg(env);
+
+    enif_mutex_lock(account->lock);
+
+    uint64_t generation = account->generation;
+
+    enif_mutex_unlock(account->lock);
+
+    return enif_make_uint64(env, generation);
+}
+
+// Pickles an account unless its generation is still the given one, returning
+// :unchanged, or {:ok, pickled, generation} with the generation the pickle
+// was taken at.
+static ERL_NIF_TERM
+pickle_account_if_changed(ErlNifEnv         *env,
+                          int                argc,
+                          const ERL_NIF_TERM argv[])
+{
+    account_handle *account;
+    if (!get_account(env, argv[0], &account)) return enif_make_badarg(env);
+
+    ErlNifBinary key;
+    if (!enif_inspect_iolist_as_binary(env, argv[1], &key))
+        return enif_make_badarg(env);
+
+    ErlNifUInt64 last_generation;
+    if (!enif_get_uint64(env, argv[2], &last_generation))
+        return enif_make_badarg(env);
+
+    enif_mutex_lock(account->lock);
+
+    uint64_t generation = account->generation;
+
+    if (generation == last_generation) {
+        enif_mutex_unlock(account->lock);
+
+        return atom_unchanged;
+    }
+
+    ErlNifBinary pickled;
+    enif_alloc_binary(olm_pickle_account_length(account->olm), &pickled);
+
+    size_t result = olm_pickle_account(
+        account->olm, key.data, key.size, pickled.data, pickled.size);
+    enum OlmErrorCode error = olm_account_last_error_code(account->olm);
+
+    enif_mutex_unlock(account->lock);
+
+    count_operation(STATS_PICKLE, 0, result == olm_error() ? 0 : result);
+
+    if (result == olm_error()) {
+        enif_release_binary(&pickled);
+
+        return make_error(env, error);
+    }
+
+    return enif_make_tuple3(env,
+                            atom_ok,
+                            enif_make_binary(env, &pickled),
+                            enif_make_uint64(env, generation));
+}
+
+static ERL_NIF_TERM
+account_identity_keys(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    account_handle *account;
+    if (!get_account(env, argv[0], &account)) return enif_make_badarg(env);
+
+    enif_mutex_lock(account->lock);
+
+    // Allocate memory for identity keys.
+    ErlNifBinary identity_keys;
+    size_t       keys_length = olm_account_identity_keys_length(account->olm);
+    enif_alloc_binary(keys_length, &identity_keys);
+
+    size_t result = olm_account_identity_keys(
+        account->olm, identity_keys.data, identity_keys.size);
+    enum OlmErrorCode error = olm_account_last_error_code(account->olm);
+
+    enif_mutex_unlock(account->lock);
+
+    // Returns {:ok, identity_keys} or {:error, last_error}.
+    if (result == olm_error()) {
+        enif_release_binary(&identity_keys);
+
+        return make_error(env, error);
+    }
+
+    ERL_NIF_TERM term = enif_make_binary(env, &identity_keys);
+
+    return enif_make_tuple2(env, atom_ok, term);
+}
+
+// Fills in the account's identity keys if they haven't been read yet. Must be
+// called with the account locked.
+static int
+load_identity_keys(account_handle *account)
+{
+    if (account->has_identity_keys) return 1;
+
+    size_t  length = olm_account_identity_keys_length(account->olm);
+    uint8_t json[length];
+
+    length = olm_account_identity_keys(account->olm, json, length);
+    if (length == olm_error()) return 0;
+
+    size_t      position = 0;
+    int         found    = 0;
+    json_string name, key;
+
+    while (next_json_string(json, length, &position, &name) &&
+           next_json_string(json, length, &position, &key)) {
+        if (key.size != IDENTITY_KEY_LENGTH) continue;
+
+        if (name.size == 10 && memcmp(name.data, "curve25519", 10) == 0) {
+            memcpy(account->curve25519_key, key.data, key.size);
+            found |= 1;
+        } else if (name.size == 7 && memcmp(name.data, "ed25519", 7) == 0) {
+            memcpy(account->ed25519_key, key.data, key.size);
+            found |= 2;
+        }
+    }
+
+    // Keys which weren't both found aren't cached, and are read again.
+    if (found != 3) return 0;
+
+    account->has_identity_keys = 1;
+
+    return 1;
+}
+
+static ERL_NIF_TERM
+account_identity_keys_map(ErlNifEnv         *env,
+                          int                argc,
+                          const ERL_NIF_TERM argv[])
+{
+    account_handle *account;
+    if (!get_account(env, argv[0], &account)) return enif_make_badarg(env);
+
+    enif_mutex_lock(account->lock);
+
+    int               loaded = load_identity_keys(account);
+    enum OlmErrorCode error  = olm_account_last_error_code(account->olm);
+
+    enif_mutex_unlock(account->lock);
+
+    // Returns {:ok, %{curve25519: key, ed25519: key}} or {:error, last_error},
+    // or {:error, :unknown_error} if libolm's JSON lacked one of the keys.
+    if (!loaded && error == OLM_SUCCESS)
+        return enif_make_tuple2(env, atom_error, atom_unknown_error);
+    if (!loaded) return make_error(env, error);
+
+    // The cached keys are never written again, so they can be read unlocked.
+    ERL_NIF_TERM keys[2], values[2], map;
+
+    keys[0] = atom_curve25519;
+    keys[1] = atom_ed25519;
+
+    memcpy(enif_make_new_binary(env, IDENTITY_KEY_LENGTH, &values[0]),
+           account->curve25519_key,
+           IDENTITY_KEY_LENGTH);
+    memcpy(enif_make_new_binary(env, IDENTITY_KEY_LENGTH, &values[1]),
+           account->ed25519_key,
+           IDENTITY_KEY_LENGTH);
+
+    enif_make_map_from_arrays(env, keys, values, 2, &map);
+
+    return enif_make_tuple2(env, atom_ok, map);
+}
+
+static ERL_NIF_TERM
+account_sign(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    account_handle *account;
+    if (!get_account(env, argv[0], &account)) return enif_make_badarg(env);
+
+    ErlNifBinary message;
+    if (!enif_inspect_iolist_as_binary(env, argv[1], &message))
+        return enif_make_badarg(env);
+
+    enif_mutex_lock(account->lock);
+
+    ErlNifBinary signature;
+    size_t       signature_length = olm_account_signature_length(account->olm);
+    enif_alloc_binary(signature_length, &signature);
+
+    size_t result = olm_account_sign(account->olm,
+                                     message.data,
+                                     message.size,
+                                     signature.data,
+                                     signature.size);
+    enum OlmErrorCode error = olm_account_last_error_code(account->olm);
+
+    enif_mutex_unlock(account->lock);
+
+    count_operation(
+        STATS_SIGN, message.size, result == olm_error() ? 0 : signature.size);
+
+    // Returns {:ok, signed} or {:error, last_error}.
+    if (result == olm_error()) {
+        enif_release_binary(&signature);
+
+        return make_error(env, error);
+    }
+
+    ERL_NIF_TERM term = enif_make_binary(env, &signature);
+
+    return enif_make_tuple2(env, atom_ok, term);
+}
+
+static ERL_NIF_TERM
+account_one_time_keys(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    account_handle *account;
+    if (!get_account(env, argv[0], &account)) return enif_make_badarg(env);
+
+    enif_mutex_lock(account->lock);
+
+    ErlNifBinary one_time_keys;
+    size_t       one_time_keys_length =
+        olm_account_one_time_keys_length(account->olm);
+    enif_alloc_binary(one_time_keys_length, &one_time_keys);
+
+    size_t result = olm_account_one_time_keys(
+        account->olm, one_time_keys.data, one_time_keys.size);
+    enum OlmErrorCode error = olm_account_last_error_code(account->olm);
+
+    enif_mutex_unlock(account->lock);
+
+    // Returns {:ok, one_time_keys} or {:error, last_error}.
+    if (result == olm_error()) {
+        enif_release_binary(&one_time_keys);
+
+        return make_error(env, error);
+    }
+
+    ERL_NIF_TERM term = enif_make_binary(env, &one_time_keys);
+
+    return enif_make_tuple2(env, atom_ok, term);
+}
+
+static ERL_NIF_TERM
+account_one_time_keys_list(ErlNifEnv         *env,
+                           int                argc,
+                           const ERL_NIF_TERM argv[])
+{
+    account_handle *account;
+    if (!get_account(env, argv[0], &account)) return enif_make_badarg(env);
+
+    enif_mutex_lock(account->lock);
+
+    size_t            length;
+    uint8_t          *json = read_one_time_keys(account, &length);
+    enum OlmErrorCode error = olm_account_last_error_code(account->olm);
+
+    enif_mutex_unlock(account->lock);
+
+    // Returns {:ok, [{key_id, key}]} or {:error, last_error}.
+    if (json == NULL) return make_error(env, error);
+
+    ERL_NIF_TERM keys     = enif_make_list(env, 0);
+    size_t       position = 0;
+    json_string  key_id, key;
+
+    while (next_one_time_key(json, length, &position, &key_id, &key)) {
+        ERL_NIF_TERM key_id_term, key_term;
+        memcpy(enif_make_new_binary(env, key_id.size, &key_id_term),
+               key_id.data,
+               key_id.size);
+        memcpy(
+            enif_make_new_binary(env, key.size, &key_term), key.data, key.size);
+
+        keys = enif_make_list_cell(
+            env, enif_make_tuple2(env, key_id_term, key_term), keys);
+    }
+
+    enif_free(json);
+
+    ERL_NIF_TERM reversed;
+    enif_make_reverse_list(env, keys, &reversed);
+
+    return enif_make_tuple2(env, atom_ok, reversed);
+}
+
+static ERL_NIF_TERM
+account_mark_keys_as_published(ErlNifEnv         *env,
+                               int                argc,
+                               const ERL_NIF_TERM argv[])
+{
+    account_handle *account;
+    if (!get_account(env, argv[0], &account)) return enif_make_badarg(env);
+
+    enif_mutex_lock(account->lock);
+
+    size_t            result = olm_account_mark_keys_as_published(account->olm);
+    enum OlmErrorCode error  = olm_account_last_error_code(account->olm);
+
+    // Marking no keys changes nothing.
+    if (result != olm_error() && result > 0) account->generation++;
+
+    enif_mutex_unlock(account->lock);
+
+    // Returns :ok or {:error, last_error}.
+    if (result == olm_error()) return make_error(env, error);
+
+    return atom_ok;
+}
+
+static ERL_NIF_TERM
+account_max_one_time_keys(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    account_handle *account;
+    if (!get_account(env, argv[0], &account)) return enif_make_badarg(env);
+
+    size_t max = olm_account_max_number_of_one_time_keys(account->olm);
+
+    ERL_NIF_TERM term = enif_make_ulong(env, max);
+
+    return enif_make_tuple2(env, atom_ok, term);
+}
+
+// Generating more keys than this is moved to a dirty CPU scheduler.
+#define GENERATE_ONE_TIME_KEYS_DIRTY_THRESHOLD 16
+
+static ERL_NIF_TERM
+account_generate_one_time_keys_run(ErlNifEnv         *env,
+                                   int                argc,
+                                   const ERL_NIF_TERM argv[])
+{
+    // Get args.
+    account_handle *account;
+    get_account(env, argv[0], &account);
+
+    size_t count;
+    enif_get_ulong(env, argv[1], &count);
+
+    enif_mutex_lock(account->lock);
+
+    for (size_t done = 0; done < count;) {
+        size_t chunk = count - done;
+        if (chunk > BATCH_CHUNK_SIZE) chunk = BATCH_CHUNK_SIZE;
+
+        size_t random_length =
+            olm_account_generate_one_time_keys_random_length(account->olm,
+                                                             chunk);
+        char random[random_length];
+
+        if (!random_bytes(random, random_length)) {
+            enif_mutex_unlock(account->lock);
+
+            return make_error(env, OLM_NOT_ENOUGH_RANDOM);
+        }
+
+        size_t result = olm_account_generate_one_time_keys(
+            account->olm, chunk, random, random_length);
+        wipe(random, random_length);
+
+        if (result == olm_error()) {
+            enum OlmErrorCode error = olm_account_last_error_code(account->olm);
+
+            enif_mutex_unlock(account->lock);
+
+            return make_error(env, error);
+        }
+
+        account->generation++;
+        done += chunk;
+
+        if (done < count) yield_lock(account->lock);
+    }
+
+    enif_mutex_unlock(account->lock);
+
+    return atom_ok;
+}
+
+static ERL_NIF_TERM
+account_generate_one_time_keys(ErlNifEnv         *env,
+                               int                argc,
+                               const ERL_NIF_TERM argv[])
+{
+    account_handle *account;
+    if (!get_account(env, argv[0], &account)) return enif_make_badarg(env);
+
+    size_t count;
+    if (!enif_get_ulong(env, argv[1], &count)) return enif_make_badarg(env);
+
+    if (count > GENERATE_ONE_TIME_KEYS_DIRTY_THRESHOLD) {
+        return enif_schedule_nif(env,
+                                 "account_generate_one_time_keys",
+                                 ERL_NIF_DIRTY_JOB_CPU_BOUND,
+                                 account_generate_one_time_keys_run,
+                                 argc,
+                                 argv);
+    }
+
+    return account_generate_one_time_keys_run(env, argc, argv);
+}
+
+// Keys are generated in chunks of this size, and the account lock is given up
+// between chunks so sessions can still be created during a large refill.
+#define REPLENISH_CHUNK_SIZE 10
+
+// Tops up the keys the account holds for peers to watermark: the published
+// keys the server still hands out, which the caller passes in, and the
+// unpublished ones. libolm holds at most its maximum number of keys and drops
+// the oldest to make room for new ones, which are the published keys peers
+// are still given, so the total is never taken past it.
+static ERL_NIF_TERM
+account_replenish_one_time_keys(ErlNifEnv         *env,
+                                int                argc,
+                                const ERL_NIF_TERM argv[])
+{
+    account_handle *account;
+    if (!get_account(env, argv[0], &account)) return enif_make_badarg(env);
+
+    size_t watermark;
+    if (!enif_get_ulong(env, argv[1], &watermark))
+        return enif_make_badarg(env);
+
+    size_t published;
+    if (!enif_get_ulong(env, argv[2], &published))
+        return enif_make_badarg(env);
+
+    size_t max = olm_account_max_number_of_one_time_keys(account->olm);
+    if (watermark > max) watermark = max;
+
+    ERL_NIF_TERM keys = enif_make_list(env, 0);
+
+    for (;;) {
+        size_t      length, position = 0, count = 0;
+        uint32_t    newest = 0, number;
+        json_string key_id, key;
+
+        enif_mutex_lock(account->lock);
+
+        uint8_t *json = read_one_time_keys(account, &length);
+        if (json == NULL) break;
+
+        while (next_one_time_key(json, length, &position, &key_id, &key)) {
+            if (read_key_number(key_id, &number) && number > newest)
+                newest = number;
+            count++;
+        }
+
+        enif_free(json);
+
+        if (published >= watermark || count >= watermark - published) {
+            enif_mutex_unlock(account->lock);
+
+            return enif_make_tuple2(env, atom_ok, keys);
+        }
+
+        size_t chunk = watermark - published - count;
+        if (chunk > REPLENISH_CHUNK_SIZE) chunk = REPLENISH_CHUNK_SIZE;
+
+        size_t random_length =
+            olm_account_generate_one_time_keys_random_length(account->olm,
+                                                             chunk);
+        uint8_t random[random_length];
+
+        if (!random_bytes(random, random_length)) {
+            enif_mutex_unlock(account->lock);
+
+            return make_error(env, OLM_NOT_ENOUGH_RANDOM);
+        }
+
+        size_t result = olm_account_generate_one_time_keys(
+            account->olm, chunk, random, random_length);
+        wipe(random, random_length);
+
+        if (result == olm_error()) break;
+
+        account->generation++;
+
+        json = read_one_time_keys(account, &length);
+        if (json == NULL) break;
+
+        enif_mutex_unlock(account->lock);
+
+        // The keys this chunk generated are numbered after every key there
+        // was before it.
+        position = 0;
+
+        while (next_one_time_key(json, length, &position, &key_id, &key)) {
+            if (!read_key_number(key_id, &number) || number <= newest)
+                continue;
+
+            ERL_NIF_TERM key_id_term, key_term;
+            memcpy(enif_make_new_binary(env, key_id.size, &key_id_term),
+                   key_id.data,
+                   key_id.size);
+            memcpy(enif_make_new_binary(env, key.size, &key_term),
+                   key.data,
+                   key.size);
+
+            keys = enif_make_list_cell(
+                env, enif_make_tuple2(env, key_id_term, key_term), keys);
+        }
+
+        enif_free(json);
+    }
+
+    // Only reached when libolm failed, with the account still locked.
+    enum OlmErrorCode error = olm_account_last_error_code(account->olm);
+
+    enif_mutex_unlock(account->lock);
+
+    return make_error(env, error);
+}
+
+static ERL_NIF_TERM
+remove_one_time_keys(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    account_handle *account;
+    if (!get_account(env, argv[0], &account)) return enif_make_badarg(env);
+
+    session_handle *session;
+    if (!get_session(env, argv[1], &session)) return enif_make_badarg(env);
+
+    enif_mutex_lock(account->lock);
+    enif_mutex_lock(session->lock);
+
+    size_t result = olm_remove_one_time_keys(account->olm, session->olm);
+    enum OlmErrorCode error = olm_account_last_error_code(account->olm);
+
+    if (result != olm_error()) account->generation++;
+
+    enif_mutex_unlock(session->lock);
+    enif_mutex_unlock(account->lock);
+
+    if (result == olm_error()) return make_error(env, error);
+
+    return atom_ok;
+}
+
+// Sessions
+
+static ERL_NIF_TERM
+create_outbound_session(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    account_handle *account;
+    if (!get_account(env, argv[0], &account)) return enif_make_badarg(env);
+
+    ErlNifBinary peer_id_key;
+    if (!enif_inspect_iolist_as_binary(env, argv[1], &peer_id_key))
+        return enif_make_badarg(env);
+
+    ErlNifBinary peer_one_time_key;
+    if (!enif_inspect_iolist_as_binary(env, argv[2], &peer_one_time_key))
+        return enif_make_badarg(env);
+
+    // Allocate new session
+    session_handle *session = alloc_session();
+    if (session == NULL) return make_errno_error(env, ENOMEM);
+
+    size_t random_length =
+        olm_create_outbound_session_random_length(session->olm);
+    char bytes[random_length];
+
+    if (!random_bytes(bytes, random_length)) {
+        enif_release_resource(session);
+
+        return make_error(env, OLM_NOT_ENOUGH_RANDOM);
+    }
+
+    enif_mutex_lock(account->lock);
+
+    size_t result = olm_create_outbound_session(session->olm,
+                                                account->olm,
+                                                peer_id_key.data,
+                                                peer_id_key.size,
+                                                peer_one_time_key.data,
+                                                peer_one_time_key.size,
+                                                bytes,
+                                                random_length);
+
+    enif_mutex_unlock(account->lock);
+
+    wipe(bytes, random_length);
+
+    if (result == olm_error()) {
+        enum OlmErrorCode error = olm_session_last_error_code(session->olm);
+
+        enif_release_resource(session);
+
+        return make_error(env, error);
+    }
+
+    ERL_NIF_TERM term = enif_make_resource(env, session);
+    enif_release_resource(session);
+
+    return enif_make_tuple2(env, atom_ok, term);
+}
+
+static ERL_NIF_TERM
+create_inbound_session(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    account_handle *account;
+    if (!get_account(env, argv[0], &account)) return enif_make_badarg(env);
+
+    ErlNifBinary   cyphertext_input;
+    scratch_buffer cyphertext;
+    if (!enif_inspect_iolist_as_binary(env, argv[1], &cyphertext_input))
+        return enif_make_badarg(env);
+    scratch_copy(&cyphertext, &cyphertext_input);
+
+    // Allocate new session
+    session_handle *session = alloc_session();
+    if (session == NULL) {
+        scratch_release(&cyphertext);
+
+        return make_errno_error(env, ENOMEM);
+    }
+
+    enif_mutex_lock(account->lock);
+
+    size_t result = olm_create_inbound_session(
+        session->olm, account->olm, cyphertext.data, cyphertext.size);
+
+    enif_mutex_unlock(account->lock);
+
+    if (result == olm_error()) {
+        enum OlmErrorCode error = olm_session_last_error_code(session->olm);
+
+        enif_release_resource(session);
+        scratch_release(&cyphertext);
+
+        return make_error(env, error);
+    }
+
+    session->has_pre_key_id = parse_pre_key_id(
+        cyphertext_input.data, cyphertext_input.size, session->pre_key_id);
+
+    ERL_NIF_TERM term = enif_make_resource(env, session);
+
+    enif_release_resource(session);
+    scratch_release(&cyphertext);
+
+    return enif_make_tuple2(env, atom_ok, term);
+}
+
+static ERL_NIF_TERM
+create_inbound_session_from(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    account_handle *account;
+    if (!get_account(env, argv[0], &account)) return enif_make_badarg(env);
+
+    ErlNifBinary   cyphertext_input;
+    scratch_buffer cyphertext;
+    ErlNifBinary   peer_id_key;
+    if (!enif_inspect_iolist_as_binary(env, argv[1], &cyphertext_input))
+        return enif_make_badarg(env);
+    if (!enif_inspect_iolist_as_binary(env, argv[2], &peer_id_key))
+        return enif_make_badarg(env);
+
+    scratch_copy(&cyphertext, &cyphertext_input);
+
+    // Allocate new session
+    session_handle *session = alloc_session();
+    if (session == NULL) {
+        scratch_release(&cyphertext);
+
+        return make_errno_error(env, ENOMEM);
+    }
+
+    enif_mutex_lock(account->lock);
+
+    size_t result = olm_create_inbound_session_from(session->olm,
+                                                    account->olm,
+                                                    peer_id_key.data,
+                                                    peer_id_key.size,
+                                                    cyphertext.data,
+                                                    cyphertext.size);
+
+    enif_mutex_unlock(account->lock);
+
+    if (result == olm_error()) {
+        enum OlmErrorCode error = olm_session_last_error_code(session->olm);
+
+        enif_release_resource(session);
+        scratch_release(&cyphertext);
+
+        return make_error(env, error);
+    }
+
+    session->has_pre_key_id = parse_pre_key_id(
+        cyphertext_input.data, cyphertext_input.size, session->pre_key_id);
+
+    ERL_NIF_TERM term = enif_make_resource(env, session);
+
+    enif_release_resource(session);
+    scratch_release(&cyphertext);
+
+    return enif_make_tuple2(env, atom_ok, term);
+}
+
+// The memory a live session holds: the handle and libolm's session after it.
+static ERL_NIF_TERM
+session_size(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    return enif_make_ulong(env, sizeof(session_handle) + olm_session_size());
+}
+
+static ERL_NIF_TERM
+session_id(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    session_handle *session;
+    if (!get_session(env, argv[0], &session)) return enif_make_badarg(env);
+
+    enif_mutex_lock(session->lock);
+
+    ErlNifBinary id;
+    size_t       id_length = olm_session_id_length(session->olm);
+    enif_alloc_binary(id_length, &id);
+
+    size_t            result = olm_session_id(session->olm, id.data, id.size);
+    enum OlmErrorCode error  = olm_session_last_error_code(session->olm);
+
+    enif_mutex_unlock(session->lock);
+
+    if (result == olm_error()) {
+        enif_release_binary(&id);
+
+        return make_error(env, error);
+    }
+
+    ERL_NIF_TERM term = enif_make_binary(env, &id);
+
+    return enif_make_tuple2(env, atom_ok, term);
+}
+
+static ERL_NIF_TERM
+match_inbound_session(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    session_handle *session;
+    if (!get_session(env, argv[0], &session)) return enif_make_badarg(env);
+
+    ErlNifBinary   cyphertext_input;
+    scratch_buffer cyphertext;
+    if (!enif_inspect_iolist_as_binary(env, argv[1], &cyphertext_input))
+        return enif_make_badarg(env);
+    scratch_copy(&cyphertext, &cyphertext_input);
+
+    enif_mutex_lock(session->lock);
+
+    size_t result = olm_matches_inbound_session(
+        session->olm, cyphertext.data, cyphertext.size);
+    enum OlmErrorCode error = olm_session_last_error_code(session->olm);
+
+    enif_mutex_unlock(session->lock);
+
+    if (result == olm_error()) {
+        scratch_release(&cyphertext);
+
+        return make_error(env, error);
+    }
+
+    ERL_NIF_TERM term = enif_make_ulong(env, result);
+
+    scratch_release(&cyphertext);
+
+    return enif_make_tuple2(env, atom_ok, term);
+}
+
+static ERL_NIF_TERM
+match_inbound_session_from(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    session_handle *session;
+    if (!get_session(env, argv[0], &session)) return enif_make_badarg(env);
+
+    ErlNifBinary   cyphertext_input;
+    scratch_buffer cyphertext;
+    ErlNifBinary   peer_id_key;
+    if (!enif_inspect_iolist_as_binary(env, argv[1], &cyphertext_input))
+        return enif_make_badarg(env);
+    if (!enif_inspect_iolist_as_binary(env, argv[2], &peer_id_key))
+        return enif_make_badarg(env);
+
+    scratch_copy(&cyphertext, &cyphertext_input);
+
+    enif_mutex_lock(session->lock);
+
+    size_t result = olm_matches_inbound_session_from(session->olm,
+                                                     peer_id_key.data,
+                                                     peer_id_key.size,
+                                                     cyphertext.data,
+                                                     cyphertext.size);
+    enum OlmErrorCode error = olm_session_last_error_code(session->olm);
+
+    enif_mutex_unlock(session->lock);
+
+    if (result == olm_error()) {
+        scratch_release(&cyphertext);
+
+        return make_error(env, error);
+    }
+
+    ERL_NIF_TERM term = enif_make_ulong(env, result);
+
+    scratch_release(&cyphertext);
+
+    return enif_make_tuple2(env, atom_ok, term);
+}
+
+static ERL_NIF_TERM
+pickle_session(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    session_handle *session;
+    if (!get_session(env, argv[0], &session)) return enif_make_badarg(env);
+
+    ErlNifBinary key;
+    if (!enif_inspect_iolist_as_binary(env, argv[1], &key))
+        return enif_make_badarg(env);
+
+    enif_mutex_lock(session->lock);
+
+    ErlNifBinary pickled;
+    size_t       pickled_length = olm_pickle_session_length(session->olm);
+    enif_alloc_binary(pickled_length, &pickled);
+
+    size_t result = olm_pickle_session(
+        session->olm, key.data, key.size, pickled.data, pickled.size);
+    enum OlmErrorCode error = olm_session_last_error_code(session->olm);
+
+    enif_mutex_unlock(session->lock);
+
+    count_operation(STATS_PICKLE, 0, result == olm_error() ? 0 : result);
+
+    if (result == olm_error()) {
+        enif_release_binary(&pickled);
+
+        return make_error(env, error);
+    }
+
+    ERL_NIF_TERM term = enif_make_binary(env, &pickled);
+
+    return enif_make_tuple2(env, atom_ok, term);
+}
+
+static ERL_NIF_TERM
+unpickle_session(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    ErlNifBinary   pickled_input;
+    scratch_buffer pickled;
+    ErlNifBinary   key;
+
+    // Read args.
+    if (!enif_inspect_iolist_as_binary(env, argv[0], &pickled_input))
+        return enif_make_badarg(env);
+    if (!enif_inspect_iolist_as_binary(env, argv[1], &key))
+        return enif_make_badarg(env);
+
+    scratch_copy(&pickled, &pickled_input);
+
+    // Alloc memory
+    session_handle *session = alloc_session();
+    if (session == NULL) {
+        scratch_release(&pickled);
+
+        return make_errno_error(env, ENOMEM);
+    }
+
+    size_t result = olm_unpickle_session(
+        session->olm, key.data, key.size, pickled.data, pickled.size);
+
+    count_operation(STATS_UNPICKLE, pickled.size, 0);
+
+    if (result == olm_error()) {
+        enum OlmErrorCode error = olm_session_last_error_code(session->olm);
+
+        enif_release_resource(session);
+        scratch_release(&pickled);
+
+        return make_error(env, error);
+    }
+
+    ERL_NIF_TERM term = enif_make_resource(env, session);
+
+    enif_release_resource(session);
+    scratch_release(&pickled);
+
+    return enif_make_tuple2(env, atom_ok, term);
+}
+
+// Pickles a session in the raw format: libolm's pickle with the base64 decoded
+// away.
+static ERL_NIF_TERM
+pickle_session_raw(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    session_handle *session;
+    if (!get_session(env, argv[0], &session)) return enif_make_badarg(env);
+
+    ErlNifBinary key;
+    if (!enif_inspect_iolist_as_binary(env, argv[1], &key))
+        return enif_make_badarg(env);
+
+    enif_mutex_lock(session->lock);
+
+    ErlNifBinary pickled;
+    enif_alloc_binary(olm_pickle_session_length(session->olm), &pickled);
+
+    size_t result = olm_pickle_session(
+        session->olm, key.data, key.size, pickled.data, pickled.size);
+    enum OlmErrorCode error = olm_session_last_error_code(session->olm);
+
+    enif_mutex_unlock(session->lock);
+
+    count_operation(STATS_PICKLE, 0, result == olm_error() ? 0 : result);
+
+    if (result == olm_error()) {
+        enif_release_binary(&pickled);
+
+        return make_error(env, error);
+    }
+
+    // libolm's output is always valid base64.
+    base64_decode(pickled.data, result, pickled.data);
+    enif_realloc_binary(&pickled, BASE64_DECODED_LENGTH(result));
+
+    ERL_NIF_TERM term = enif_make_binary(env, &pickled);
+
+    return enif_make_tuple2(env, atom_ok, term);
+}
+
+// Loads a session pickled by pickle_session_raw. The bytes are re-encoded into
+// a scratch buffer for libolm, which is also what keeps the input untouched.
+static ERL_NIF_TERM
+unpickle_session_raw(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    ErlNifBinary pickled;
+    if (!enif_inspect_iolist_as_binary(env, argv[0], &pickled))
+        return enif_make_badarg(env);
+
+    ErlNifBinary key;
+    if (!enif_inspect_iolist_as_binary(env, argv[1], &key))
+        return enif_make_badarg(env);
+
+    size_t   encoded_length = BASE64_ENCODED_LENGTH(pickled.size);
+    uint8_t *encoded        = enif_alloc(encoded_length);
+
+    base64_encode(pickled.data, pickled.size, encoded);
+
+    session_handle *session = alloc_session();
+    if (session == NULL) {
+        enif_free(encoded);
+
+        return make_errno_error(env, ENOMEM);
+    }
+
+    size_t result = olm_unpickle_session(
+        session->olm, key.data, key.size, encoded, encoded_length);
+
+    count_operation(STATS_UNPICKLE, pickled.size, 0);
+
+    enif_free(encoded);
+
+    if (result == olm_error()) {
+        enum OlmErrorCode error = olm_session_last_error_code(session->olm);
+
+        enif_release_resource(session);
+
+        return make_error(env, error);
+    }
+
+    ERL_NIF_TERM term = enif_make_resource(env, session);
+
+    enif_release_resource(session);
+
+    return enif_make_tuple2(env, atom_ok, term);
+}
+
+static ERL_NIF_TERM
+session_generation(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    session_handle *session;
+    if (!get_session(env, argv[0], &session)) return enif_make_badarg(env);
+
+    enif_mutex_lock(session->lock);
+
+    uint64_t generation = session->generation;
+
+    enif_mutex_unlock(session->lock);
+
+    return enif_make_uint64(env, generation);
+}
+
+// Pickles a session unless its generation is still the given one, like
+// pickle_account_if_changed. The last argument picks the raw format.
+static ERL_NIF_TERM
+pickle_session_if_changed(ErlNifEnv         *env,
+                          int                argc,
+                          const ERL_NIF_TERM argv[])
+{
+    session_handle *session;
+    if (!get_session(env, argv[0], &session)) return enif_make_badarg(env);
+
+    ErlNifBinary key;
+    if (!enif_inspect_iolist_as_binary(env, argv[1], &key))
+        return enif_make_badarg(env);
+
+    ErlNifUInt64 last_generation;
+    if (!enif_get_uint64(env, argv[2], &last_generation))
+        return enif_make_badarg(env);
+
+    int raw = enif_is_identical(argv[3], atom_true);
+
+    enif_mutex_lock(session->lock);
+
+    uint64_t generation = session->generation;
+
+    if (generation == last_generation) {
+        enif_mutex_unlock(session->lock);
+
+        return atom_unchanged;
+    }
+
+    ErlNifBinary pickled;
+    enif_alloc_binary(olm_pickle_session_length(session->olm), &pickled);
+
+    size_t result = olm_pickle_session(
+        session->olm, key.data, key.size, pickled.data, pickled.size);
+    enum OlmErrorCode error = olm_session_last_error_code(session->olm);
+
+    enif_mutex_unlock(session->lock);
+
+    count_operation(STATS_PICKLE, 0, result == olm_error() ? 0 : result);
+
+    if (result == olm_error()) {
+        enif_release_binary(&pickled);
+
+        return make_error(env, error);
+    }
+
+    if (raw) {
+        base64_decode(pickled.data, result, pickled.data);
+        enif_realloc_binary(&pickled, BASE64_DECODED_LENGTH(result));
+    }
+
+    return enif_make_tuple3(env,
+                            atom_ok,
+                            enif_make_binary(env, &pickled),
+                            enif_make_uint64(env, generation));
+}
+
+// Pickles a list of sessions with the same key, returning an {:ok, pickled}
+// or {:error, last_error} for each. Always runs on a dirty scheduler.
+static ERL_NIF_TERM
+pickle_sessions(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    ErlNifBinary key;
+    if (!enif_inspect_iolist_as_binary(env, argv[1], &key))
+        return enif_make_badarg(env);
+
+    ERL_NIF_TERM list = argv[0];
+    ERL_NIF_TERM head;
+
+    session_handle *session;
+
+    while (enif_get_list_cell(env, list, &head, &list)) {
+        if (!get_session(env, head, &session)) return enif_make_badarg(env);
+    }
+
+    if (!enif_is_empty_list(env, list)) return enif_make_badarg(env);
+
+    ERL_NIF_TERM results = enif_make_list(env, 0);
+
+    list = argv[0];
+
+    while (enif_get_list_cell(env, list, &head, &list)) {
+        get_session(env, head, &session);
+
+        enif_mutex_lock(session->lock);
+
+        ErlNifBinary pickled;
+        enif_alloc_binary(olm_pickle_session_length(session->olm), &pickled);
+
+        size_t result = olm_pickle_session(
+            session->olm, key.data, key.size, pickled.data, pickled.size);
+        enum OlmErrorCode error = olm_session_last_error_code(session->olm);
+
+        enif_mutex_unlock(session->lock);
+
+        count_operation(STATS_PICKLE, 0, result == olm_error() ? 0 : result);
+
+        ERL_NIF_TERM item;
+
+        if (result == olm_error()) {
+            enif_release_binary(&pickled);
+
+            item = enif_make_tuple2(env, atom_error, error_reason(error));
+        } else {
+            item =
+                enif_make_tuple2(env, atom_ok, enif_make_binary(env, &pickled));
+        }
+
+        results = enif_make_list_cell(env, item, results);
+    }
+
+    enif_make_reverse_list(env, results, &results);
+
+    return enif_make_tuple2(env, atom_ok, results);
+}
+
+// Unpickles a list of sessions with the same key, returning an {:ok, session}
+// or {:error, last_error} for each. libolm decodes each pickle in place, so
+// they're copied into one scratch buffer sized for the largest instead of a
+// fresh binary each. Always runs on a dirty scheduler.
+static ERL_NIF_TERM
+unpickle_sessions(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    ErlNifBinary key;
+    if (!enif_inspect_iolist_as_binary(env, argv[1], &key))
+        return enif_make_badarg(env);
+
+    ERL_NIF_TERM list = argv[0];
+    ERL_NIF_TERM head;
+
+    ErlNifBinary pickled;
+    size_t       scratch_size = 0;
+
+    while (enif_get_list_cell(env, list, &head, &list)) {
+        if (!enif_inspect_iolist_as_binary(env, head, &pickled))
+            return enif_make_badarg(env);
+
+        if (pickled.size > scratch_size) scratch_size = pickled.size;
+    }
+
+    if (!enif_is_empty_list(env, list)) return enif_make_badarg(env);
+
+    uint8_t *scratch = enif_alloc(scratch_size > 0 ? scratch_size : 1);
+
+    ERL_NIF_TERM results = enif_make_list(env, 0);
+
+    list = argv[0];
+
+    while (enif_get_list_cell(env, list, &head, &list)) {
+        enif_inspect_iolist_as_binary(env, head, &pickled);
+        memcpy(scratch, pickled.data, pickled.size);
+
+        session_handle *session = alloc_session();
+        if (session == NULL) {
+            enif_free(scratch);
+
+            return make_errno_error(env, ENOMEM);
+        }
+
+        size_t result = olm_unpickle_session(
+            session->olm, key.data, key.size, scratch, pickled.size);
+
+        count_operation(STATS_UNPICKLE, pickled.size, 0);
+
+        ERL_NIF_TERM item;
+
+        if (result == olm_error()) {
+            item = enif_make_tuple2(
+                env,
+                atom_error,
+                error_reason(olm_session_last_error_code(session->olm)));
+        } else {
+            item = enif_make_tuple2(
+                env, atom_ok, enif_make_resource(env, session));
+        }
+
+        enif_release_resource(session);
+
+        results = enif_make_list_cell(env, item, results);
+    }
+
+    enif_free(scratch);
+
+    enif_make_reverse_list(env, results, &results);
+
+    return enif_make_tuple2(env, atom_ok, results);
+}
+
+// Returns {:ok, {type, cyphertext}}. The type is read under the same lock as
+// the message is encrypted, so a message decrypted in between can't change it.
+static ERL_NIF_TERM
+encrypt_message(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    session_handle *session;
+    if (!get_session(env, argv[0], &session)) return enif_make_badarg(env);
+
+    ErlNifBinary plaintext;
+    if (!enif_inspect_iolist_as_binary(env, argv[1], &plaintext))
+        return enif_make_badarg(env);
+
+    enif_mutex_lock(session->lock);
+
+    size_t type = olm_encrypt_message_type(session->olm);
+
+    if (type == olm_error()) {
+        enum OlmErrorCode error = olm_session_last_error_code(session->olm);
+
+        enif_mutex_unlock(session->lock);
+
+        return make_error(env, error);
+    }
+
+    size_t random_length = olm_encrypt_random_length(session->olm);
+    char   bytes[random_length];
+
+    if (!random_bytes(bytes, random_length)) {
+        enif_mutex_unlock(session->lock);
+
+        return make_error(env, OLM_NOT_ENOUGH_RANDOM);
+    }
+
+    ErlNifBinary message;
+    size_t       message_length =
+        olm_encrypt_message_length(session->olm, plaintext.size);
+    enif_alloc_binary(message_length, &message);
+
+    size_t result = olm_encrypt(session->olm,
+                                plaintext.data,
+                                plaintext.size,
+                                bytes,
+                                random_length,
+                                message.data,
+                                message.size);
+    wipe(bytes, random_length);
+    enum OlmErrorCode error = olm_session_last_error_code(session->olm);
+
+    if (result != olm_error()) session->generation++;
+
+    enif_mutex_unlock(session->lock);
+
+    count_operation(STATS_ENCRYPT,
+                    plaintext.size,
+                    result == olm_error() ? 0 : message.size);
+
+    if (result == olm_error()) {
+        enif_release_binary(&message);
+
+        return make_error(env, error);
+    }
+
+    ERL_NIF_TERM term = enif_make_tuple2(
+        env, enif_make_ulong(env, type), enif_make_binary(env, &message));
+
+    return enif_make_tuple2(env, atom_ok, term);
+}
+
+// Batches of more messages or plaintext bytes than these are moved to a dirty
+// CPU scheduler.
+#define ENCRYPT_MESSAGES_DIRTY_THRESHOLD 32
+#define ENCRYPT_MESSAGES_DIRTY_BYTES     (64 << 10)
+
+// Returns {:error, reason, messages} with the messages encrypted before the
+// one which failed, which have already moved the session's ratchet on.
+static ERL_NIF_TERM
+make_batch_error(ErlNifEnv *env, enum OlmErrorCode code, ERL_NIF_TERM done)
+{
+    enif_make_reverse_list(env, done, &done);
+
+    return enif_make_tuple3(env, atom_error, error_reason(code), done);
+}
+
+static ERL_NIF_TERM
+encrypt_messages_run(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    session_handle *session;
+    get_session(env, argv[0], &session);
+
+    ERL_NIF_TERM list = argv[1];
+    ERL_NIF_TERM head;
+    ERL_NIF_TERM messages = enif_make_list(env, 0);
+
+    ErlNifBinary plaintext;
+
+    unsigned done = 0;
+
+    // Other callers may encrypt with the session between chunks, but the
+    // batch's own messages still come out in order.
+    enif_mutex_lock(session->lock);
+
+    while (enif_get_list_cell(env, list, &head, &list)) {
+        if (done > 0 && done % BATCH_CHUNK_SIZE == 0)
+            yield_lock(session->lock);
+
+        done++;
+        enif_inspect_iolist_as_binary(env, head, &plaintext);
+
+        size_t type = olm_encrypt_message_type(session->olm);
+
+        size_t random_length = olm_encrypt_random_length(session->olm);
+        char   bytes[random_length];
+
+        if (!random_bytes(bytes, random_length)) {
+            enif_mutex_unlock(session->lock);
+
+            return make_batch_error(env, OLM_NOT_ENOUGH_RANDOM, messages);
+        }
+
+        ErlNifBinary message;
+        size_t       message_length =
+            olm_encrypt_message_length(session->olm, plaintext.size);
+        enif_alloc_binary(message_length, &message);
+
+        size_t result = olm_encrypt(session->olm,
+                                    plaintext.data,
+                                    plaintext.size,
+                                    bytes,
+                                    random_length,
+                                    message.data,
+                                    message.size);
+        wipe(bytes, random_length);
+
+        if (result != olm_error()) session->generation++;
+
+        count_operation(STATS_ENCRYPT,
+                        plaintext.size,
+                        result == olm_error() ? 0 : message.size);
+
+        if (type == olm_error() || result == olm_error()) {
+            enum OlmErrorCode error = olm_session_last_error_code(session->olm);
+
+            enif_mutex_unlock(session->lock);
+
+            enif_release_binary(&message);
+
+            return make_batch_error(env, error, messages);
+        }
+
+        ERL_NIF_TERM entry = enif_make_tuple2(
+            env, enif_make_ulong(env, type), enif_make_binary(env, &message));
+        messages = enif_make_list_cell(env, entry, messages);
+    }
+
+    enif_mutex_unlock(session->lock);
+
+    enif_make_reverse_list(env, messages, &messages);
+
+    return enif_make_tuple2(env, atom_ok, messages);
+}
+
+static ERL_NIF_TERM
+encrypt_messages(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    session_handle *session;
+    if (!get_session(env, argv[0], &session)) return enif_make_badarg(env);
+
+    // Check every plaintext before ratcheting, so a bad element can't leave
+    // the session half way through the batch.
+    ERL_NIF_TERM list = argv[1];
+    ERL_NIF_TERM head;
+    ErlNifBinary plaintext;
+    unsigned     length = 0;
+    size_t       bytes  = 0;
+
+    while (enif_get_list_cell(env, list, &head, &list)) {
+        if (!enif_inspect_iolist_as_binary(env, head, &plaintext))
+            return enif_make_badarg(env);
+        length++;
+        bytes += plaintext.size;
+    }
+
+    if (!enif_is_empty_list(env, list)) return enif_make_badarg(env);
+
+    if (length > ENCRYPT_MESSAGES_DIRTY_THRESHOLD ||
+        bytes > ENCRYPT_MESSAGES_DIRTY_BYTES) {
+        return enif_schedule_nif(env,
+                                 "encrypt_messages",
+                                 ERL_NIF_DIRTY_JOB_CPU_BOUND,
+                                 encrypt_messages_run,
+                                 argc,
+                                 argv);
+    }
+
+    return encrypt_messages_run(env, argc, argv);
+}
+
+// Fan-outs to more sessions, or of more plaintext bytes in all, than these
+// are moved to a dirty CPU scheduler.
+#define ENCRYPT_TO_SESSIONS_DIRTY_THRESHOLD 32
+#define ENCRYPT_TO_SESSIONS_DIRTY_BYTES     (64 << 10)
+
+static ERL_NIF_TERM
+encrypt_to_sessions_run(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    ERL_NIF_TERM list = argv[0];
+    ERL_NIF_TERM head;
+    ERL_NIF_TERM messages = enif_make_list(env, 0);
+
+    ErlNifBinary plaintext;
+    enif_inspect_iolist_as_binary(env, argv[1], &plaintext);
+
+    while (enif_get_list_cell(env, list, &head, &list)) {
+        session_handle *session;
+        get_session(env, head, &session);
+
+        // Each session is only locked while encrypting for it.
+        enif_mutex_lock(session->lock);
+
+        size_t type = olm_encrypt_message_type(session->olm);
+
+        size_t random_length = olm_encrypt_random_length(session->olm);
+        char   bytes[random_length];
+
+        if (!random_bytes(bytes, random_length)) {
+            enif_mutex_unlock(session->lock);
+
+            return make_batch_error(env, OLM_NOT_ENOUGH_RANDOM, messages);
+        }
+
+        ErlNifBinary message;
+        size_t       message_length =
+            olm_encrypt_message_length(session->olm, plaintext.size);
+        enif_alloc_binary(message_length, &message);
+
+        size_t result = olm_encrypt(session->olm,
+                                    plaintext.data,
+                                    plaintext.size,
+                                    bytes,
+                                    random_length,
+                                    message.data,
+                                    message.size);
+        wipe(bytes, random_length);
+        enum OlmErrorCode error = olm_session_last_error_code(session->olm);
+
+        if (result != olm_error()) session->generation++;
+
+        enif_mutex_unlock(session->lock);
+
+        count_operation(STATS_ENCRYPT,
+                        plaintext.size,
+                        result == olm_error() ? 0 : message.size);
+
+        if (type == olm_error() || result == olm_error()) {
+            enif_release_binary(&message);
+
+            return make_batch_error(env, error, messages);
+        }
+
+        ERL_NIF_TERM entry = enif_make_tuple3(env,
+                                              head,
+                                              enif_make_ulong(env, type),
+                                              enif_make_binary(env, &message));
+        messages = enif_make_list_cell(env, entry, messages);
+    }
+
+    enif_make_reverse_list(env, messages, &messages);
+
+    return enif_make_tuple2(env, atom_ok, messages);
+}
+
+// Encrypts one plaintext for each session in a list, returning a
+// {session, type, cyphertext} tuple per session in the same order. If a
+// session fails to encrypt, the ones before it are returned with the error.
+static ERL_NIF_TERM
+encrypt_to_sessions(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    // Check every session before ratcheting any of them.
+    ERL_NIF_TERM    list = argv[0];
+    ERL_NIF_TERM    head;
+    session_handle *session;
+    unsigned        length = 0;
+
+    while (enif_get_list_cell(env, list, &head, &list)) {
+        if (!get_session(env, head, &session)) return enif_make_badarg(env);
+        length++;
+    }
+
+    if (!enif_is_empty_list(env, list)) return enif_make_badarg(env);
+
+    ErlNifBinary plaintext;
+    if (!enif_inspect_iolist_as_binary(env, argv[1], &plaintext))
+        return enif_make_badarg(env);
+
+    if (length > ENCRYPT_TO_SESSIONS_DIRTY_THRESHOLD ||
+        (uint64_t) length * plaintext.size > ENCRYPT_TO_SESSIONS_DIRTY_BYTES) {
+        return enif_schedule_nif(env,
+                                 "encrypt_to_sessions",
+                                 ERL_NIF_DIRTY_JOB_CPU_BOUND,
+                                 encrypt_to_sessions_run,
+                                 argc,
+                                 argv);
+    }
+
+    return encrypt_to_sessions_run(env, argc, argv);
+}
+
+static ERL_NIF_TERM
+decrypt_message(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    session_handle *session;
+    if (!get_session(env, argv[0], &session)) return enif_make_badarg(env);
+
+    size_t type;
+    if (!enif_get_ulong(env, argv[1], &type)) return enif_make_badarg(env);
+
+    ErlNifBinary   cyphertext_input;
+    scratch_buffer cyphertext;
+    if (!enif_inspect_iolist_as_binary(env, argv[2], &cyphertext_input))
+        return enif_make_badarg(env);
+    scratch_copy(&cyphertext, &cyphertext_input);
+
+    // olm_decrypt_max_plaintext_length would need a copy of its own, since it
+    // decodes the message in place too, so the plaintext is sized by the
+    // upper bound instead and shrunk to the decrypted length afterwards.
+    ErlNifBinary plaintext;
+    enif_alloc_binary(MAX_PLAINTEXT_LENGTH(cyphertext.size), &plaintext);
+
+    enif_mutex_lock(session->lock);
+
+    size_t result = olm_decrypt(session->olm,
+                                type,
+                                cyphertext.data,
+                                cyphertext.size,
+                                plaintext.data,
+                                plaintext.size);
+    enum OlmErrorCode error = olm_session_last_error_code(session->olm);
+
+    // A message which fails to decrypt leaves the ratchet as it was.
+    if (result != olm_error()) session->generation++;
+
+    enif_mutex_unlock(session->lock);
+
+    count_operation(
+        STATS_DECRYPT, cyphertext.size, result == olm_error() ? 0 : result);
+
+    if (result == olm_error()) {
+        enif_release_binary(&plaintext);
+        scratch_release(&cyphertext);
+
+        return make_error(env, error);
+    }
+
+    // Shrinking in place is cheap, and unlike a sub-binary doesn't keep the
+    // unused bytes alive for as long as the plaintext is.
+    enif_realloc_binary(&plaintext, result);
+
+    ERL_NIF_TERM term = enif_make_binary(env, &plaintext);
+
+    scratch_release(&cyphertext);
+
+    return enif_make_tuple2(env, atom_ok, term);
+}
+
+// Batches larger than this are moved to a dirty CPU scheduler.
+#define DECRYPT_MESSAGES_DIRTY_THRESHOLD 32
+
+typedef struct {
+    int          ok;
+    size_t       offset;
+    size_t       length;
+    ERL_NIF_TERM error;
+} decrypt_result;
+
+static ERL_NIF_TERM
+decrypt_messages_run(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    session_handle *session;
+    get_session(env, argv[0], &session);
+
+    unsigned count;
+    enif_get_list_length(env, argv[1], &count);
+
+    if (count == 0)
+        return enif_make_tuple2(env, atom_ok, enif_make_list(env, 0));
+
+    // Size one scratch buffer for libolm's destructive base64 decode and one
+    // arena which every plaintext is decrypted into back to back.
+    ERL_NIF_TERM list = argv[1];
+    ERL_NIF_TERM head;
+
+    const ERL_NIF_TERM *tuple;
+    int                 arity;
+    ErlNifBinary        cyphertext;
+
+    size_t scratch_size = 0;
+    size_t arena_size   = 0;
+
+    while (enif_get_list_cell(env, list, &head, &list)) {
+        enif_get_tuple(env, head, &arity, &tuple);
+        enif_inspect_iolist_as_binary(env, tuple[1], &cyphertext);
+
+        if (cyphertext.size > scratch_size) scratch_size = cyphertext.size;
+        arena_size += MAX_PLAINTEXT_LENGTH(cyphertext.size);
+    }
+
+    // Empty cyphertexts are still handed to libolm, which fails them, but
+    // need no scratch space.
+    uint8_t        *scratch =
+        scratch_size > 0 ? enif_alloc(scratch_size) : NULL;
+    decrypt_result *results = enif_alloc(count * sizeof(decrypt_result));
+
+    ErlNifBinary arena;
+    enif_alloc_binary(arena_size, &arena);
+
+    size_t   offset = 0;
+    unsigned i      = 0;
+    list            = argv[1];
+
+    enif_mutex_lock(session->lock);
+
+    while (enif_get_list_cell(env, list, &head, &list)) {
+        if (i > 0 && i % BATCH_CHUNK_SIZE == 0) yield_lock(session->lock);
+
+        size_t type;
+
+        enif_get_tuple(env, head, &arity, &tuple);
+        enif_get_ulong(env, tuple[0], &type);
+        enif_inspect_iolist_as_binary(env, tuple[1], &cyphertext);
+
+        if (cyphertext.size > 0)
+            memcpy(scratch, cyphertext.data, cyphertext.size);
+
+        size_t result = olm_decrypt(session->olm,
+                                    type,
+                                    scratch,
+                                    cyphertext.size,
+                                    arena.data + offset,
+                                    arena.size - offset);
+
+        count_operation(STATS_DECRYPT,
+                        cyphertext.size,
+                        result == olm_error() ? 0 : result);
+
+        if (result == olm_error()) {
+            results[i].ok    = 0;
+            results[i].error =
+                error_reason(olm_session_last_error_code(session->olm));
+        } else {
+            results[i].ok     = 1;
+            results[i].offset = offset;
+            results[i].length = result;
+            offset += result;
+            session->generation++;
+        }
+
+        i++;
+    }
+
+    enif_mutex_unlock(session->lock);
+
+    if (scratch) enif_free(scratch);
+
+    // Trim the arena to what was actually decrypted; every plaintext is a
+    // sub-binary of it.
+    enif_realloc_binary(&arena, offset);
+    ERL_NIF_TERM arena_term = enif_make_binary(env, &arena);
+
+    ERL_NIF_TERM plaintexts = enif_make_list(env, 0);
+
+    while (i-- > 0) {
+        ERL_NIF_TERM entry;
+
+        if (results[i].ok) {
+            ERL_NIF_TERM plaintext = enif_make_sub_binary(
+                env, arena_term, results[i].offset, results[i].length);
+            entry = enif_make_tuple2(env, atom_ok, plaintext);
+        } else {
+            entry = enif_make_tuple2(env, atom_error, results[i].error);
+        }
+
+        plaintexts = enif_make_list_cell(env, entry, plaintexts);
+    }
+
+    enif_free(results);
+
+    return enif_make_tuple2(env, atom_ok, plaintexts);
+}
+
+static ERL_NIF_TERM
+decrypt_messages(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    session_handle *session;
+    if (!get_session(env, argv[0], &session)) return enif_make_badarg(env);
+
+    // Validate the whole batch up front so the run never sees a bad element.
+    ERL_NIF_TERM list = argv[1];
+    ERL_NIF_TERM head;
+
+    const ERL_NIF_TERM *tuple;
+    int                 arity;
+    size_t              type;
+    ErlNifBinary        cyphertext;
+    unsigned            length = 0;
+
+    while (enif_get_list_cell(env, list, &head, &list)) {
+        if (!enif_get_tuple(env, head, &arity, &tuple) || arity != 2 ||
+            !enif_get_ulong(env, tuple[0], &type) ||
+            !enif_inspect_iolist_as_binary(env, tuple[1], &cyphertext))
+            return enif_make_badarg(env);
+        length++;
+    }
+
+    if (!enif_is_empty_list(env, list)) return enif_make_badarg(env);
+
+    if (length > DECRYPT_MESSAGES_DIRTY_THRESHOLD) {
+        return enif_schedule_nif(env,
+                                 "decrypt_messages",
+                                 ERL_NIF_DIRTY_JOB_CPU_BOUND,
+                                 decrypt_messages_run,
+                                 argc,
+                                 argv);
+    }
+
+    return decrypt_messages_run(env, argc, argv);
+}
+
+// Messages
+//
+// Headers are read by parse_message_header, see olm_common.c.
+
+static ERL_NIF_TERM
+make_base64_key(ErlNifEnv *env, const uint8_t *key)
+{
+    ERL_NIF_TERM term;
+    uint8_t     *data = enif_make_new_binary(
+        env, BASE64_ENCODED_LENGTH(CURVE25519_KEY_LENGTH), &term);
+
+    base64_encode(key, CURVE25519_KEY_LENGTH, data);
+
+    return term;
+}
+
+// Returns {ratchet_key, chain_index} for a normal message, and
+// {ratchet_key, chain_index, one_time_key, base_key, identity_key} for a pre
+// key message. Keys are unpadded base64, like libolm hands them out.
+static ERL_NIF_TERM
+inspect_message(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    int type;
+    if (!enif_get_int(env, argv[0], &type) ||
+        (type != MESSAGE_TYPE_PRE_KEY && type != MESSAGE_TYPE_NORMAL))
+        return enif_make_badarg(env);
+
+    ErlNifBinary message;
+    if (!enif_inspect_iolist_as_binary(env, argv[1], &message))
+        return enif_make_badarg(env);
+
+    message_header header;
+    if (!parse_message_header(type, message.data, message.size, &header))
+        return make_error(env, OLM_BAD_MESSAGE_FORMAT);
+
+    ERL_NIF_TERM ratchet_key = make_base64_key(env, header.ratchet_key);
+    ERL_NIF_TERM chain_index = enif_make_uint64(env, header.chain_index);
+
+    if (type == MESSAGE_TYPE_NORMAL)
+        return enif_make_tuple2(
+            env, atom_ok, enif_make_tuple2(env, ratchet_key, chain_index));
+
+    ERL_NIF_TERM keys[3];
+
+    for (int i = 0; i < 3; i++)
+        keys[i] = make_base64_key(
+            env, header.pre_key_id + i * CURVE25519_KEY_LENGTH);
+
+    ERL_NIF_TERM term = enif_make_tuple5(
+        env, ratchet_key, chain_index, keys[0], keys[1], keys[2]);
+
+    return enif_make_tuple2(env, atom_ok, term);
+}
+
+// Session index
+//
+// Finds the inbound session a pre key message belongs to by the keys it
+// names, without handing the message to each session in turn.
+
+#define SESSION_INDEX_INITIAL_CAPACITY 16
+
+// The keys come from the message, so a sender could pick base keys which all
+// land in one probe run if they were hashed without the seed.
+static size_t
+session_index_home(const session_index_handle *index, const uint8_t *id)
+{
+    uint64_t hash = siphash(index->seed, id, PRE_KEY_ID_LENGTH);
+
+    return hash & (index->capacity - 1);
+}
+
+// Returns the slot holding id, or the empty slot it would go in.
+static size_t
+session_index_find(const session_index_handle *index, const uint8_t *id)
+{
+    size_t slot = session_index_home(index, id);
+
+    while (index->entries[slot].session &&
+           memcmp(index->entries[slot].id, id, PRE_KEY_ID_LENGTH) != 0)
+        slot = (slot + 1) & (index->capacity - 1);
+
+    return slot;
+}
+
+static void
+session_index_alloc_entries(session_index_handle *index, size_t capacity)
+{
+    size_t size = capacity * sizeof(session_index_entry);
+
+    index->entries  = enif_alloc(size);
+    index->capacity = capacity;
+    memset(index->entries, 0, size);
+}
+
+// Doubles the table once it's three quarters full, which keeps probe runs
+// short.
+static void
+session_index_grow(session_index_handle *index)
+{
+    session_index_entry *entries  = index->entries;
+    size_t               capacity = index->capacity;
+
+    if (index->count * 4 <= capacity * 3) return;
+
+    session_index_alloc_entries(index, capacity * 2);
+
+    for (size_t i = 0; i < capacity; i++)
+        if (entries[i].session)
+            index->entries[session_index_find(index, entries[i].id)] =
+                entries[i];
+
+    enif_free(entries);
+}
+
+// Empties a slot, moving back any later entry of the probe run which could
+// no longer be found across the gap, so no tombstones are needed.
+static void
+session_index_remove(session_index_handle *index, size_t slot)
+{
+    size_t mask = index->capacity - 1;
+    size_t next = (slot + 1) & mask;
+
+    enif_release_resource(index->entries[slot].session);
+
+    while (index->entries[next].session) {
+        size_t home = session_index_home(index, index->entries[next].id);
+
+        if (((next - home) & mask) >= ((next - slot) & mask)) {
+            index->entries[slot] = index->entries[next];
+            slot                 = next;
+        }
+
+        next = (next + 1) & mask;
+    }
+
+    index->entries[slot].session = NULL;
+    index->count--;
+}
+
+static ERL_NIF_TERM
+create_session_index(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    uint8_t seed[SIPHASH_KEY_LENGTH];
+    if (!random_bytes(seed, sizeof(seed)))
+        return make_error(env, OLM_NOT_ENOUGH_RANDOM);
+
+    session_index_handle *index = enif_alloc_resource(
+        session_index_resource, sizeof(session_index_handle));
+
+    memcpy(index->seed, seed, sizeof(seed));
+    index->lock  = enif_mutex_create("olm_session_index");
+    index->count = 0;
+    session_index_alloc_entries(index, SESSION_INDEX_INITIAL_CAPACITY);
+
+    if (index->lock == NULL) {
+        enif_release_resource(index);
+
+        return make_errno_error(env, ENOMEM);
+    }
+
+    ERL_NIF_TERM term = enif_make_resource(env, index);
+    enif_release_resource(index);
+
+    return enif_make_tuple2(env, atom_ok, term);
+}
+
+// Adds an inbound session under the keys of the message which created it,
+// or, given a pre key message for the session, under the keys of that one.
+// The second form is for sessions restored from a pickle, which doesn't hold
+// the keys.
+static ERL_NIF_TERM
+session_index_put(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    session_index_handle *index;
+    if (!get_session_index(env, argv[0], &index)) return enif_make_badarg(env);
+
+    session_handle *session;
+    if (!get_session(env, argv[1], &session)) return enif_make_badarg(env);
+
+    ErlNifBinary message_input;
+    if (argc == 3 &&
+        !enif_inspect_iolist_as_binary(env, argv[2], &message_input))
+        return enif_make_badarg(env);
+
+    uint8_t id[PRE_KEY_ID_LENGTH];
+    int     matches = 1;
+
+    if (argc == 3 &&
+        !parse_pre_key_id(message_input.data, message_input.size, id))
+        return make_error(env, OLM_BAD_MESSAGE_FORMAT);
+
+    enif_mutex_lock(session->lock);
+
+    if (argc == 3) {
+        scratch_buffer message;
+        scratch_copy(&message, &message_input);
+
+        matches = olm_matches_inbound_session(
+                      session->olm, message.data, message.size) == 1;
+
+        if (matches) {
+            memcpy(session->pre_key_id, id, PRE_KEY_ID_LENGTH);
+            session->has_pre_key_id = 1;
+        }
+
+        scratch_release(&message);
+    } else {
+        matches = session->has_pre_key_id;
+        memcpy(id, session->pre_key_id, PRE_KEY_ID_LENGTH);
+    }
+
+    enif_mutex_unlock(session->lock);
+
+    if (!matches) return enif_make_tuple2(env, atom_error, atom_not_inbound);
+
+    enif_mutex_lock(index->lock);
+
+    size_t slot = session_index_find(index, id);
+
+    enif_keep_resource(session);
+
+    if (index->entries[slot].session) {
+        enif_release_resource(index->entries[slot].session);
+    } else {
+        memcpy(index->entries[slot].id, id, PRE_KEY_ID_LENGTH);
+        index->count++;
+    }
+
+    index->entries[slot].session = session;
+    session_index_grow(index);
+
+    enif_mutex_unlock(index->lock);
+
+    return atom_ok;
+}
+
+static ERL_NIF_TERM
+session_index_lookup(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    session_index_handle *index;
+    if (!get_session_index(env, argv[0], &index)) return enif_make_badarg(env);
+
+    ErlNifBinary message;
+    if (!enif_inspect_iolist_as_binary(env, argv[1], &message))
+        return enif_make_badarg(env);
+
+    uint8_t id[PRE_KEY_ID_LENGTH];
+    if (!parse_pre_key_id(message.data, message.size, id))
+        return make_error(env, OLM_BAD_MESSAGE_FORMAT);
+
+    enif_mutex_lock(index->lock);
+
+    size_t          slot    = session_index_find(index, id);
+    session_handle *session = index->entries[slot].session;
+    ERL_NIF_TERM    term    = session ? enif_make_resource(env, session) : 0;
+
+    enif_mutex_unlock(index->lock);
+
+    if (!session) return enif_make_tuple2(env, atom_error, atom_not_found);
+
+    return enif_make_tuple2(env, atom_ok, term);
+}
+
+static ERL_NIF_TERM
+session_index_delete(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    session_index_handle *index;
+    if (!get_session_index(env, argv[0], &index)) return enif_make_badarg(env);
+
+    session_handle *session;
+    if (!get_session(env, argv[1], &session)) return enif_make_badarg(env);
+
+    uint8_t id[PRE_KEY_ID_LENGTH];
+
+    enif_mutex_lock(session->lock);
+
+    int has_pre_key_id = session->has_pre_key_id;
+    memcpy(id, session->pre_key_id, PRE_KEY_ID_LENGTH);
+
+    enif_mutex_unlock(session->lock);
+
+    if (!has_pre_key_id) return atom_ok;
+
+    enif_mutex_lock(index->lock);
+
+    size_t slot = session_index_find(index, id);
+
+    // Another session may have replaced this one under the same keys.
+    if (index->entries[slot].session == session)
+        session_index_remove(index, slot);
+
+    enif_mutex_unlock(index->lock);
+
+    return atom_ok;
+}
+
+static ERL_NIF_TERM
+session_index_size(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    session_index_handle *index;
+    if (!get_session_index(env, argv[0], &index)) return enif_make_badarg(env);
+
+    enif_mutex_lock(index->lock);
+
+    size_t count = index->count;
+
+    enif_mutex_unlock(index->lock);
+
+    return enif_make_ulong(env, count);
+}
+
+// Session journal
+//
+// An append-only file of {session id, generation, raw pickle} records. The
+// file is mapped into memory and indexed by session id when it's opened, and
+// a session is only unpickled when it's loaded.
+//
+// A writer appends its record under the journal's lock and then waits for an
+// fsync covering it. One fsync runs at a time and covers every record
+// appended before it started, so writers arriving while it runs share the
+// next one instead of each syncing on their own.
+//
+// Deleting a session appends a record without a pickle. Once most of a large
+// file is records which have been superseded, the live ones are copied into
+// a new file which replaces it.
+
+#define JOURNAL_MAGIC      "OLMJRNL1"
+#define JOURNAL_MAGIC_SIZE 8
+
+#define JOURNAL_INDEX_INITIAL_CAPACITY 64
+
+// Files smaller than this are never compacted.
+#define JOURNAL_COMPACT_MIN_SIZE (4 << 20)
+
+// Live records are copied into a compacted file in writes of this size.
+#define JOURNAL_COMPACT_BUFFER_SIZE (64 << 10)
+
+#define FNV1A_INITIAL 0xcbf29ce484222325ULL
+#define FNV1A_PRIME   0x100000001b3ULL
+
+// Records are written in the host's byte order, followed by the id and the
+// pickle. The checksum covers everything after it, so a record torn by a
+// crash is found when the file is next opened.
+typedef struct {
+    uint64_t checksum;
+    uint64_t generation;
+    uint32_t id_length;
+    uint32_t pickle_length;
+} journal_record_header;
+
+#define JOURNAL_HEADER_SIZE sizeof(journal_record_header)
+
+static uint64_t
+fnv1a(uint64_t hash, const uint8_t *data, size_t length)
+{
+    for (size_t i = 0; i < length; i++) hash = (hash ^ data[i]) * FNV1A_PRIME;
+
+    return hash;
+}
+
+// Records start at any offset in the file, so headers are copied out of it
+// rather than read in place.
+static uint64_t
+journal_checksum(const uint8_t *record, const journal_record_header *header)
+{
+    size_t length = JOURNAL_HEADER_SIZE - sizeof(header->checksum) +
+                    header->id_length + header->pickle_length;
+
+    return fnv1a(FNV1A_INITIAL, record + sizeof(header->checksum), length);
+}
+
+// Writes all of buffer at offset. Returns 0 or an errno value.
+static int
+write_fully(int fd, const void *buffer, size_t length, uint64_t offset)
+{
+    const uint8_t *data = buffer;
+
+    while (length > 0) {
+        ssize_t written = pwrite(fd, data, length, offset);
+
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return errno;
+        }
+
+        data += written;
+        length -= written;
+        offset += written;
+    }
+
+    return 0;
+}
+
+// Makes the creation or renaming of a file durable. Failing to is not an
+// error, the file itself is complete either way.
+static void
+sync_directory(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    size_t      length = slash ? (slash == path ? 1 : slash - path) : 1;
+    char        directory[length + 1];
+
+    memcpy(directory, slash ? path : ".", length);
+    directory[length] = '\0';
+
+    int fd = open(directory, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return;
+
+    fsync(fd);
+    close(fd);
+}
+
+static uint64_t
+journal_hash(const journal_handle *journal,
+             const uint8_t        *id,
+             size_t                id_length)
+{
+    return siphash(journal->seed, id, id_length);
+}
+
+// Returns the slot holding id, or the empty slot it would go in.
+static size_t
+journal_find(const journal_handle *journal,
+             const uint8_t        *id,
+             size_t                id_length,
+             uint64_t              hash)
+{
+    size_t mask = journal->capacity - 1;
+    size_t slot = hash & mask;
+
+    while (journal->entries[slot].id &&
+           (journal->entries[slot].hash != hash ||
+            journal->entries[slot].id_length != id_length ||
+            memcmp(journal->entries[slot].id, id, id_length) != 0))
+        slot = (slot + 1) & mask;
+
+    return slot;
+}
+
+static void
+journal_alloc_entries(journal_handle *journal, size_t capacity)
+{
+    size_t size = capacity * sizeof(journal_entry);
+
+    journal->entries  = enif_alloc(size);
+    journal->capacity = capacity;
+    memset(journal->entries, 0, size);
+}
+
+// Doubles the table once it's three quarters full, like session_index_grow.
+static void
+journal_grow(journal_handle *journal)
+{
+    journal_entry *entries  = journal->entries;
+    size_t         capacity = journal->capacity;
+
+    if (journal->count * 4 <= capacity * 3) return;
+
+    journal_alloc_entries(journal, capacity * 2);
+
+    for (size_t i = 0; i < capacity; i++) {
+        if (!entries[i].id) continue;
+
+        size_t slot = entries[i].hash & (journal->capacity - 1);
+
+        while (journal->entries[slot].id)
+            slot = (slot + 1) & (journal->capacity - 1);
+
+        journal->entries[slot] = entries[i];
+    }
+
+    enif_free(entries);
+}
+
+// Points the index at the latest record of a session.
+static void
+journal_index_put(journal_handle *journal,
+                  const uint8_t  *id,
+                  uint32_t        id_length,
+                  uint64_t        offset,
+                  uint32_t        size,
+                  uint64_t        generation)
+{
+    uint64_t       hash  = journal_hash(journal, id, id_length);
+    journal_entry *entry = &journal->entries[journal_find(
+        journal, id, id_length, hash)];
+
+    if (entry->id) {
+        journal->live_bytes -= entry->size;
+    } else {
+        entry->id        = enif_alloc(id_length);
+        entry->id_length = id_length;
+        entry->hash      = hash;
+        memcpy(entry->id, id, id_length);
+        journal->count++;
+    }
+
+    entry->offset     = offset;
+    entry->size       = size;
+    entry->generation = generation;
+    journal->live_bytes += size;
+
+    journal_grow(journal);
+}
+
+// Removes a session from the index, moving back later entries of its probe
+// run like session_index_remove.
+static void
+journal_index_remove(journal_handle *journal,
+                     const uint8_t  *id,
+                     uint32_t        id_length)
+{
+    uint64_t hash = journal_hash(journal, id, id_length);
+    size_t   mask = journal->capacity - 1;
+    size_t   slot = journal_find(journal, id, id_length, hash);
+    size_t   next = (slot + 1) & mask;
+
+    if (!journal->entries[slot].id) return;
+
+    journal->live_bytes -= journal->entries[slot].size;
+    enif_free(journal->entries[slot].id);
+
+    while (journal->entries[next].id) {
+        size_t home = journal->entries[next].hash & mask;
+
+        if (((next - home) & mask) >= ((next - slot) & mask)) {
+            journal->entries[slot] = journal->entries[next];
+            slot                   = next;
+        }
+
+        next = (next + 1) & mask;
+    }
+
+    journal->entries[slot].id = NULL;
+    journal->count--;
+}
+
+// Maps the file with room for it to double, so appends don't need it mapped
+// again until then. Returns 0 or an errno value.
+static int
+journal_map(journal_handle *journal)
+{
+    size_t size = journal->end * 2;
+
+    if (journal->map) munmap((void *) journal->map, journal->map_size);
+
+    void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, journal->fd, 0);
+
+    if (map == MAP_FAILED) {
+        journal->map      = NULL;
+        journal->map_size = 0;
+
+        return errno;
+    }
+
+    journal->map      = map;
+    journal->map_size = size;
+
+    return 0;
+}
+
+// Returns the record an entry points at, mapping the file again if it was
+// appended past the mapping, or NULL with errno set if that fails.
+static const uint8_t *
+journal_record(journal_handle *journal, const journal_entry *entry)
+{
+    if (entry->offset + entry->size > journal->map_size) {
+        int error = journal_map(journal);
+
+        if (error) {
+            errno = error;
+            return NULL;
+        }
+    }
+
+    return journal->map + entry->offset;
+}
+
+// Indexes the mapped records from offset up to size, stopping at the first
+// one which is torn or fails its checksum. Returns the offset it stopped at.
+static uint64_t
+journal_index_records(journal_handle *journal, uint64_t offset, uint64_t size)
+{
+    while (size - offset >= JOURNAL_HEADER_SIZE) {
+        const uint8_t        *record = journal->map + offset;
+        journal_record_header header;
+
+        memcpy(&header, record, JOURNAL_HEADER_SIZE);
+
+        uint64_t record_size = JOURNAL_HEADER_SIZE +
+                               (uint64_t) header.id_length +
+                               header.pickle_length;
+
+        if (header.id_length == 0 || record_size > size - offset ||
+            record_size > UINT32_MAX ||
+            journal_checksum(record, &header) != header.checksum)
+            break;
+
+        const uint8_t *id = record + JOURNAL_HEADER_SIZE;
+
+        if (header.pickle_length == 0)
+            journal_index_remove(journal, id, header.id_length);
+        else
+            journal_index_put(journal,
+                              id,
+                              header.id_length,
+                              offset,
+                              record_size,
+                              header.generation);
+
+        offset += record_size;
+    }
+
+    return offset;
+}
+
+// Indexes the records of a mapped file of the given size. Returns 0 if the
+// file isn't a journal.
+static int
+journal_scan(journal_handle *journal, uint64_t size)
+{
+    if (size < JOURNAL_MAGIC_SIZE ||
+        memcmp(journal->map, JOURNAL_MAGIC, JOURNAL_MAGIC_SIZE) != 0)
+        return 0;
+
+    journal->end     = journal_index_records(journal, JOURNAL_MAGIC_SIZE, size);
+    journal->indexed = journal->end;
+
+    return 1;
+}
+
+// Opens and indexes the journal's file, creating it if it doesn't exist, and
+// cuts off anything after the last whole record. Returns 0, an errno value,
+// or -1 if the file isn't a journal.
+static int
+journal_open_file(journal_handle *journal)
+{
+    journal->fd = open(journal->path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (journal->fd == -1) return errno;
+
+    // Two journals appending to one file would interleave their records.
+    if (flock(journal->fd, LOCK_EX | LOCK_NB) != 0) return errno;
+
+    struct stat st;
+    if (fstat(journal->fd, &st) != 0) return errno;
+    if (!S_ISREG(st.st_mode)) return EISDIR;
+
+    if (st.st_size == 0) {
+        int error = write_fully(
+            journal->fd, JOURNAL_MAGIC, JOURNAL_MAGIC_SIZE, 0);
+        if (error) return error;
+        if (fsync(journal->fd) != 0) return errno;
+
+        sync_directory(journal->path);
+        st.st_size = JOURNAL_MAGIC_SIZE;
+    }
+
+    journal->end = st.st_size;
+
+    int error = journal_map(journal);
+    if (error) return error;
+
+    if (!journal_scan(journal, st.st_size)) return -1;
+
+    if (journal->end < (uint64_t) st.st_size &&
+        ftruncate(journal->fd, journal->end) != 0)
+        return errno;
+
+    return 0;
+}
+
+// Marks the bytes appended up to `appended`, which end at offset `end` of the
+// file, as synced, and indexes the records in them. Returns 0 or an errno
+// value.
+static int
+journal_mark_synced(journal_handle *journal, uint64_t appended, uint64_t end)
+{
+    if (appended > journal->synced) journal->synced = appended;
+    if (end <= journal->indexed) return 0;
+
+    if (end > journal->map_size) {
+        int error = journal_map(journal);
+        if (error) return error;
+    }
+
+    journal->indexed = journal_index_records(journal, journal->indexed, end);
+
+    return 0;
+}
+
+// Waits until the first `appended` bytes ever appended have been synced,
+// syncing them itself unless another writer already is. Must be called with
+// the journal locked. Returns 0 or an errno value, which every later call
+// returns as well: the records may or may not have reached the disk, and
+// after a failed fsync the kernel may not report the lost writes again.
+static int
+journal_sync(journal_handle *journal, uint64_t appended)
+{
+    while (journal->synced < appended) {
+        if (journal->error) return journal->error;
+
+        if (journal->syncing) {
+            enif_cond_wait(journal->sync_done, journal->lock);
+            continue;
+        }
+
+        // The sync covers the records of writers which come to wait for it.
+        uint64_t target = journal->appended;
+        uint64_t end    = journal->end;
+        int      fd     = journal->fd;
+
+        journal->syncing = 1;
+        enif_mutex_unlock(journal->lock);
+
+        int error = fsync(fd) == 0 ? 0 : errno;
+
+        enif_mutex_lock(journal->lock);
+        journal->syncing = 0;
+        if (!error) error = journal_mark_synced(journal, target, end);
+        if (error) journal->error = error;
+        enif_cond_broadcast(journal->sync_done);
+    }
+
+    return 0;
+}
+
+// Appends a record whose header has everything but its checksum filled in,
+// and waits for it to be synced and indexed. Must be called with the journal
+// locked and open. Returns 0 or an errno value.
+static int
+journal_append(journal_handle *journal, uint8_t *record)
+{
+    journal_record_header header;
+    memcpy(&header, record, JOURNAL_HEADER_SIZE);
+
+    uint32_t size = JOURNAL_HEADER_SIZE + header.id_length +
+                    header.pickle_length;
+
+    header.checksum = journal_checksum(record, &header);
+    memcpy(record, &header, JOURNAL_HEADER_SIZE);
+
+    int error = write_fully(journal->fd, record, size, journal->end);
+    if (error) return error;
+
+    journal->end += size;
+    journal->appended += size;
+
+    return journal_sync(journal, journal->appended);
+}
+
+// Allocates a record for a session, filling in its header and id. The pickle
+// goes after the id.
+static uint8_t *
+journal_new_record(const uint8_t *id,
+                   uint32_t       id_length,
+                   uint64_t       generation,
+                   uint32_t       pickle_length)
+{
+    journal_record_header header = {.generation    = generation,
+                                    .id_length     = id_length,
+                                    .pickle_length = pickle_length};
+    uint8_t              *record = enif_alloc(
+        JOURNAL_HEADER_SIZE + id_length + pickle_length);
+
+    memcpy(record, &header, JOURNAL_HEADER_SIZE);
+    memcpy(record + JOURNAL_HEADER_SIZE, id, id_length);
+
+    return record;
+}
+
+// Whether most of a large enough file is superseded records.
+static int
+journal_needs_compaction(const journal_handle *journal)
+{
+    return journal->end > JOURNAL_COMPACT_MIN_SIZE &&
+           journal->end > 2 * (journal->live_bytes + JOURNAL_MAGIC_SIZE);
+}
+
+// Copies the live records into a new file, which is synced and then renamed
+// over the journal's. Must be called with the journal locked and open.
+// Returns 0 or an errno value, in which case the old file is kept.
+static int
+journal_compact_file(journal_handle *journal)
+{
+    // The file can't be swapped out from under a writer syncing it, and
+    // records aren't copied unless they're synced and indexed.
+    int error;
+
+    while (!(error = journal_sync(journal, journal->appended)) &&
+           journal->syncing)
+        enif_cond_wait(journal->sync_done, journal->lock);
+
+    if (error) return error;
+    if (journal->fd == -1) return 0;
+
+    size_t path_length = strlen(journal->path);
+    char   compact_path[path_length + sizeof(".compact")];
+
+    memcpy(compact_path, journal->path, path_length);
+    memcpy(compact_path + path_length, ".compact", sizeof(".compact"));
+
+    int fd = open(
+        compact_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1) return errno;
+
+    uint64_t *offsets = enif_alloc(journal->capacity * sizeof(uint64_t));
+    uint8_t  *buffer  = enif_alloc(JOURNAL_COMPACT_BUFFER_SIZE);
+    size_t    used    = JOURNAL_MAGIC_SIZE;
+    uint64_t  flushed = 0;
+
+    error = flock(fd, LOCK_EX | LOCK_NB) == 0 ? 0 : errno;
+
+    memcpy(buffer, JOURNAL_MAGIC, JOURNAL_MAGIC_SIZE);
+
+    for (size_t i = 0; !error && i < journal->capacity; i++) {
+        const journal_entry *entry = &journal->entries[i];
+        if (!entry->id) continue;
+
+        const uint8_t *record = journal_record(journal, entry);
+
+        if (!record) {
+            error = errno;
+            break;
+        }
+
+        offsets[i] = flushed + used;
+
+        if (used + entry->size > JOURNAL_COMPACT_BUFFER_SIZE) {
+            error = write_fully(fd, buffer, used, flushed);
+            flushed += used;
+            used = 0;
+        }
+
+        // Records larger than the buffer are written straight away.
+        if (!error && entry->size > JOURNAL_COMPACT_BUFFER_SIZE) {
+            error = write_fully(fd, record, entry->size, flushed);
+            flushed += entry->size;
+        } else if (!error) {
+            memcpy(buffer + used, record, entry->size);
+            used += entry->size;
+        }
+    }
+
+    if (!error) error = write_fully(fd, buffer, used, flushed);
+    if (!error && fsync(fd) != 0) error = errno;
+    if (!error && rename(compact_path, journal->path) != 0) error = errno;
+
+    enif_free(buffer);
+
+    if (error) {
+        close(fd);
+        unlink(compact_path);
+        enif_free(offsets);
+
+        return error;
+    }
+
+    sync_directory(journal->path);
+    close(journal->fd);
+
+    for (size_t i = 0; i < journal->capacity; i++)
+        if (journal->entries[i].id) journal->entries[i].offset = offsets[i];
+
+    enif_free(offsets);
+
+    // Everything appended so far is in the new file, which is synced.
+    journal->fd      = fd;
+    journal->end     = flushed + used;
+    journal->indexed = journal->end;
+    journal->synced  = journal->appended;
+    enif_cond_broadcast(journal->sync_done);
+
+    // A failed mapping is tried again on the next read.
+    journal_map(journal);
+
+    return 0;
+}
+
+// Returns {:error, :closed} if the journal is closed, or {:error, reason}
+// with the error a sync failed with, and unlocks it. Returns 0 if it can be
+// used, leaving it locked. Must be called with the journal locked.
+static ERL_NIF_TERM
+journal_check(ErlNifEnv *env, journal_handle *journal)
+{
+    int closed = journal->fd == -1;
+    int error  = journal->error;
+
+    if (!closed && !error) return 0;
+
+    enif_mutex_unlock(journal->lock);
+
+    if (closed) return enif_make_tuple2(env, atom_error, atom_closed);
+
+    return make_errno_error(env, error);
+}
+
+// Appends a record and compacts the file if it's due. Returns :ok or
+// {:error, reason}.
+static ERL_NIF_TERM
+journal_write(ErlNifEnv *env, journal_handle *journal, uint8_t *record)
+{
+    enif_mutex_lock(journal->lock);
+
+    ERL_NIF_TERM unusable = journal_check(env, journal);
+    if (unusable) return unusable;
+
+    int error = journal_append(journal, record);
+
+    // The record is already synced, so failing to compact isn't an error.
+    if (!error && journal_needs_compaction(journal))
+        journal_compact_file(journal);
+
+    enif_mutex_unlock(journal->lock);
+
+    if (error) return make_errno_error(env, error);
+
+    return atom_ok;
+}
+
+// Opens the journal at a path, creating it if it doesn't exist. A file can
+// only be open in one journal at a time.
+static ERL_NIF_TERM
+journal_open(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    ErlNifBinary path;
+    if (!enif_inspect_iolist_as_binary(env, argv[0], &path) ||
+        path.size == 0 || memchr(path.data, '\0', path.size))
+        return enif_make_badarg(env);
+
+    uint8_t seed[SIPHASH_KEY_LENGTH];
+    if (!random_bytes(seed, sizeof(seed)))
+        return make_error(env, OLM_NOT_ENOUGH_RANDOM);
+
+    journal_handle *journal = enif_alloc_resource(
+        journal_resource, sizeof(journal_handle));
+
+    memset(journal, 0, sizeof(journal_handle));
+    memcpy(journal->seed, seed, sizeof(seed));
+    journal->lock      = enif_mutex_create("olm_journal");
+    journal->sync_done = enif_cond_create("olm_journal_sync_done");
+    journal->fd        = -1;
+    journal->path      = enif_alloc(path.size + 1);
+    memcpy(journal->path, path.data, path.size);
+    journal->path[path.size] = '\0';
+    journal_alloc_entries(journal, JOURNAL_INDEX_INITIAL_CAPACITY);
+
+    int error = journal->lock && journal->sync_done
+                    ? journal_open_file(journal)
+                    : ENOMEM;
+
+    if (error) {
+        enif_release_resource(journal);
+
+        if (error == -1)
+            return enif_make_tuple2(env, atom_error, atom_bad_journal);
+
+        return make_errno_error(env, error);
+    }
+
+    ERL_NIF_TERM term = enif_make_resource(env, journal);
+    enif_release_resource(journal);
+
+    return enif_make_tuple2(env, atom_ok, term);
+}
+
+// Syncs and closes the file. Later calls with the journal return
+// {:error, :closed}.
+static ERL_NIF_TERM
+journal_close(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    journal_handle *journal;
+    if (!get_journal(env, argv[0], &journal)) return enif_make_badarg(env);
+
+    enif_mutex_lock(journal->lock);
+
+    while (journal->syncing)
+        enif_cond_wait(journal->sync_done, journal->lock);
+
+    int error = 0;
+
+    // Writes made after a failed sync aren't known to be on disk either.
+    if (journal->fd != -1) {
+        error = journal->error;
+
+        if (!error && fsync(journal->fd) != 0) error = errno;
+        if (!error)
+            journal_mark_synced(journal, journal->appended, journal->end);
+
+        journal->error = error;
+        enif_cond_broadcast(journal->sync_done);
+
+        if (journal->map) munmap((void *) journal->map, journal->map_size);
+        close(journal->fd);
+
+        journal->map      = NULL;
+        journal->map_size = 0;
+        journal->fd       = -1;
+    }
+
+    enif_mutex_unlock(journal->lock);
+
+    return error ? make_errno_error(env, error) : atom_ok;
+}
+
+// Appends a raw pickle under a session id.
+static ERL_NIF_TERM
+journal_put(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    journal_handle *journal;
+    if (!get_journal(env, argv[0], &journal)) return enif_make_badarg(env);
+
+    ErlNifBinary id;
+    if (!enif_inspect_iolist_as_binary(env, argv[1], &id))
+        return enif_make_badarg(env);
+
+    ErlNifUInt64 generation;
+    if (!enif_get_uint64(env, argv[2], &generation))
+        return enif_make_badarg(env);
+
+    ErlNifBinary pickled;
+    if (!enif_inspect_iolist_as_binary(env, argv[3], &pickled))
+        return enif_make_badarg(env);
+
+    if (id.size == 0 || pickled.size == 0 ||
+        JOURNAL_HEADER_SIZE + id.size + pickled.size > UINT32_MAX)
+        return enif_make_badarg(env);
+
+    uint8_t *record = journal_new_record(
+        id.data, id.size, generation, pickled.size);
+
+    memcpy(record + JOURNAL_HEADER_SIZE + id.size, pickled.data, pickled.size);
+
+    ERL_NIF_TERM term = journal_write(env, journal, record);
+    enif_free(record);
+
+    return term;
+}
+
+// Pickles a session in the raw format straight into a record, under its
+// session id and at its generation.
+static ERL_NIF_TERM
+journal_put_session(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    journal_handle *journal;
+    if (!get_journal(env, argv[0], &journal)) return enif_make_badarg(env);
+
+    session_handle *session;
+    if (!get_session(env, argv[1], &session)) return enif_make_badarg(env);
+
+    ErlNifBinary key;
+    if (!enif_inspect_iolist_as_binary(env, argv[2], &key))
+        return enif_make_badarg(env);
+
+    enif_mutex_lock(session->lock);
+
+    journal_record_header header = {
+        .generation = session->generation,
+        .id_length  = olm_session_id_length(session->olm)};
+    size_t   pickled_length = olm_pickle_session_length(session->olm);
+    uint8_t *record         = enif_alloc(
+        JOURNAL_HEADER_SIZE + header.id_length + pickled_length);
+    uint8_t *id      = record + JOURNAL_HEADER_SIZE;
+    uint8_t *pickled = id + header.id_length;
+
+    size_t result = olm_session_id(session->olm, id, header.id_length);
+
+    if (result != olm_error())
+        result = olm_pickle_session(
+            session->olm, key.data, key.size, pickled, pickled_length);
+
+    enum OlmErrorCode error = olm_session_last_error_code(session->olm);
+
+    enif_mutex_unlock(session->lock);
+
+    count_operation(STATS_PICKLE, 0, result == olm_error() ? 0 : result);
+
+    if (result == olm_error()) {
+        enif_free(record);
+
+        return make_error(env, error);
+    }
+
+    base64_decode(pickled, result, pickled);
+
+    header.pickle_length = BASE64_DECODED_LENGTH(result);
+    memcpy(record, &header, JOURNAL_HEADER_SIZE);
+
+    ERL_NIF_TERM term = journal_write(env, journal, record);
+    enif_free(record);
+
+    return term;
+}
+
+// Appends a record deleting a session, if the journal has one with the id.
+static ERL_NIF_TERM
+journal_delete(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    journal_handle *journal;
+    if (!get_journal(env, argv[0], &journal)) return enif_make_badarg(env);
+
+    ErlNifBinary id;
+    if (!enif_inspect_iolist_as_binary(env, argv[1], &id) || id.size == 0 ||
+        id.size > UINT32_MAX - JOURNAL_HEADER_SIZE)
+        return enif_make_badarg(env);
+
+    uint64_t hash = journal_hash(journal, id.data, id.size);
+
+    enif_mutex_lock(journal->lock);
+
+    ERL_NIF_TERM unusable = journal_check(env, journal);
+    if (unusable) return unusable;
 
-    // Return {:ok, pickled} or {:error, last_error}.
-    if (result == olm_error()) {
-        ERL_NIF_TERM error_atom    = enif_make_atom(env, "error");
-        ERL_NIF_TERM error_message = enif_make_string(
-            env, olm_account_last_error(account), ERL_NIF_LATIN1);
+    // A record of the session may be appended but not indexed yet.
+    int error = journal_sync(journal, journal->appended);
 
-        enif_release_binary(&pickled);
+    if (error) {
+        enif_mutex_unlock(journal->lock);
 
-        return enif_make_tuple2(env, error_atom, error_message);
+        return make_errno_error(env, error);
     }
 
-    ERL_NIF_TERM ok_atom = enif_make_atom(env, "ok");
-    ERL_NIF_TERM term    = enif_make_binary(env, &pickled);
+    size_t slot  = journal_find(journal, id.data, id.size, hash);
+    int    found = journal->entries[slot].id != NULL;
 
-    return enif_make_tuple2(env, ok_atom, term);
+    enif_mutex_unlock(journal->lock);
+
+    if (!found) return atom_ok;
+
+    uint8_t     *record = journal_new_record(id.data, id.size, 0, 0);
+    ERL_NIF_TERM term   = journal_write(env, journal, record);
+    enif_free(record);
+
+    return term;
 }
 
+// Returns {:ok, pickled, generation} with the latest raw pickle stored under
+// an id.
 static ERL_NIF_TERM
-unpickle_account(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+journal_fetch(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-    ErlNifBinary pickled, pickled_input;
-    ErlNifBinary key;
+    journal_handle *journal;
+    if (!get_journal(env, argv[0], &journal)) return enif_make_badarg(env);
 
-    // Read args.
-    enif_inspect_binary(env, argv[0], &pickled_input);
-    enif_alloc_binary(pickled_input.size, &pickled);
-    memcpy(pickled.data, pickled_input.data, pickled_input.size);
+    ErlNifBinary id;
+    if (!enif_inspect_iolist_as_binary(env, argv[1], &id))
+        return enif_make_badarg(env);
 
-    enif_inspect_binary(env, argv[1], &key);
+    uint64_t hash = journal_hash(journal, id.data, id.size);
 
-    // Initialise account memory.
-    size_t      account_size = olm_account_size();
-    OlmAccount *memory  = enif_alloc_resource(account_resource, account_size);
-    OlmAccount *account = olm_account(memory);
+    enif_mutex_lock(journal->lock);
 
-    size_t result = olm_unpickle_account(
-        account, key.data, key.size, pickled.data, pickled.size);
+    ERL_NIF_TERM unusable = journal_check(env, journal);
+    if (unusable) return unusable;
 
-    // Return {:ok, account_ref} or {:error, last_error}.
-    if (result == olm_error()) {
-        ERL_NIF_TERM error_atom    = enif_make_atom(env, "error");
-        ERL_NIF_TERM error_message = enif_make_string(
-            env, olm_account_last_error(account), ERL_NIF_LATIN1);
+    const journal_entry *entry = &journal->entries[journal_find(
+        journal, id.data, id.size, hash)];
 
-        enif_release_resource(account);
-        enif_release_binary(&pickled);
+    if (!entry->id) {
+        enif_mutex_unlock(journal->lock);
 
-        return enif_make_tuple2(env, error_atom, error_message);
+        return enif_make_tuple2(env, atom_error, atom_not_found);
     }
 
-    ERL_NIF_TERM ok_atom = enif_make_atom(env, "ok");
-    ERL_NIF_TERM term    = enif_make_resource(env, account);
+    const uint8_t *record = journal_record(journal, entry);
 
-    enif_release_resource(account);
-    enif_release_binary(&pickled);
+    if (!record) {
+        int error = errno;
+        enif_mutex_unlock(journal->lock);
+
+        return make_errno_error(env, error);
+    }
+
+    size_t pickled_length = entry->size - JOURNAL_HEADER_SIZE -
+                            entry->id_length;
+
+    ERL_NIF_TERM pickled;
+    uint8_t     *data = enif_make_new_binary(env, pickled_length, &pickled);
+
+    memcpy(data,
+           record + JOURNAL_HEADER_SIZE + entry->id_length,
+           pickled_length);
+
+    uint64_t generation = entry->generation;
 
-    return enif_make_tuple2(env, ok_atom, term);
+    enif_mutex_unlock(journal->lock);
+
+    return enif_make_tuple3(
+        env, atom_ok, pickled, enif_make_uint64(env, generation));
 }
 
+// Unpickles the latest session stored under an id, like
+// unpickle_session_raw. The pickle is re-encoded straight out of the mapped
+// file, and the journal is unlocked before it's unpickled.
 static ERL_NIF_TERM
-account_identity_keys(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+journal_load_session(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-    OlmAccount *account;
-    enif_get_resource(env, argv[0], account_resource, (void **) &account);
+    journal_handle *journal;
+    if (!get_journal(env, argv[0], &journal)) return enif_make_badarg(env);
 
-    // Allocate memory for identity keys.
-    ErlNifBinary identity_keys;
-    size_t       keys_length = olm_account_identity_keys_length(account);
-    enif_alloc_binary(keys_length, &identity_keys);
+    ErlNifBinary id;
+    if (!enif_inspect_iolist_as_binary(env, argv[1], &id))
+        return enif_make_badarg(env);
 
-    size_t result = olm_account_identity_keys(
-        account, identity_keys.data, identity_keys.size);
+    ErlNifBinary key;
+    if (!enif_inspect_iolist_as_binary(env, argv[2], &key))
+        return enif_make_badarg(env);
 
-    // Returns {:ok, identity_keys} or {:error, last_error}.
-    if (result == olm_error()) {
-        ERL_NIF_TERM error_atom    = enif_make_atom(env, "error");
-        ERL_NIF_TERM error_message = enif_make_string(
-            env, olm_account_last_error(account), ERL_NIF_LATIN1);
+    uint64_t hash = journal_hash(journal, id.data, id.size);
 
-        enif_release_binary(&identity_keys);
+    enif_mutex_lock(journal->lock);
 
-        return enif_make_tuple2(env, error_atom, error_message);
-    }
+    ERL_NIF_TERM unusable = journal_check(env, journal);
+    if (unusable) return unusable;
 
-    ERL_NIF_TERM ok_atom = enif_make_atom(env, "ok");
-    ERL_NIF_TERM term    = enif_make_binary(env, &identity_keys);
+    const journal_entry *entry = &journal->entries[journal_find(
+        journal, id.data, id.size, hash)];
 
-    return enif_make_tuple2(env, ok_atom, term);
-}
+    if (!entry->id) {
+        enif_mutex_unlock(journal->lock);
 
-static ERL_NIF_TERM
-account_sign(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
-{
-    OlmAccount *account;
-    enif_get_resource(env, argv[0], account_resource, (void **) &account);
+        return enif_make_tuple2(env, atom_error, atom_not_found);
+    }
 
-    ErlNifBinary message;
-    enif_inspect_binary(env, argv[1], &message);
+    const uint8_t *record = journal_record(journal, entry);
 
-    ErlNifBinary signature;
-    size_t       signature_length = olm_account_signature_length(account);
-    enif_alloc_binary(signature_length, &signature);
+    if (!record) {
+        int error = errno;
+        enif_mutex_unlock(journal->lock);
 
-    size_t result = olm_account_sign(
-        account, message.data, message.size, signature.data, signature.size);
+        return make_errno_error(env, error);
+    }
 
-    // Returns {:ok, signed} or {:error, last_error}.
-    if (result == olm_error()) {
-        ERL_NIF_TERM error_atom    = enif_make_atom(env, "error");
-        ERL_NIF_TERM error_message = enif_make_string(
-            env, olm_account_last_error(account), ERL_NIF_LATIN1);
+    size_t   pickled_length = entry->size - JOURNAL_HEADER_SIZE -
+                            entry->id_length;
+    size_t   encoded_length = BASE64_ENCODED_LENGTH(pickled_length);
+    uint8_t *encoded        = enif_alloc(encoded_length);
 
-        enif_release_binary(&signature);
+    base64_encode(record + JOURNAL_HEADER_SIZE + entry->id_length,
+                  pickled_length,
+                  encoded);
 
-        return enif_make_tuple2(env, error_atom, error_message);
-    }
+    enif_mutex_unlock(journal->lock);
 
-    ERL_NIF_TERM ok_atom = enif_make_atom(env, "ok");
-    ERL_NIF_TERM term    = enif_make_binary(env, &signature);
+    session_handle *session = alloc_session();
+    if (session == NULL) {
+        enif_free(encoded);
 
-    return enif_make_tuple2(env, ok_atom, term);
-}
+        return make_errno_error(env, ENOMEM);
+    }
 
-static ERL_NIF_TERM
-account_one_time_keys(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
-{
-    OlmAccount *account;
-    enif_get_resource(env, argv[0], account_resource, (void **) &account);
+    size_t result = olm_unpickle_session(
+        session->olm, key.data, key.size, encoded, encoded_length);
 
-    ErlNifBinary one_time_keys;
-    size_t one_time_keys_length = olm_account_one_time_keys_length(account);
-    enif_alloc_binary(one_time_keys_length, &one_time_keys);
+    count_operation(STATS_UNPICKLE, pickled_length, 0);
 
-    size_t result = olm_account_one_time_keys(
-        account, one_time_keys.data, one_time_keys.size);
+    enif_free(encoded);
 
-    // Returns {:ok, one_time_keys} or {:error, last_error}.
     if (result == olm_error()) {
-        ERL_NIF_TERM error_atom    = enif_make_atom(env, "error");
-        ERL_NIF_TERM error_message = enif_make_string(
-            env, olm_account_last_error(account), ERL_NIF_LATIN1);
+        enum OlmErrorCode error = olm_session_last_error_code(session->olm);
 
-        enif_release_binary(&one_time_keys);
+        enif_release_resource(session);
 
-        return enif_make_tuple2(env, error_atom, error_message);
+        return make_error(env, error);
     }
 
-    ERL_NIF_TERM ok_atom = enif_make_atom(env, "ok");
-    ERL_NIF_TERM term    = enif_make_binary(env, &one_time_keys);
+    ERL_NIF_TERM term = enif_make_resource(env, session);
+
+    enif_release_resource(session);
 
-    return enif_make_tuple2(env, ok_atom, term);
+    return enif_make_tuple2(env, atom_ok, term);
 }
 
+// Compacts the file now, whether or not it's due.
 static ERL_NIF_TERM
-account_mark_keys_as_published(ErlNifEnv         *env,
-                               int                argc,
-                               const ERL_NIF_TERM argv[])
+journal_compact(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-    OlmAccount *account;
-    enif_get_resource(env, argv[0], account_resource, (void **) &account);
+    journal_handle *journal;
+    if (!get_journal(env, argv[0], &journal)) return enif_make_badarg(env);
 
-    size_t result = olm_account_mark_keys_as_published(account);
+    enif_mutex_lock(journal->lock);
 
-    // Returns {:ok, 'SUCCESS'} or {:error, last_error}.
-    if (result == olm_error()) {
-        ERL_NIF_TERM error_atom    = enif_make_atom(env, "error");
-        ERL_NIF_TERM error_message = enif_make_string(
-            env, olm_account_last_error(account), ERL_NIF_LATIN1);
+    ERL_NIF_TERM unusable = journal_check(env, journal);
+    if (unusable) return unusable;
 
-        return enif_make_tuple2(env, error_atom, error_message);
-    }
+    int error = journal_compact_file(journal);
 
-    ERL_NIF_TERM ok_atom = enif_make_atom(env, "ok");
-    ERL_NIF_TERM msg     = enif_make_string(
-        env, "Successfully marked keys as published", ERL_NIF_LATIN1);
+    enif_mutex_unlock(journal->lock);
 
-    return enif_make_tuple2(env, ok_atom, msg);
+    if (error) return make_errno_error(env, error);
+
+    return atom_ok;
 }
 
+// Returns the number of sessions in the journal, the bytes their latest
+// records take and the size of the file.
 static ERL_NIF_TERM
-account_max_one_time_keys(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+journal_stats(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-    OlmAccount *account;
-    enif_get_resource(env, argv[0], account_resource, (void **) &account);
+    journal_handle *journal;
+    if (!get_journal(env, argv[0], &journal)) return enif_make_badarg(env);
+
+    enif_mutex_lock(journal->lock);
+
+    ERL_NIF_TERM keys[] = {atom_sessions, atom_live_bytes, atom_file_bytes};
+    ERL_NIF_TERM values[] = {
+        enif_make_ulong(env, journal->count),
+        enif_make_uint64(env, journal->live_bytes),
+        enif_make_uint64(env, journal->fd == -1 ? 0 : journal->end)};
 
-    size_t max = olm_account_max_number_of_one_time_keys(account);
+    enif_mutex_unlock(journal->lock);
 
-    ERL_NIF_TERM ok_atom = enif_make_atom(env, "ok");
-    ERL_NIF_TERM term    = enif_make_ulong(env, max);
+    ERL_NIF_TERM map;
+    enif_make_map_from_arrays(env, keys, values, 3, &map);
 
-    return enif_make_tuple2(env, ok_atom, term);
+    return map;
 }
 
+// Outbound group sessions
+
 static ERL_NIF_TERM
-account_generate_one_time_keys(ErlNifEnv         *env,
-                               int                argc,
-                               const ERL_NIF_TERM argv[])
+create_outbound_group_session(ErlNifEnv         *env,
+                              int                argc,
+                              const ERL_NIF_TERM argv[])
 {
-    // Get args.
-    OlmAccount *account;
-    enif_get_resource(env, argv[0], account_resource, (void **) &account);
-
-    size_t count;
-    enif_get_ulong(env, argv[1], &count);
+    outbound_group_session_handle *session = alloc_outbound_group_session();
+    if (session == NULL) return make_errno_error(env, ENOMEM);
 
     size_t random_length =
-        olm_account_generate_one_time_keys_random_length(account, count);
+        olm_init_outbound_group_session_random_length(session->olm);
+    uint8_t bytes[random_length];
 
-    // Needs more randomness?
-    char   random[random_length];
-    size_t result = olm_account_generate_one_time_keys(
-        account, count, random, random_length);
+    if (!random_bytes(bytes, random_length)) {
+        enif_release_resource(session);
+
+        return make_error(env, OLM_NOT_ENOUGH_RANDOM);
+    }
 
-    ERL_NIF_TERM result_atom;
+    size_t result =
+        olm_init_outbound_group_session(session->olm, bytes, random_length);
+    wipe(bytes, random_length);
 
     if (result == olm_error()) {
-        ERL_NIF_TERM error_atom    = enif_make_atom(env, "error");
-        ERL_NIF_TERM error_message = enif_make_string(
-            env, olm_account_last_error(account), ERL_NIF_LATIN1);
+        enum OlmErrorCode error =
+            olm_outbound_group_session_last_error_code(session->olm);
 
-        return enif_make_tuple2(env, error_atom, error_message);
+        enif_release_resource(session);
+
+        return make_error(env, error);
     }
 
-    result_atom = enif_make_atom(env, "ok");
-    ERL_NIF_TERM msg =
-        enif_make_string(env, "Successfully generated", ERL_NIF_LATIN1);
+    ERL_NIF_TERM term = enif_make_resource(env, session);
+    enif_release_resource(session);
 
-    return enif_make_tuple2(env, result_atom, msg);
+    return enif_make_tuple2(env, atom_ok, term);
 }
 
 static ERL_NIF_TERM
-remove_one_time_keys(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+pickle_outbound_group_session(ErlNifEnv         *env,
+                              int                argc,
+                              const ERL_NIF_TERM argv[])
 {
-    OlmAccount *account;
-    enif_get_resource(env, argv[0], account_resource, (void **) &account);
+    outbound_group_session_handle *session;
+    if (!get_outbound_group_session(env, argv[0], &session))
+        return enif_make_badarg(env);
 
-    OlmSession *session;
-    enif_get_resource(env, argv[1], session_resource, (void **) &session);
+    ErlNifBinary key;
+    if (!enif_inspect_iolist_as_binary(env, argv[1], &key))
+        return enif_make_badarg(env);
+
+    enif_mutex_lock(session->lock);
+
+    ErlNifBinary pickled;
+    size_t       pickled_length =
+        olm_pickle_outbound_group_session_length(session->olm);
+    enif_alloc_binary(pickled_length, &pickled);
+
+    size_t result = olm_pickle_outbound_group_session(
+        session->olm, key.data, key.size, pickled.data, pickled.size);
+    enum OlmErrorCode error =
+        olm_outbound_group_session_last_error_code(session->olm);
 
-    size_t result = olm_remove_one_time_keys(account, session);
+    enif_mutex_unlock(session->lock);
+
+    count_operation(STATS_PICKLE, 0, result == olm_error() ? 0 : result);
 
     if (result == olm_error()) {
-        ERL_NIF_TERM error_atom    = enif_make_atom(env, "error");
-        ERL_NIF_TERM error_message = enif_make_string(
-            env, olm_account_last_error(account), ERL_NIF_LATIN1);
+        enif_release_binary(&pickled);
 
-        return enif_make_tuple2(env, error_atom, error_message);
+        return make_error(env, error);
     }
 
-    ERL_NIF_TERM result_atom = enif_make_atom(env, "ok");
-    ERL_NIF_TERM msg =
-        enif_make_string(env, "Successfully removed", ERL_NIF_LATIN1);
+    ERL_NIF_TERM term = enif_make_binary(env, &pickled);
 
-    return enif_make_tuple2(env, result_atom, msg);
+    return enif_make_tuple2(env, atom_ok, term);
 }
 
-// Sessions
-
 static ERL_NIF_TERM
-create_outbound_session(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+unpickle_outbound_group_session(ErlNifEnv         *env,
+                                int                argc,
+                                const ERL_NIF_TERM argv[])
 {
-    OlmAccount *account;
-    enif_get_resource(env, argv[0], account_resource, (void **) &account);
+    ErlNifBinary   pickled_input;
+    scratch_buffer pickled;
+    ErlNifBinary   key;
 
-    ErlNifBinary peer_id_key;
-    enif_inspect_binary(env, argv[1], &peer_id_key);
+    // Read args.
+    if (!enif_inspect_iolist_as_binary(env, argv[0], &pickled_input))
+        return enif_make_badarg(env);
+    if (!enif_inspect_iolist_as_binary(env, argv[1], &key))
+        return enif_make_badarg(env);
 
-    ErlNifBinary peer_one_time_key;
-    enif_inspect_binary(env, argv[2], &peer_one_time_key);
+    scratch_copy(&pickled, &pickled_input);
 
-    // Allocate new session
-    size_t      session_size = olm_session_size();
-    OlmSession *memory  = enif_alloc_resource(session_resource, session_size);
-    OlmSession *session = olm_session(memory);
+    // Alloc memory
+    outbound_group_session_handle *session = alloc_outbound_group_session();
+    if (session == NULL) {
+        scratch_release(&pickled);
 
-    size_t random_length = olm_create_outbound_session_random_length(session);
-    char   bytes[random_length];
+        return make_errno_error(env, ENOMEM);
+    }
 
-    size_t result = olm_create_outbound_session(session,
-                                                account,
-                                                peer_id_key.data,
-                                                peer_id_key.size,
-                                                peer_one_time_key.data,
-                                                peer_one_time_key.size,
-                                                bytes,
-                                                random_length);
+    size_t result = olm_unpickle_outbound_group_session(
+        session->olm, key.data, key.size, pickled.data, pickled.size);
+
+    count_operation(STATS_UNPICKLE, pickled.size, 0);
 
     if (result == olm_error()) {
-        ERL_NIF_TERM error_atom    = enif_make_atom(env, "error");
-        ERL_NIF_TERM error_message = enif_make_string(
-            env, olm_session_last_error(session), ERL_NIF_LATIN1);
+        enum OlmErrorCode error =
+            olm_outbound_group_session_last_error_code(session->olm);
 
         enif_release_resource(session);
+        scratch_release(&pickled);
 
-        return enif_make_tuple2(env, error_atom, error_message);
+        return make_error(env, error);
     }
 
-    ERL_NIF_TERM ok_atom = enif_make_atom(env, "ok");
-    ERL_NIF_TERM term    = enif_make_resource(env, session);
+    ERL_NIF_TERM term = enif_make_resource(env, session);
+
     enif_release_resource(session);
+    scratch_release(&pickled);
 
-    return enif_make_tuple2(env, ok_atom, term);
+    return enif_make_tuple2(env, atom_ok, term);
 }
 
 static ERL_NIF_TERM
-create_inbound_session(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+outbound_group_session_id(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-    OlmAccount *account;
-    enif_get_resource(env, argv[0], account_resource, (void **) &account);
+    outbound_group_session_handle *session;
+    if (!get_outbound_group_session(env, argv[0], &session))
+        return enif_make_badarg(env);
 
-    ErlNifBinary cyphertext, cyphertext_input;
-    enif_inspect_binary(env, argv[1], &cyphertext_input);
-    enif_alloc_binary(cyphertext_input.size, &cyphertext);
-    memcpy(cyphertext.data, cyphertext_input.data, cyphertext_input.size);
+    enif_mutex_lock(session->lock);
 
-    // Allocate new session
-    size_t      session_size = olm_session_size();
-    OlmSession *memory  = enif_alloc_resource(session_resource, session_size);
-    OlmSession *session = olm_session(memory);
+    ErlNifBinary id;
+    size_t       id_length = olm_outbound_group_session_id_length(session->olm);
+    enif_alloc_binary(id_length, &id);
 
-    size_t result = olm_create_inbound_session(
-        session, account, cyphertext.data, cyphertext.size);
+    size_t result =
+        olm_outbound_group_session_id(session->olm, id.data, id.size);
+    enum OlmErrorCode error =
+        olm_outbound_group_session_last_error_code(session->olm);
 
-    if (result == olm_error()) {
-        ERL_NIF_TERM error_atom    = enif_make_atom(env, "error");
-        ERL_NIF_TERM error_message = enif_make_string(
-            env, olm_session_last_error(session), ERL_NIF_LATIN1);
+    enif_mutex_unlock(session->lock);
 
-        enif_release_resource(session);
-        enif_release_binary(&cyphertext);
+    if (result == olm_error()) {
+        enif_release_binary(&id);
 
-        return enif_make_tuple2(env, error_atom, error_message);
+        return make_error(env, error);
     }
 
-    ERL_NIF_TERM ok_atom = enif_make_atom(env, "ok");
-    ERL_NIF_TERM term    = enif_make_resource(env, session);
+    ERL_NIF_TERM term = enif_make_binary(env, &id);
 
-    enif_release_resource(session);
-    enif_release_binary(&cyphertext);
-
-    return enif_make_tuple2(env, ok_atom, term);
+    return enif_make_tuple2(env, atom_ok, term);
 }
 
 static ERL_NIF_TERM
-create_inbound_session_from(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+outbound_group_session_key(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-    OlmAccount *account;
-    enif_get_resource(env, argv[0], account_resource, (void **) &account);
+    outbound_group_session_handle *session;
+    if (!get_outbound_group_session(env, argv[0], &session))
+        return enif_make_badarg(env);
 
-    ErlNifBinary cyphertext, cyphertext_input;
-    enif_inspect_binary(env, argv[1], &cyphertext_input);
-    enif_alloc_binary(cyphertext_input.size, &cyphertext);
-    memcpy(cyphertext.data, cyphertext_input.data, cyphertext_input.size);
+    enif_mutex_lock(session->lock);
 
-    ErlNifBinary peer_id_key;
-    enif_inspect_binary(env, argv[2], &peer_id_key);
+    ErlNifBinary key;
+    size_t key_length = olm_outbound_group_session_key_length(session->olm);
+    enif_alloc_binary(key_length, &key);
 
-    // Allocate new session
-    size_t      session_size = olm_session_size();
-    OlmSession *memory  = enif_alloc_resource(session_resource, session_size);
-    OlmSession *session = olm_session(memory);
+    size_t result =
+        olm_outbound_group_session_key(session->olm, key.data, key.size);
+    enum OlmErrorCode error =
+        olm_outbound_group_session_last_error_code(session->olm);
 
-    size_t result = olm_create_inbound_session_from(session,
-                                                    account,
-                                                    peer_id_key.data,
-                                                    peer_id_key.size,
-                                                    cyphertext.data,
-                                                    cyphertext.size);
+    enif_mutex_unlock(session->lock);
 
     if (result == olm_error()) {
-        ERL_NIF_TERM error_atom    = enif_make_atom(env, "error");
-        ERL_NIF_TERM error_message = enif_make_string(
-            env, olm_session_last_error(session), ERL_NIF_LATIN1);
-
-        enif_release_resource(session);
-        enif_release_binary(&cyphertext);
+        enif_release_binary(&key);
 
-        return enif_make_tuple2(env, error_atom, error_message);
+        return make_error(env, error);
     }
 
-    ERL_NIF_TERM ok_atom = enif_make_atom(env, "ok");
-    ERL_NIF_TERM term    = enif_make_resource(env, session);
-
-    enif_release_resource(session);
-    enif_release_binary(&cyphertext);
+    ERL_NIF_TERM term = enif_make_binary(env, &key);
 
-    return enif_make_tuple2(env, ok_atom, term);
+    return enif_make_tuple2(env, atom_ok, term);
 }
 
 static ERL_NIF_TERM
-session_id(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+outbound_group_session_message_index(ErlNifEnv         *env,
+                                     int                argc,
+                                     const ERL_NIF_TERM argv[])
 {
-    OlmSession *session;
-    enif_get_resource(env, argv[0], session_resource, (void **) &session);
+    outbound_group_session_handle *session;
+    if (!get_outbound_group_session(env, argv[0], &session))
+        return enif_make_badarg(env);
 
-    ErlNifBinary id;
-    size_t       id_length = olm_session_id_length(session);
-    enif_alloc_binary(id_length, &id);
+    enif_mutex_lock(session->lock);
+    uint32_t index = olm_outbound_group_session_message_index(session->olm);
+    enif_mutex_unlock(session->lock);
 
-    size_t result = olm_session_id(session, id.data, id.size);
+    ERL_NIF_TERM term = enif_make_uint(env, index);
 
-    if (result == olm_error()) {
-        ERL_NIF_TERM error_atom    = enif_make_atom(env, "error");
-        ERL_NIF_TERM error_message = enif_make_string(
-            env, olm_session_last_error(session), ERL_NIF_LATIN1);
+    return enif_make_tuple2(env, atom_ok, term);
+}
 
-        enif_release_binary(&id);
+static ERL_NIF_TERM
+group_encrypt_message(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    outbound_group_session_handle *session;
+    if (!get_outbound_group_session(env, argv[0], &session))
+        return enif_make_badarg(env);
 
-        return enif_make_tuple2(env, error_atom, error_message);
-    }
+    ErlNifBinary plaintext;
+    if (!enif_inspect_iolist_as_binary(env, argv[1], &plaintext))
+        return enif_make_badarg(env);
 
-    ERL_NIF_TERM ok_atom = enif_make_atom(env, "ok");
-    ERL_NIF_TERM term    = enif_make_binary(env, &id);
+    enif_mutex_lock(session->lock);
 
-    return enif_make_tuple2(env, ok_atom, term);
-}
+    // The message length is exact, so libolm encrypts straight into the
+    // binary which is handed back to the caller.
+    ErlNifBinary message;
+    size_t       message_length =
+        olm_group_encrypt_message_length(session->olm, plaintext.size);
+    enif_alloc_binary(message_length, &message);
 
-static ERL_NIF_TERM
-match_inbound_session(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
-{
-    OlmSession *session;
-    enif_get_resource(env, argv[0], session_resource, (void **) &session);
+    size_t result = olm_group_encrypt(session->olm,
+                                      plaintext.data,
+                                      plaintext.size,
+                                      message.data,
+                                      message.size);
+    enum OlmErrorCode error =
+        olm_outbound_group_session_last_error_code(session->olm);
 
-    ErlNifBinary cyphertext, cyphertext_input;
-    enif_inspect_binary(env, argv[1], &cyphertext_input);
-    enif_alloc_binary(cyphertext_input.size, &cyphertext);
-    memcpy(cyphertext.data, cyphertext_input.data, cyphertext_input.size);
+    enif_mutex_unlock(session->lock);
 
-    size_t result =
-        olm_matches_inbound_session(session, cyphertext.data, cyphertext.size);
+    count_operation(STATS_GROUP_ENCRYPT,
+                    plaintext.size,
+                    result == olm_error() ? 0 : message.size);
 
     if (result == olm_error()) {
-        ERL_NIF_TERM error_atom    = enif_make_atom(env, "error");
-        ERL_NIF_TERM error_message = enif_make_string(
-            env, olm_session_last_error(session), ERL_NIF_LATIN1);
-
-        enif_release_binary(&cyphertext);
+        enif_release_binary(&message);
 
-        return enif_make_tuple2(env, error_atom, error_message);
+        return make_error(env, error);
     }
 
-    ERL_NIF_TERM ok_atom = enif_make_atom(env, "ok");
-    ERL_NIF_TERM term    = enif_make_ulong(env, result);
+    ERL_NIF_TERM term = enif_make_binary(env, &message);
 
-    enif_release_binary(&cyphertext);
-
-    return enif_make_tuple2(env, ok_atom, term);
+    return enif_make_tuple2(env, atom_ok, term);
 }
 
+// Inbound group sessions
+
 static ERL_NIF_TERM
-match_inbound_session_from(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+create_inbound_group_session(ErlNifEnv         *env,
+                             int                argc,
+                             const ERL_NIF_TERM argv[])
 {
-    OlmSession *session;
-    enif_get_resource(env, argv[0], session_resource, (void **) &session);
-
-    ErlNifBinary cyphertext, cyphertext_input;
-    enif_inspect_binary(env, argv[1], &cyphertext_input);
-    enif_alloc_binary(cyphertext_input.size, &cyphertext);
-    memcpy(cyphertext.data, cyphertext_input.data, cyphertext_input.size);
+    ErlNifBinary session_key;
+    if (!enif_inspect_iolist_as_binary(env, argv[0], &session_key))
+        return enif_make_badarg(env);
 
-    ErlNifBinary peer_id_key;
-    enif_inspect_binary(env, argv[2], &peer_id_key);
+    inbound_group_session_handle *session = alloc_inbound_group_session();
+    if (session == NULL) return make_errno_error(env, ENOMEM);
 
-    size_t result = olm_matches_inbound_session_from(session,
-                                                     peer_id_key.data,
-                                                     peer_id_key.size,
-                                                     cyphertext.data,
-                                                     cyphertext.size);
+    size_t result = olm_init_inbound_group_session(
+        session->olm, session_key.data, session_key.size);
 
     if (result == olm_error()) {
-        ERL_NIF_TERM error_atom    = enif_make_atom(env, "error");
-        ERL_NIF_TERM error_message = enif_make_string(
-            env, olm_session_last_error(session), ERL_NIF_LATIN1);
+        enum OlmErrorCode error =
+            olm_inbound_group_session_last_error_code(session->olm);
 
-        enif_release_binary(&cyphertext);
+        enif_release_resource(session);
 
-        return enif_make_tuple2(env, error_atom, error_message);
+        return make_error(env, error);
     }
 
-    ERL_NIF_TERM ok_atom = enif_make_atom(env, "ok");
-    ERL_NIF_TERM term    = enif_make_ulong(env, result);
-
-    enif_release_binary(&cyphertext);
+    ERL_NIF_TERM term = enif_make_resource(env, session);
+    enif_release_resource(session);
 
-    return enif_make_tuple2(env, ok_atom, term);
+    return enif_make_tuple2(env, atom_ok, term);
 }
 
 static ERL_NIF_TERM
-pickle_session(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+pickle_inbound_group_session(ErlNifEnv         *env,
+                             int                argc,
+                             const ERL_NIF_TERM argv[])
 {
-    OlmSession *session;
-    enif_get_resource(env, argv[0], session_resource, (void **) &session);
+    inbound_group_session_handle *session;
+    if (!get_inbound_group_session(env, argv[0], &session))
+        return enif_make_badarg(env);
 
     ErlNifBinary key;
-    enif_inspect_binary(env, argv[1], &key);
+    if (!enif_inspect_iolist_as_binary(env, argv[1], &key))
+        return enif_make_badarg(env);
+
+    enif_mutex_lock(session->lock);
 
     ErlNifBinary pickled;
-    size_t       pickled_length = olm_pickle_session_length(session);
+    size_t       pickled_length =
+        olm_pickle_inbound_group_session_length(session->olm);
     enif_alloc_binary(pickled_length, &pickled);
 
-    size_t result = olm_pickle_session(
-        session, key.data, key.size, pickled.data, pickled.size);
+    size_t result = olm_pickle_inbound_group_session(
+        session->olm, key.data, key.size, pickled.data, pickled.size);
+    enum OlmErrorCode error =
+        olm_inbound_group_session_last_error_code(session->olm);
 
-    if (result == olm_error()) {
-        ERL_NIF_TERM error_atom    = enif_make_atom(env, "error");
-        ERL_NIF_TERM error_message = enif_make_string(
-            env, olm_session_last_error(session), ERL_NIF_LATIN1);
+    enif_mutex_unlock(session->lock);
 
+    count_operation(STATS_PICKLE, 0, result == olm_error() ? 0 : result);
+
+    if (result == olm_error()) {
         enif_release_binary(&pickled);
 
-        return enif_make_tuple2(env, error_atom, error_message);
+        return make_error(env, error);
     }
 
-    ERL_NIF_TERM ok_atom = enif_make_atom(env, "ok");
-    ERL_NIF_TERM term    = enif_make_binary(env, &pickled);
+    ERL_NIF_TERM term = enif_make_binary(env, &pickled);
 
-    return enif_make_tuple2(env, ok_atom, term);
+    return enif_make_tuple2(env, atom_ok, term);
 }
 
 static ERL_NIF_TERM
-unpickle_session(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+unpickle_inbound_group_session(ErlNifEnv         *env,
+                               int                argc,
+                               const ERL_NIF_TERM argv[])
 {
-    ErlNifBinary pickled, pickled_input;
-    ErlNifBinary key;
+    ErlNifBinary   pickled_input;
+    scratch_buffer pickled;
+    ErlNifBinary   key;
 
     // Read args.
-    enif_inspect_binary(env, argv[0], &pickled_input);
-    enif_alloc_binary(pickled_input.size, &pickled);
-    memcpy(pickled.data, pickled_input.data, pickled_input.size);
+    if (!enif_inspect_iolist_as_binary(env, argv[0], &pickled_input))
+        return enif_make_badarg(env);
+    if (!enif_inspect_iolist_as_binary(env, argv[1], &key))
+        return enif_make_badarg(env);
 
-    enif_inspect_binary(env, argv[1], &key);
+    scratch_copy(&pickled, &pickled_input);
 
     // Alloc memory
-    size_t      session_size = olm_session_size();
-    OlmSession *memory  = enif_alloc_resource(session_resource, session_size);
-    OlmSession *session = olm_session(memory);
+    inbound_group_session_handle *session = alloc_inbound_group_session();
+    if (session == NULL) {
+        scratch_release(&pickled);
 
-    size_t result = olm_unpickle_session(
-        session, key.data, key.size, pickled.data, pickled.size);
+        return make_errno_error(env, ENOMEM);
+    }
+
+    size_t result = olm_unpickle_inbound_group_session(
+        session->olm, key.data, key.size, pickled.data, pickled.size);
+
+    count_operation(STATS_UNPICKLE, pickled.size, 0);
 
     if (result == olm_error()) {
-        ERL_NIF_TERM error_atom    = enif_make_atom(env, "error");
-        ERL_NIF_TERM error_message = enif_make_string(
-            env, olm_session_last_error(session), ERL_NIF_LATIN1);
+        enum OlmErrorCode error =
+            olm_inbound_group_session_last_error_code(session->olm);
 
         enif_release_resource(session);
-        enif_release_binary(&pickled);
+        scratch_release(&pickled);
 
-        return enif_make_tuple2(env, error_atom, error_message);
+        return make_error(env, error);
     }
 
-    ERL_NIF_TERM ok_atom = enif_make_atom(env, "ok");
-    ERL_NIF_TERM term    = enif_make_resource(env, session);
+    ERL_NIF_TERM term = enif_make_resource(env, session);
 
     enif_release_resource(session);
-    enif_release_binary(&pickled);
+    scratch_release(&pickled);
 
-    return enif_make_tuple2(env, ok_atom, term);
+    return enif_make_tuple2(env, atom_ok, term);
 }
 
 static ERL_NIF_TERM
-encrypt_message_type(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+inbound_group_session_id(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-    OlmSession *session;
-    enif_get_resource(env, argv[0], session_resource, (void **) &session);
+    inbound_group_session_handle *session;
+    if (!get_inbound_group_session(env, argv[0], &session))
+        return enif_make_badarg(env);
+
+    enif_mutex_lock(session->lock);
+
+    ErlNifBinary id;
+    size_t       id_length = olm_inbound_group_session_id_length(session->olm);
+    enif_alloc_binary(id_length, &id);
+
+    size_t result =
+        olm_inbound_group_session_id(session->olm, id.data, id.size);
+    enum OlmErrorCode error =
+        olm_inbound_group_session_last_error_code(session->olm);
 
-    size_t result = olm_encrypt_message_type(session);
+    enif_mutex_unlock(session->lock);
 
     if (result == olm_error()) {
-        ERL_NIF_TERM error_atom    = enif_make_atom(env, "error");
-        ERL_NIF_TERM error_message = enif_make_string(
-            env, olm_session_last_error(session), ERL_NIF_LATIN1);
+        enif_release_binary(&id);
 
-        return enif_make_tuple2(env, error_atom, error_message);
+        return make_error(env, error);
     }
 
-    ERL_NIF_TERM ok_atom = enif_make_atom(env, "ok");
-    ERL_NIF_TERM type    = enif_make_ulong(env, result);
+    ERL_NIF_TERM term = enif_make_binary(env, &id);
 
-    return enif_make_tuple2(env, ok_atom, type);
+    return enif_make_tuple2(env, atom_ok, term);
 }
 
 static ERL_NIF_TERM
-encrypt_message(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+inbound_group_session_first_known_index(ErlNifEnv         *env,
+                                        int                argc,
+                                        const ERL_NIF_TERM argv[])
 {
-    OlmSession *session;
-    enif_get_resource(env, argv[0], session_resource, (void **) &session);
-
-    ErlNifBinary plaintext;
-    enif_inspect_binary(env, argv[1], &plaintext);
-
-    size_t random_length = olm_encrypt_random_length(session);
-    char   bytes[random_length];
-
-    ErlNifBinary message;
-    size_t message_length = olm_encrypt_message_length(session, plaintext.size);
-    enif_alloc_binary(message_length, &message);
-
-    size_t result = olm_encrypt(session,
-                                plaintext.data,
-                                plaintext.size,
-                                bytes,
-                                random_length,
-                                message.data,
-                                message.size);
-
-    if (result == olm_error()) {
-        ERL_NIF_TERM error_atom    = enif_make_atom(env, "error");
-        ERL_NIF_TERM error_message = enif_make_string(
-            env, olm_session_last_error(session), ERL_NIF_LATIN1);
-
-        enif_release_binary(&message);
+    inbound_group_session_handle *session;
+    if (!get_inbound_group_session(env, argv[0], &session))
+        return enif_make_badarg(env);
 
-        return enif_make_tuple2(env, error_atom, error_message);
-    }
+    enif_mutex_lock(session->lock);
+    uint32_t index = olm_inbound_group_session_first_known_index(session->olm);
+    enif_mutex_unlock(session->lock);
 
-    ERL_NIF_TERM ok_atom = enif_make_atom(env, "ok");
-    ERL_NIF_TERM term    = enif_make_binary(env, &message);
+    ERL_NIF_TERM term = enif_make_uint(env, index);
 
-    return enif_make_tuple2(env, ok_atom, term);
+    return enif_make_tuple2(env, atom_ok, term);
 }
 
 static ERL_NIF_TERM
-decrypt_message(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+group_decrypt_message(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-    OlmSession *session;
-    enif_get_resource(env, argv[0], session_resource, (void **) &session);
-
-    size_t type;
-    enif_get_ulong(env, argv[1], &type);
+    inbound_group_session_handle *session;
+    if (!get_inbound_group_session(env, argv[0], &session))
+        return enif_make_badarg(env);
 
-    ErlNifBinary cyphertext, cyphertext_input;
-    enif_inspect_binary(env, argv[2], &cyphertext_input);
-    enif_alloc_binary(cyphertext_input.size, &cyphertext);
-    memcpy(cyphertext.data, cyphertext_input.data, cyphertext_input.size);
+    // libolm decodes the message in place, so work on a copy.
+    ErlNifBinary   cyphertext_input;
+    scratch_buffer cyphertext;
+    if (!enif_inspect_iolist_as_binary(env, argv[1], &cyphertext_input))
+        return enif_make_badarg(env);
+    scratch_copy(&cyphertext, &cyphertext_input);
 
     ErlNifBinary plaintext;
-    size_t       plaintext_size = olm_decrypt_max_plaintext_length(
-        session, type, cyphertext_input.data, cyphertext_input.size);
+    enif_alloc_binary(MAX_PLAINTEXT_LENGTH(cyphertext.size), &plaintext);
 
-    enif_alloc_binary(plaintext_size, &plaintext);
+    enif_mutex_lock(session->lock);
 
-    size_t result = olm_decrypt(session,
-                                type,
-                                cyphertext.data,
-                                cyphertext.size,
-                                plaintext.data,
-                                plaintext.size);
+    uint32_t message_index;
+    size_t   result = olm_group_decrypt(session->olm,
+                                      cyphertext.data,
+                                      cyphertext.size,
+                                      plaintext.data,
+                                      plaintext.size,
+                                      &message_index);
+    enum OlmErrorCode error =
+        olm_inbound_group_session_last_error_code(session->olm);
 
-    if (result == olm_error()) {
-        ERL_NIF_TERM error_atom    = enif_make_atom(env, "error");
-        ERL_NIF_TERM error_message = enif_make_string(
-            env, olm_session_last_error(session), ERL_NIF_LATIN1);
+    enif_mutex_unlock(session->lock);
+
+    count_operation(STATS_GROUP_DECRYPT,
+                    cyphertext.size,
+                    result == olm_error() ? 0 : result);
 
+    scratch_release(&cyphertext);
+
+    if (result == olm_error()) {
         enif_release_binary(&plaintext);
-        enif_release_binary(&cyphertext);
 
-        return enif_make_tuple2(env, error_atom, error_message);
+        return make_error(env, error);
     }
 
-    ERL_NIF_TERM ok_atom = enif_make_atom(env, "ok");
-    ERL_NIF_TERM term    = enif_make_binary(env, &plaintext);
+    enif_realloc_binary(&plaintext, result);
 
-    enif_release_binary(&cyphertext);
+    ERL_NIF_TERM term = enif_make_tuple2(env,
+                                         enif_make_binary(env, &plaintext),
+                                         enif_make_uint(env, message_index));
 
-    return enif_make_tuple2(env, ok_atom, term);
+    return enif_make_tuple2(env, atom_ok, term);
 }
 
 // Utility
 
+// Returns the calling thread's OlmUtility, setting it up on first use.
+static OlmUtility *
+thread_utility(void)
+{
+    OlmUtility *utility = enif_tsd_get(utility_key);
+
+    if (utility == NULL) {
+        utility = olm_utility(enif_alloc(olm_utility_size()));
+        enif_tsd_set(utility_key, utility);
+    }
+
+    return utility;
+}
+
 static ERL_NIF_TERM
 utility_sha256(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
     // Args
     ErlNifBinary input;
-    enif_inspect_binary(env, argv[0], &input);
+    if (!enif_inspect_iolist_as_binary(env, argv[0], &input))
+        return enif_make_badarg(env);
 
-    size_t      utility_size = olm_utility_size();
-    OlmUtility *memory       = enif_alloc(utility_size);
-    OlmUtility *utility      = olm_utility(memory);
+    OlmUtility *utility = thread_utility();
 
     ErlNifBinary output;
     size_t       output_length = olm_sha256_length(utility);
@@ -786,42 +4547,38 @@ utility_sha256(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
     size_t result =
         olm_sha256(utility, input.data, input.size, output.data, output.size);
 
-    if (result == olm_error()) {
-        ERL_NIF_TERM error_atom    = enif_make_atom(env, "error");
-        ERL_NIF_TERM error_message = enif_make_string(
-            env, olm_utility_last_error(utility), ERL_NIF_LATIN1);
+    count_operation(
+        STATS_SHA256, input.size, result == olm_error() ? 0 : output.size);
 
+    if (result == olm_error()) {
         enif_release_binary(&output);
-        enif_free(memory);
 
-        return enif_make_tuple2(env, error_atom, error_message);
+        return make_error(env, olm_utility_last_error_code(utility));
     }
 
-    ERL_NIF_TERM ok_atom = enif_make_atom(env, "ok");
-    ERL_NIF_TERM term    = enif_make_binary(env, &output);
+    ERL_NIF_TERM term = enif_make_binary(env, &output);
 
-    enif_free(memory);
-
-    return enif_make_tuple2(env, ok_atom, term);
+    return enif_make_tuple2(env, atom_ok, term);
 }
 
 static ERL_NIF_TERM
 utility_ed25519_verify(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-    ErlNifBinary key;
-    ErlNifBinary message;
-    ErlNifBinary signature, signature_input;
+    ErlNifBinary   key;
+    ErlNifBinary   message;
+    ErlNifBinary   signature_input;
+    scratch_buffer signature;
 
-    enif_inspect_binary(env, argv[0], &key);
-    enif_inspect_binary(env, argv[1], &message);
+    if (!enif_inspect_iolist_as_binary(env, argv[0], &key))
+        return enif_make_badarg(env);
+    if (!enif_inspect_iolist_as_binary(env, argv[1], &message))
+        return enif_make_badarg(env);
 
-    enif_inspect_binary(env, argv[2], &signature_input);
-    enif_alloc_binary(signature_input.size, &signature);
-    memcpy(signature.data, signature_input.data, signature_input.size);
+    if (!enif_inspect_iolist_as_binary(env, argv[2], &signature_input))
+        return enif_make_badarg(env);
+    scratch_copy(&signature, &signature_input);
 
-    size_t      utility_size = olm_utility_size();
-    OlmUtility *memory       = enif_alloc(utility_size);
-    OlmUtility *utility      = olm_utility(memory);
+    OlmUtility *utility = thread_utility();
 
     size_t result = olm_ed25519_verify(utility,
                                        key.data,
@@ -831,53 +4588,199 @@ utility_ed25519_verify(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
                                        signature.data,
                                        signature.size);
 
+    count_operation(STATS_VERIFY, message.size, 0);
+
     if (result == olm_error()) {
-        ERL_NIF_TERM error_atom    = enif_make_atom(env, "error");
-        ERL_NIF_TERM error_message = enif_make_string(
-            env, olm_utility_last_error(utility), ERL_NIF_LATIN1);
+        scratch_release(&signature);
 
-        enif_free(memory);
-        enif_release_binary(&signature);
+        return make_error(env, olm_utility_last_error_code(utility));
+    }
+
+    scratch_release(&signature);
 
-        return enif_make_tuple2(env, error_atom, error_message);
+    return atom_ok;
+}
+
+// Verifies a list of {key, message, signature} tuples, returning a boolean for
+// each. libolm decodes each signature in place, so they're copied into one
+// scratch buffer sized for the largest. Always runs on a dirty scheduler.
+static ERL_NIF_TERM
+utility_ed25519_verify_many(ErlNifEnv         *env,
+                            int                argc,
+                            const ERL_NIF_TERM argv[])
+{
+    ERL_NIF_TERM list = argv[0];
+    ERL_NIF_TERM head;
+
+    const ERL_NIF_TERM *tuple;
+    int                 arity;
+    ErlNifBinary        key, message, signature;
+    size_t              scratch_size = 0;
+
+    while (enif_get_list_cell(env, list, &head, &list)) {
+        if (!enif_get_tuple(env, head, &arity, &tuple) || arity != 3 ||
+            !enif_inspect_iolist_as_binary(env, tuple[0], &key) ||
+            !enif_inspect_iolist_as_binary(env, tuple[1], &message) ||
+            !enif_inspect_iolist_as_binary(env, tuple[2], &signature))
+            return enif_make_badarg(env);
+
+        if (signature.size > scratch_size) scratch_size = signature.size;
     }
 
-    ERL_NIF_TERM ok_atom = enif_make_atom(env, "ok");
-    ERL_NIF_TERM msg =
-        enif_make_string(env, "Signature verified", ERL_NIF_LATIN1);
+    if (!enif_is_empty_list(env, list)) return enif_make_badarg(env);
 
-    enif_free(memory);
-    enif_release_binary(&signature);
+    OlmUtility *utility = thread_utility();
+    uint8_t    *scratch = enif_alloc(scratch_size > 0 ? scratch_size : 1);
+
+    ERL_NIF_TERM results = enif_make_list(env, 0);
+
+    list = argv[0];
+
+    while (enif_get_list_cell(env, list, &head, &list)) {
+        enif_get_tuple(env, head, &arity, &tuple);
+        enif_inspect_iolist_as_binary(env, tuple[0], &key);
+        enif_inspect_iolist_as_binary(env, tuple[1], &message);
+        enif_inspect_iolist_as_binary(env, tuple[2], &signature);
+
+        memcpy(scratch, signature.data, signature.size);
+
+        size_t result = olm_ed25519_verify(utility,
+                                           key.data,
+                                           key.size,
+                                           message.data,
+                                           message.size,
+                                           scratch,
+                                           signature.size);
+
+        count_operation(STATS_VERIFY, message.size, 0);
+
+        if (result == olm_error())
+            count_error(olm_utility_last_error_code(utility));
+
+        results = enif_make_list_cell(
+            env, result == olm_error() ? atom_false : atom_true, results);
+    }
+
+    enif_free(scratch);
+
+    enif_make_reverse_list(env, results, &results);
 
-    return enif_make_tuple2(env, ok_atom, msg);
+    return enif_make_tuple2(env, atom_ok, results);
 }
 
 // Let's define the array of ErlNifFunc beforehand:
 static ErlNifFunc nif_funcs[] = {
-    // {erl_function_name, erl_function_arity, c_function}
+    // {erl_function_name, erl_function_arity, c_function, flags}
+    //
+    // Functions doing key generation or key derivation (creating accounts and
+    // sessions, unpickling) or working through whole batches run on dirty CPU
+    // schedulers so they can't hold up a normal scheduler. Functions touching
+    // a journal's file run on dirty IO schedulers.
     {"version", 0, version},
-    {"create_account", 0, create_account},
+    {"stats", 0, stats},
+    {"create_account", 0, create_account, ERL_NIF_DIRTY_JOB_CPU_BOUND},
     {"pickle_account", 2, pickle_account},
-    {"unpickle_account", 2, unpickle_account},
+    {"unpickle_account", 2, unpickle_account, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+    {"account_generation", 1, account_generation},
+    {"pickle_account_if_changed", 3, pickle_account_if_changed},
     {"account_identity_keys", 1, account_identity_keys},
+    {"account_identity_keys_map", 1, account_identity_keys_map},
     {"account_sign", 2, account_sign},
     {"account_one_time_keys", 1, account_one_time_keys},
+    {"account_one_time_keys_list", 1, account_one_time_keys_list},
     {"account_mark_keys_as_published", 1, account_mark_keys_as_published},
     {"account_max_one_time_keys", 1, account_max_one_time_keys},
     {"account_generate_one_time_keys", 2, account_generate_one_time_keys},
+    {"account_replenish_one_time_keys",
+     3,
+     account_replenish_one_time_keys,
+     ERL_NIF_DIRTY_JOB_CPU_BOUND},
     {"remove_one_time_keys", 2, remove_one_time_keys},
-    {"create_outbound_session", 3, create_outbound_session},
-    {"create_inbound_session", 2, create_inbound_session},
-    {"create_inbound_session_from", 3, create_inbound_session_from},
+    {"create_outbound_session",
+     3,
+     create_outbound_session,
+     ERL_NIF_DIRTY_JOB_CPU_BOUND},
+    {"create_inbound_session",
+     2,
+     create_inbound_session,
+     ERL_NIF_DIRTY_JOB_CPU_BOUND},
+    {"create_inbound_session_from",
+     3,
+     create_inbound_session_from,
+     ERL_NIF_DIRTY_JOB_CPU_BOUND},
+    {"session_size", 0, session_size},
     {"session_id", 1, session_id},
     {"match_inbound_session", 2, match_inbound_session},
     {"match_inbound_session_from", 3, match_inbound_session_from},
+    {"inspect_message", 2, inspect_message},
+    {"create_session_index", 0, create_session_index},
+    {"session_index_put", 2, session_index_put},
+    {"session_index_put", 3, session_index_put},
+    {"session_index_lookup", 2, session_index_lookup},
+    {"session_index_delete", 2, session_index_delete},
+    {"session_index_size", 1, session_index_size},
+    {"journal_open", 1, journal_open, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"journal_close", 1, journal_close, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"journal_put", 4, journal_put, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"journal_put_session", 3, journal_put_session, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"journal_delete", 2, journal_delete, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"journal_fetch", 2, journal_fetch, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"journal_load_session",
+     3,
+     journal_load_session,
+     ERL_NIF_DIRTY_JOB_CPU_BOUND},
+    {"journal_compact", 1, journal_compact, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"journal_stats", 1, journal_stats},
     {"pickle_session", 2, pickle_session},
-    {"unpickle_session", 2, unpickle_session},
-    {"encrypt_message_type", 1, encrypt_message_type},
+    {"unpickle_session", 2, unpickle_session, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+    {"pickle_session_raw", 2, pickle_session_raw},
+    {"unpickle_session_raw",
+     2,
+     unpickle_session_raw,
+     ERL_NIF_DIRTY_JOB_CPU_BOUND},
+    {"session_generation", 1, session_generation},
+    {"pickle_session_if_changed", 4, pickle_session_if_changed},
+    {"pickle_sessions", 2, pickle_sessions, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+    {"unpickle_sessions", 2, unpickle_sessions, ERL_NIF_DIRTY_JOB_CPU_BOUND},
     {"encrypt_message", 2, encrypt_message},
+    {"encrypt_messages", 2, encrypt_messages},
+    {"encrypt_to_sessions", 2, encrypt_to_sessions},
     {"decrypt_message", 3, decrypt_message},
+    {"decrypt_messages", 2, decrypt_messages},
+    {"create_outbound_group_session",
+     0,
+     create_outbound_group_session,
+     ERL_NIF_DIRTY_JOB_CPU_BOUND},
+    {"pickle_outbound_group_session", 2, pickle_outbound_group_session},
+    {"unpickle_outbound_group_session",
+     2,
+     unpickle_outbound_group_session,
+     ERL_NIF_DIRTY_JOB_CPU_BOUND},
+    {"outbound_group_session_id", 1, outbound_group_session_id},
+    {"outbound_group_session_key", 1, outbound_group_session_key},
+    {"outbound_group_session_message_index",
+     1,
+     outbound_group_session_message_index},
+    {"group_encrypt_message", 2, group_encrypt_message},
+    {"create_inbound_group_session",
+     1,
+     create_inbound_group_session,
+     ERL_NIF_DIRTY_JOB_CPU_BOUND},
+    {"pickle_inbound_group_session", 2, pickle_inbound_group_session},
+    {"unpickle_inbound_group_session",
+     2,
+     unpickle_inbound_group_session,
+     ERL_NIF_DIRTY_JOB_CPU_BOUND},
+    {"inbound_group_session_id", 1, inbound_group_session_id},
+    {"inbound_group_session_first_known_index",
+     1,
+     inbound_group_session_first_known_index},
+    {"group_decrypt_message", 2, group_decrypt_message},
     {"utility_sha256", 1, utility_sha256},
-    {"utility_ed25519_verify", 3, utility_ed25519_verify}};
+    {"utility_ed25519_verify", 3, utility_ed25519_verify},
+    {"utility_ed25519_verify_many",
+     1,
+     utility_ed25519_verify_many,
+     ERL_NIF_DIRTY_JOB_CPU_BOUND}};
 
 ERL_NIF_INIT(Elixir.Olm.NIF, nif_funcs, nif_load, NULL, NULL, NULL)
@@ -12,4 +12,20 @@ defmodule Olm do
     {major, minor, patch} = NIF.version()
     "#{major}.#{minor}.#{patch}"
   end
+
+  @doc """
+  Returns the counters kept by the NIFs since they were loaded.
+
+  For each kind of operation (`:encrypt`, `:decrypt`, `:group_encrypt`, `:group_decrypt`,
+  `:sign`, `:verify`, `:sha256`, `:pickle` and `:unpickle`) there's a map of `:calls`,
+  `:bytes_in` and `:bytes_out`. `:errors` maps each libolm error that has happened, such as
+  `:bad_message_mac`, to the number of times it has.
+
+  Every scheduler thread counts into its own slots, so counting is cheap and this call only adds
+  them up. The counts of a call still in progress on another scheduler may not be included yet.
+  """
+  def stats() do
+    {:ok, stats} = NIF.stats()
+    stats
+  end
 end
@@ -1,16 +1,19 @@
 defmodule Olm.Account do
   @moduledoc """
   Functions for working with Olm Accounts.
+
+  An account reference can be shared between processes. Calls on the same account are
+  serialised by a lock inside the NIF.
   """
 
-  alias Olm.{NIF, NIFError}
+  alias Olm.{NIF, NIFError, Telemetry}
   alias Jason
 
   @doc """
   Creates a new account.
   """
   def create() do
-    case NIF.create_account() do
+    case Telemetry.span([:account, :create], %{}, fn -> NIF.create_account() end) do
       {:ok, account_ref} -> account_ref
       {:error, error} -> raise NIFError, error
     end
@@ -20,21 +23,60 @@ defmodule Olm.Account do
   Stores an account as a base64 string. Encrypts the account using the supplied key.
   """
   def pickle(account_ref, key) when is_reference(account_ref) and is_binary(key) do
-    case NIF.pickle_account(account_ref, key) do
+    nif = fn -> NIF.pickle_account(account_ref, key) end
+
+    case Telemetry.span([:account, :pickle], %{}, nif, &Telemetry.result_bytes/1) do
       {:ok, pickled_account} -> pickled_account
       {:error, error} -> raise NIFError, error
     end
   end
 
+  @doc """
+  Returns the account's generation, a number which changes whenever its one time keys do.
+
+  An account which still has the generation it was pickled at doesn't need pickling again, see
+  `pickle_if_changed/3`. Every account, new or unpickled, starts at a generation of its own, so a
+  generation read from one never matches another. To skip pickling an account which was just
+  unpickled, read its generation first.
+  """
+  def generation(account_ref) when is_reference(account_ref),
+    do: NIF.account_generation(account_ref)
+
+  @doc """
+  Pickles the account like `pickle/2`, unless its generation is still `last_generation`.
+
+  Returns `:unchanged`, or `{:ok, pickled_account, generation}` with the generation to pass next
+  time. Pass `0` for an account which was never pickled. The generation is read under the same
+  lock as the account is pickled under, so the pickle is never older than it.
+  """
+  def pickle_if_changed(account_ref, key, last_generation)
+      when is_reference(account_ref) and is_binary(key) and is_integer(last_generation) do
+    nif = fn -> NIF.pickle_account_if_changed(account_ref, key, last_generation) end
+
+    measure = fn
+      {:ok, pickled_account, _generation} -> %{bytes: byte_size(pickled_account)}
+      _result -> %{}
+    end
+
+    case Telemetry.span([:account, :pickle_if_changed], %{}, nif, measure) do
+      :unchanged -> :unchanged
+      {:ok, pickled_account, generation} -> {:ok, pickled_account, generation}
+      {:error, error} -> raise NIFError, error
+    end
+  end
+
   @doc """
   Loads an account from a pickled base64 string. Decrypts the account using the supplied key.
   """
   def unpickle(pickled_account, key) when is_binary(pickled_account) and is_binary(key) do
-    case NIF.unpickle_account(pickled_account, key) do
+    nif = fn -> NIF.unpickle_account(pickled_account, key) end
+    measure = fn _result -> %{bytes: byte_size(pickled_account)} end
+
+    case Telemetry.span([:account, :unpickle], %{}, nif, measure) do
       {:ok, account_ref} ->
         {:ok, account_ref}
 
-      {:error, 'BAD_ACCOUNT_KEY'} ->
+      {:error, :bad_account_key} ->
         {:error, "bad account key: can't decrypt the pickled account"}
 
       {:error, error} ->
@@ -46,17 +88,23 @@ defmodule Olm.Account do
   Returns the public parts of the identity keys for the account. 
   """
   def identity_keys(account_ref) when is_reference(account_ref) do
-    case NIF.account_identity_keys(account_ref) do
-      {:ok, keys_as_json} -> Jason.decode!(keys_as_json, keys: :atoms)
+    nif = fn -> NIF.account_identity_keys_map(account_ref) end
+
+    case Telemetry.span([:account, :identity_keys], %{}, nif) do
+      {:ok, keys} -> keys
       {:error, error} -> raise NIFError, error
     end
   end
 
   @doc """
-  Signs a message with the ed25519 key for this account.
+  Signs a message with the ed25519 key for this account. The message may be iodata.
   """
-  def sign(account_ref, message) when is_reference(account_ref) and is_binary(message) do
-    case NIF.account_sign(account_ref, message) do
+  def sign(account_ref, message)
+      when is_reference(account_ref) and (is_binary(message) or is_list(message)) do
+    nif = fn -> NIF.account_sign(account_ref, message) end
+    measure = fn _result -> %{bytes: IO.iodata_length(message)} end
+
+    case Telemetry.span([:account, :sign], %{}, nif, measure) do
       {:ok, signed} -> signed
       {:error, error} -> raise NIFError, error
     end
@@ -66,18 +114,38 @@ defmodule Olm.Account do
   Returns the public parts of the unpublished one time keys for the account.
   """
   def one_time_keys(account_ref) when is_reference(account_ref) do
-    case NIF.account_one_time_keys(account_ref) do
+    nif = fn -> NIF.account_one_time_keys(account_ref) end
+
+    case Telemetry.span([:account, :one_time_keys], %{}, nif) do
       {:ok, keys_as_json} -> Jason.decode!(keys_as_json, keys: :atoms)
       {:error, error} -> raise NIFError, error
     end
   end
 
+  @doc """
+  Returns the public parts of the unpublished one time keys for the account as a list of
+  `{key_id, key}` binaries.
+
+  Unlike `one_time_keys/1` the keys are read natively, without going through JSON or creating
+  an atom per key id.
+  """
+  def one_time_keys_list(account_ref) when is_reference(account_ref) do
+    nif = fn -> NIF.account_one_time_keys_list(account_ref) end
+
+    case Telemetry.span([:account, :one_time_keys_list], %{}, nif) do
+      {:ok, keys} -> keys
+      {:error, error} -> raise NIFError, error
+    end
+  end
+
   @doc """
   Marks the current set of one time keys as being published.
   """
   def mark_keys_as_published(account_ref) when is_reference(account_ref) do
-    case NIF.account_mark_keys_as_published(account_ref) do
-      {:ok, _} -> :ok
+    nif = fn -> NIF.account_mark_keys_as_published(account_ref) end
+
+    case Telemetry.span([:account, :mark_keys_as_published], %{}, nif) do
+      :ok -> :ok
       {:error, error} -> raise NIFError, error
     end
   end
@@ -86,7 +154,9 @@ defmodule Olm.Account do
   The largest number of one time keys this account can store.
   """
   def max_one_time_keys(account_ref) when is_reference(account_ref) do
-    case NIF.account_max_one_time_keys(account_ref) do
+    nif = fn -> NIF.account_max_one_time_keys(account_ref) end
+
+    case Telemetry.span([:account, :max_one_time_keys], %{}, nif) do
       {:ok, max} -> max
       {:error, error} -> raise NIFError, error
     end
@@ -102,8 +172,35 @@ defmodule Olm.Account do
       true -> one_time_keys(account_ref)
     end
 
-    case NIF.account_generate_one_time_keys(account_ref, count) do
-      {:ok, _} -> result.(return)
+    nif = fn -> NIF.account_generate_one_time_keys(account_ref, count) end
+
+    case Telemetry.span([:account, :generate_one_time_keys], %{count: count}, nif) do
+      :ok -> result.(return)
+      {:error, error} -> raise NIFError, error
+    end
+  end
+
+  @doc """
+  Tops the one time keys the account holds for peers up to `watermark`, capped at
+  `max_one_time_keys/1`.
+
+  The keys held are the unpublished ones and the `published` ones the server still hands out to
+  peers, as the server reports them, such as Matrix's `one_time_key_counts`. libolm drops the
+  oldest keys once it holds its maximum, and those are published keys peers may still start a
+  session with, so the count matters once keys have been published.
+
+  Returns only the newly generated keys, as a list of `{key_id, key}` binaries ready to be
+  uploaded. Generation runs on a dirty scheduler and releases the account between batches of
+  keys, so it can be called from a background process without holding up session creation.
+  Keys still need to be marked as published once uploaded.
+  """
+  def replenish_one_time_keys(account_ref, watermark, published)
+      when is_reference(account_ref) and is_integer(watermark) and watermark >= 0 and
+             is_integer(published) and published >= 0 do
+    nif = fn -> NIF.account_replenish_one_time_keys(account_ref, watermark, published) end
+
+    case Telemetry.span([:account, :replenish_one_time_keys], %{watermark: watermark}, nif) do
+      {:ok, keys} -> keys
       {:error, error} -> raise NIFError, error
     end
   end
@@ -113,8 +210,10 @@ defmodule Olm.Account do
   """
   def remove_one_time_keys(account_ref, session_ref)
       when is_reference(account_ref) and is_reference(session_ref) do
-    case NIF.remove_one_time_keys(account_ref, session_ref) do
-      {:ok, _} -> :ok
+    nif = fn -> NIF.remove_one_time_keys(account_ref, session_ref) end
+
+    case Telemetry.span([:account, :remove_one_time_keys], %{}, nif) do
+      :ok -> :ok
       {:error, error} -> raise NIFError, error
     end
   end
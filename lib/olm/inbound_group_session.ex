@@ -0,0 +1,73 @@
+defmodule Olm.InboundGroupSession do
+  @moduledoc """
+  Functions for working with inbound Megolm group sessions.
+  """
+
+  alias Olm.{NIF, NIFError}
+
+  @doc """
+  Creates a new inbound group session from a session key shared by the sender's
+  `Olm.OutboundGroupSession`.
+  """
+  def new(session_key) when is_binary(session_key) do
+    case NIF.create_inbound_group_session(session_key) do
+      {:ok, session_ref} -> session_ref
+      {:error, error} -> raise NIFError, error
+    end
+  end
+
+  @doc """
+  Stores a group session as a base64 string. Encrypts the session using the supplied key.
+  """
+  def pickle(session_ref, key) when is_reference(session_ref) and is_binary(key) do
+    case NIF.pickle_inbound_group_session(session_ref, key) do
+      {:ok, pickled_session} -> pickled_session
+      {:error, error} -> raise NIFError, error
+    end
+  end
+
+  @doc """
+  Loads a group session from a pickled base64 string. Decrypts the session using the supplied key.
+  """
+  def unpickle(pickled_session, key) when is_binary(pickled_session) and is_binary(key) do
+    case NIF.unpickle_inbound_group_session(pickled_session, key) do
+      {:ok, session_ref} -> session_ref
+      {:error, error} -> raise NIFError, error
+    end
+  end
+
+  @doc """
+  A base64 encoded identifier for this session.
+
+  Will be the same as the id of the outbound group session it was created from.
+  """
+  def id(session_ref) when is_reference(session_ref) do
+    case NIF.inbound_group_session_id(session_ref) do
+      {:ok, id} -> id
+      {:error, error} -> raise NIFError, error
+    end
+  end
+
+  @doc """
+  The first message index this session can decrypt.
+  """
+  def first_known_index(session_ref) when is_reference(session_ref) do
+    case NIF.inbound_group_session_first_known_index(session_ref) do
+      {:ok, index} -> index
+      {:error, error} -> raise NIFError, error
+    end
+  end
+
+  @doc """
+  Decrypts a message using the group session.
+
+  Returns `{plaintext, message_index}`.
+  """
+  def decrypt_message(session_ref, cyphertext)
+      when is_reference(session_ref) and is_binary(cyphertext) do
+    case NIF.group_decrypt_message(session_ref, cyphertext) do
+      {:ok, {plaintext, message_index}} -> {plaintext, message_index}
+      {:error, error} -> raise NIFError, error
+    end
+  end
+end
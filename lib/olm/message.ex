@@ -0,0 +1,49 @@
+defmodule Olm.Message do
+  @moduledoc """
+  Reads the header of an Olm message without decrypting it.
+
+  Every message names the sender's current ratchet key and its index in the chain of messages
+  sent with that key, and a pre key message also names the keys its session is created with.
+  That's enough to put messages from the same sender back in order, to drop one which was
+  delivered twice, or to find the session a message is for, before any of them is decrypted.
+
+      %{ratchet_key: ratchet_key, chain_index: chain_index} =
+        Olm.Message.inspect(type, cyphertext)
+
+  Only the start of the message is decoded and no session is involved, so inspecting is far
+  cheaper than decrypting. Nothing is authenticated either: the header of a message which fails
+  to decrypt can read fine, so it's only a hint until the message has been decrypted.
+  """
+
+  alias Olm.{NIF, NIFError}
+
+  @doc """
+  Returns the header of a message of the given type, as returned with it by
+  `Olm.Session.encrypt_message/2`.
+
+  Every header has the `:ratchet_key` and `:chain_index`. A pre key message (type 0) also has the
+  receiver's `:one_time_key` and the sender's `:base_key` and `:identity_key`. Keys are unpadded
+  base64, like `Olm.Account.identity_keys/1`.
+
+  Raises if the message isn't a message of the type.
+  """
+  def inspect(type, message) when type in [0, 1] and is_binary(message) do
+    case NIF.inspect_message(type, message) do
+      {:ok, {ratchet_key, chain_index}} ->
+        %{type: 1, ratchet_key: ratchet_key, chain_index: chain_index}
+
+      {:ok, {ratchet_key, chain_index, one_time_key, base_key, identity_key}} ->
+        %{
+          type: 0,
+          ratchet_key: ratchet_key,
+          chain_index: chain_index,
+          one_time_key: one_time_key,
+          base_key: base_key,
+          identity_key: identity_key
+        }
+
+      {:error, error} ->
+        raise NIFError, error
+    end
+  end
+end
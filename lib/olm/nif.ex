@@ -21,18 +21,28 @@ defmodule Olm.NIF do
 
   def version(), do: error(__ENV__.function())
 
+  def stats(), do: error(__ENV__.function())
+
   def create_account(), do: error(__ENV__.function())
 
   def pickle_account(_account_ref, _key), do: error(__ENV__.function())
 
   def unpickle_account(_pickled_account, _key), do: error(__ENV__.function())
 
+  def account_generation(_account_ref), do: error(__ENV__.function())
+
+  def pickle_account_if_changed(_account_ref, _key, _generation), do: error(__ENV__.function())
+
   def account_identity_keys(_account_ref), do: error(__ENV__.function())
 
+  def account_identity_keys_map(_account_ref), do: error(__ENV__.function())
+
   def account_sign(_account_ref, _message), do: error(__ENV__.function())
 
   def account_one_time_keys(_account_ref), do: error(__ENV__.function())
 
+  def account_one_time_keys_list(_account_ref), do: error(__ENV__.function())
+
   def account_mark_keys_as_published(_account_ref), do: error(__ENV__.function())
 
   def account_max_one_time_keys(_account_ref), do: error(__ENV__.function())
@@ -40,6 +50,9 @@ defmodule Olm.NIF do
   def account_generate_one_time_keys(_account_ref, _count),
     do: error(__ENV__.function())
 
+  def account_replenish_one_time_keys(_account_ref, _watermark, _published),
+    do: error(__ENV__.function())
+
   def remove_one_time_keys(_account_ref, _session_ref), do: error(__ENV__.function())
 
   def create_outbound_session(_account_ref, _peer_id_key, _peer_one_time_key),
@@ -50,6 +63,8 @@ defmodule Olm.NIF do
   def create_inbound_session_from(_account_ref, _message, _peer_id_key),
     do: error(__ENV__.function())
 
+  def session_size(), do: error(__ENV__.function())
+
   def session_id(_session_ref), do: error(__ENV__.function())
 
   def match_inbound_session(_session_ref, _message), do: error(__ENV__.function())
@@ -57,20 +72,98 @@ defmodule Olm.NIF do
   def match_inbound_session_from(_session_ref, _message, _peer_id_key),
     do: error(__ENV__.function())
 
+  def inspect_message(_type, _message), do: error(__ENV__.function())
+
+  def create_session_index(), do: error(__ENV__.function())
+
+  def session_index_put(_index_ref, _session_ref), do: error(__ENV__.function())
+
+  def session_index_put(_index_ref, _session_ref, _message), do: error(__ENV__.function())
+
+  def session_index_lookup(_index_ref, _message), do: error(__ENV__.function())
+
+  def session_index_delete(_index_ref, _session_ref), do: error(__ENV__.function())
+
+  def session_index_size(_index_ref), do: error(__ENV__.function())
+
+  def journal_open(_path), do: error(__ENV__.function())
+
+  def journal_close(_journal_ref), do: error(__ENV__.function())
+
+  def journal_put(_journal_ref, _id, _generation, _pickled_session),
+    do: error(__ENV__.function())
+
+  def journal_put_session(_journal_ref, _session_ref, _key), do: error(__ENV__.function())
+
+  def journal_delete(_journal_ref, _id), do: error(__ENV__.function())
+
+  def journal_fetch(_journal_ref, _id), do: error(__ENV__.function())
+
+  def journal_load_session(_journal_ref, _id, _key), do: error(__ENV__.function())
+
+  def journal_compact(_journal_ref), do: error(__ENV__.function())
+
+  def journal_stats(_journal_ref), do: error(__ENV__.function())
+
   def pickle_session(_session_ref, _key), do: error(__ENV__.function())
 
   def unpickle_session(_pickled_session, _key), do: error(__ENV__.function())
 
-  def encrypt_message_type(_session_ref), do: error(__ENV__.function())
+  def pickle_session_raw(_session_ref, _key), do: error(__ENV__.function())
+
+  def unpickle_session_raw(_pickled_session, _key), do: error(__ENV__.function())
+
+  def session_generation(_session_ref), do: error(__ENV__.function())
+
+  def pickle_session_if_changed(_session_ref, _key, _generation, _raw),
+    do: error(__ENV__.function())
+
+  def pickle_sessions(_session_refs, _key), do: error(__ENV__.function())
+
+  def unpickle_sessions(_pickled_sessions, _key), do: error(__ENV__.function())
 
   def encrypt_message(_session_ref, _plaintext), do: error(__ENV__.function())
 
+  def encrypt_messages(_session_ref, _plaintexts), do: error(__ENV__.function())
+
+  def encrypt_to_sessions(_session_refs, _plaintext), do: error(__ENV__.function())
+
   def decrypt_message(_session_ref, _type, _cyphertext), do: error(__ENV__.function())
 
+  def decrypt_messages(_session_ref, _messages), do: error(__ENV__.function())
+
+  def create_outbound_group_session(), do: error(__ENV__.function())
+
+  def pickle_outbound_group_session(_session_ref, _key), do: error(__ENV__.function())
+
+  def unpickle_outbound_group_session(_pickled_session, _key), do: error(__ENV__.function())
+
+  def outbound_group_session_id(_session_ref), do: error(__ENV__.function())
+
+  def outbound_group_session_key(_session_ref), do: error(__ENV__.function())
+
+  def outbound_group_session_message_index(_session_ref), do: error(__ENV__.function())
+
+  def group_encrypt_message(_session_ref, _plaintext), do: error(__ENV__.function())
+
+  def create_inbound_group_session(_session_key), do: error(__ENV__.function())
+
+  def pickle_inbound_group_session(_session_ref, _key), do: error(__ENV__.function())
+
+  def unpickle_inbound_group_session(_pickled_session, _key), do: error(__ENV__.function())
+
+  def inbound_group_session_id(_session_ref), do: error(__ENV__.function())
+
+  def inbound_group_session_first_known_index(_session_ref), do: error(__ENV__.function())
+
+  def group_decrypt_message(_session_ref, _cyphertext), do: error(__ENV__.function())
+
   def utility_sha256(_string), do: error(__ENV__.function())
 
   def utility_ed25519_verify(_key, _message, _signature), do: error(__ENV__.function())
 
+  def utility_ed25519_verify_many(_signatures), do: error(__ENV__.function())
+
   defp error({function_name, arity}),
     do: :erlang.nif_error("NIF #{function_name}/#{arity} not implemented")
 end
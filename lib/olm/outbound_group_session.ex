@@ -0,0 +1,82 @@
+defmodule Olm.OutboundGroupSession do
+  @moduledoc """
+  Functions for working with outbound Megolm group sessions.
+  """
+
+  alias Olm.{NIF, NIFError}
+
+  @doc """
+  Creates a new outbound group session.
+  """
+  def new() do
+    case NIF.create_outbound_group_session() do
+      {:ok, session_ref} -> session_ref
+      {:error, error} -> raise NIFError, error
+    end
+  end
+
+  @doc """
+  Stores a group session as a base64 string. Encrypts the session using the supplied key.
+  """
+  def pickle(session_ref, key) when is_reference(session_ref) and is_binary(key) do
+    case NIF.pickle_outbound_group_session(session_ref, key) do
+      {:ok, pickled_session} -> pickled_session
+      {:error, error} -> raise NIFError, error
+    end
+  end
+
+  @doc """
+  Loads a group session from a pickled base64 string. Decrypts the session using the supplied key.
+  """
+  def unpickle(pickled_session, key) when is_binary(pickled_session) and is_binary(key) do
+    case NIF.unpickle_outbound_group_session(pickled_session, key) do
+      {:ok, session_ref} -> session_ref
+      {:error, error} -> raise NIFError, error
+    end
+  end
+
+  @doc """
+  A base64 encoded identifier for this session.
+  """
+  def id(session_ref) when is_reference(session_ref) do
+    case NIF.outbound_group_session_id(session_ref) do
+      {:ok, id} -> id
+      {:error, error} -> raise NIFError, error
+    end
+  end
+
+  @doc """
+  The base64 encoded session key at the current ratchet index.
+
+  This is shared with the devices in the room so they can create an
+  `Olm.InboundGroupSession`.
+  """
+  def session_key(session_ref) when is_reference(session_ref) do
+    case NIF.outbound_group_session_key(session_ref) do
+      {:ok, session_key} -> session_key
+      {:error, error} -> raise NIFError, error
+    end
+  end
+
+  @doc """
+  The index of the ratchet which will be used for the next message.
+  """
+  def message_index(session_ref) when is_reference(session_ref) do
+    case NIF.outbound_group_session_message_index(session_ref) do
+      {:ok, index} -> index
+      {:error, error} -> raise NIFError, error
+    end
+  end
+
+  @doc """
+  Encrypts a message using the group session, returning the base64 encoded cyphertext. The
+  plaintext may be iodata.
+  """
+  def encrypt_message(session_ref, plaintext)
+      when is_reference(session_ref) and (is_binary(plaintext) or is_list(plaintext)) do
+    case NIF.group_encrypt_message(session_ref, plaintext) do
+      {:ok, cyphertext} -> cyphertext
+      {:error, error} -> raise NIFError, error
+    end
+  end
+end
@@ -1,16 +1,28 @@
 defmodule Olm.Session do
   @moduledoc """
   Functions for working with Olm Sessions.
+
+  A session reference can be shared between processes. Calls on the same session are serialised
+  by a lock inside the NIF, so concurrent callers never corrupt the ratchet.
   """
 
-  alias Olm.{NIF, NIFError}
+  alias Olm.{NIF, NIFError, Telemetry}
+
+  # Each NIF call in pickle_many/2 and unpickle_many/2 works through this many sessions.
+  @bulk_batch_size 1000
+
+  # Each NIF call in encrypt_to_many/2 encrypts for this many sessions, and calls run in
+  # parallel.
+  @fan_out_batch_size 250
 
   @doc """
   Creates a new out-bound session for sending messages to a given peer identity key and one time key.
   """
   def new_outbound(account_ref, peer_id_key, peer_one_time_key)
       when is_reference(account_ref) and is_binary(peer_id_key) and is_binary(peer_one_time_key) do
-    case NIF.create_outbound_session(account_ref, peer_id_key, peer_one_time_key) do
+    nif = fn -> NIF.create_outbound_session(account_ref, peer_id_key, peer_one_time_key) end
+
+    case Telemetry.span([:session, :new_outbound], %{}, nif) do
       {:ok, session_ref} -> session_ref
       {:error, error} -> raise NIFError, error
     end
@@ -20,7 +32,9 @@ defmodule Olm.Session do
   Creates a new in-bound session for sending/receiving messages from an incoming pre key message.
   """
   def new_inbound(account_ref, message) when is_reference(account_ref) and is_binary(message) do
-    case NIF.create_inbound_session(account_ref, message) do
+    nif = fn -> NIF.create_inbound_session(account_ref, message) end
+
+    case Telemetry.span([:session, :new_inbound], %{}, nif) do
       {:ok, session_ref} -> session_ref
       {:error, error} -> raise NIFError, error
     end
@@ -31,19 +45,26 @@ defmodule Olm.Session do
   """
   def new_inbound(account_ref, message, peer_id_key)
       when is_reference(account_ref) and is_binary(message) and is_binary(peer_id_key) do
-    case NIF.create_inbound_session_from(account_ref, message, peer_id_key) do
+    nif = fn -> NIF.create_inbound_session_from(account_ref, message, peer_id_key) end
+
+    case Telemetry.span([:session, :new_inbound], %{}, nif) do
       {:ok, session_ref} -> session_ref
       {:error, error} -> raise NIFError, error
     end
   end
 
+  @doc """
+  The bytes of memory each live session reference holds, not counting the BEAM's own bookkeeping.
+  """
+  def memory(), do: NIF.session_size()
+
   @doc """
   An identifier for this session. 
 
   Will be the same for both ends of the conversation.
   """
   def id(session_ref) when is_reference(session_ref) do
-    case NIF.session_id(session_ref) do
+    case Telemetry.span([:session, :id], %{}, fn -> NIF.session_id(session_ref) end) do
       {:ok, id} -> id
       {:error, error} -> raise NIFError, error
     end
@@ -51,9 +72,13 @@ defmodule Olm.Session do
 
   @doc """
   Checks if the pre key message is for this in-bound session.
+
+  To find which of many sessions a message is for, see `Olm.SessionIndex`.
   """
   def match_inbound(session_ref, message) when is_reference(session_ref) and is_binary(message) do
-    case NIF.match_inbound_session(session_ref, message) do
+    nif = fn -> NIF.match_inbound_session(session_ref, message) end
+
+    case Telemetry.span([:session, :match_inbound], %{}, nif) do
       {:ok, val} -> val
       {:error, error} -> raise NIFError, error
     end
@@ -64,7 +89,9 @@ defmodule Olm.Session do
   """
   def match_inbound(session_ref, message, peer_id_key)
       when is_reference(session_ref) and is_binary(message) and is_binary(peer_id_key) do
-    case NIF.match_inbound_session_from(session_ref, message, peer_id_key) do
+    nif = fn -> NIF.match_inbound_session_from(session_ref, message, peer_id_key) end
+
+    case Telemetry.span([:session, :match_inbound], %{}, nif) do
       {:ok, val} -> val
       {:error, error} -> raise NIFError, error
     end
@@ -72,54 +99,260 @@ defmodule Olm.Session do
 
   @doc """
   Stores a session as a base64 string.
+
+  Passing `:raw` as the format stores the same pickle as raw bytes instead, which are a quarter
+  smaller and suit a binary column. It only saves space: libolm still pickles to base64, which
+  is decoded afterwards and encoded again to unpickle, so neither is faster. Raw pickles must be
+  loaded with `unpickle/3` and `:raw`, or base64 encoded without padding to get the default
+  format back.
   """
-  def pickle(session_ref, key) when is_reference(session_ref) and is_binary(key) do
-    case NIF.pickle_session(session_ref, key) do
+  def pickle(session_ref, key, format \\ :base64)
+
+  def pickle(session_ref, key, :base64) when is_reference(session_ref) and is_binary(key) do
+    nif = fn -> NIF.pickle_session(session_ref, key) end
+    metadata = %{format: :base64}
+
+    case Telemetry.span([:session, :pickle], metadata, nif, &Telemetry.result_bytes/1) do
+      {:ok, pickled_session} -> pickled_session
+      {:error, error} -> raise NIFError, error
+    end
+  end
+
+  def pickle(session_ref, key, :raw) when is_reference(session_ref) and is_binary(key) do
+    nif = fn -> NIF.pickle_session_raw(session_ref, key) end
+    metadata = %{format: :raw}
+
+    case Telemetry.span([:session, :pickle], metadata, nif, &Telemetry.result_bytes/1) do
       {:ok, pickled_session} -> pickled_session
       {:error, error} -> raise NIFError, error
     end
   end
 
   @doc """
-  Loads a session from a pickled base64 string.
+  Returns the session's generation, a number which changes whenever encrypting or decrypting
+  moves its ratchet on.
+
+  A session which still has the generation it was pickled at doesn't need pickling again, see
+  `pickle_if_changed/4`. Reading the session's id or checking whether a message matches it
+  leaves the generation alone. Every session, new, unpickled or loaded from a journal, starts at
+  a generation of its own, so a generation read from one never matches another. To skip pickling
+  a session which was just unpickled, read its generation first.
   """
-  def unpickle(pickled_session, key) when is_binary(pickled_session) and is_binary(key) do
-    case NIF.unpickle_session(pickled_session, key) do
+  def generation(session_ref) when is_reference(session_ref),
+    do: NIF.session_generation(session_ref)
+
+  @doc """
+  Pickles the session like `pickle/3`, unless its generation is still `last_generation`.
+
+  Returns `:unchanged`, or `{:ok, pickled_session, generation}` with the generation to pass next
+  time. Pass `0` for a session which was never pickled. The generation is read under the same
+  lock as the session is pickled under, so the pickle is never older than it.
+  """
+  def pickle_if_changed(session_ref, key, last_generation, format \\ :base64)
+      when is_reference(session_ref) and is_binary(key) and is_integer(last_generation) and
+             format in [:base64, :raw] do
+    nif = fn ->
+      NIF.pickle_session_if_changed(session_ref, key, last_generation, format == :raw)
+    end
+
+    measure = fn
+      {:ok, pickled_session, _generation} -> %{bytes: byte_size(pickled_session)}
+      _result -> %{}
+    end
+
+    case Telemetry.span([:session, :pickle_if_changed], %{format: format}, nif, measure) do
+      :unchanged -> :unchanged
+      {:ok, pickled_session, generation} -> {:ok, pickled_session, generation}
+      {:error, error} -> raise NIFError, error
+    end
+  end
+
+  @doc """
+  Loads a session from a pickled base64 string, or from raw bytes when the format is `:raw`.
+  """
+  def unpickle(pickled_session, key, format \\ :base64)
+
+  def unpickle(pickled_session, key, :base64)
+      when is_binary(pickled_session) and is_binary(key) do
+    nif = fn -> NIF.unpickle_session(pickled_session, key) end
+    measure = fn _result -> %{bytes: byte_size(pickled_session)} end
+
+    case Telemetry.span([:session, :unpickle], %{format: :base64}, nif, measure) do
+      {:ok, session_ref} -> session_ref
+      {:error, error} -> raise NIFError, error
+    end
+  end
+
+  def unpickle(pickled_session, key, :raw) when is_binary(pickled_session) and is_binary(key) do
+    nif = fn -> NIF.unpickle_session_raw(pickled_session, key) end
+    measure = fn _result -> %{bytes: byte_size(pickled_session)} end
+
+    case Telemetry.span([:session, :unpickle], %{format: :raw}, nif, measure) do
       {:ok, session_ref} -> session_ref
       {:error, error} -> raise NIFError, error
     end
   end
 
   @doc """
-  Encrypts a message using the session.
+  Pickles a list or stream of sessions with the same key.
+
+  Returns a list with an `{:ok, pickled_session}` or `{:error, reason}` for each session, in
+  order. Sessions are pickled in batches of #{@bulk_batch_size} on a dirty scheduler.
   """
-  def encrypt_message(session_ref, plaintext)
-      when is_reference(session_ref) and is_binary(plaintext) do
-    type =
-      case NIF.encrypt_message_type(session_ref) do
-        {:ok, type} -> type
+  def pickle_many(session_refs, key) when is_binary(key) do
+    bulk(session_refs, :pickle_many, &NIF.pickle_sessions(&1, key))
+  end
+
+  @doc """
+  Loads a list or stream of sessions pickled with the same key.
+
+  Returns a list with an `{:ok, session_ref}` or `{:error, reason}` for each pickle, in order,
+  so one corrupt pickle doesn't stop the rest from loading. Pickles are unpickled in batches of
+  #{@bulk_batch_size} on a dirty scheduler, reusing one scratch buffer per batch.
+  """
+  def unpickle_many(pickled_sessions, key) when is_binary(key) do
+    bulk(pickled_sessions, :unpickle_many, &NIF.unpickle_sessions(&1, key))
+  end
+
+  # Each batch is a span of its own.
+  defp bulk(enumerable, event, nif) do
+    enumerable
+    |> Stream.chunk_every(@bulk_batch_size)
+    |> Enum.flat_map(fn batch ->
+      run = fn -> nif.(batch) end
+      measure = fn _result -> %{count: length(batch)} end
+
+      case Telemetry.span([:session, event], %{}, run, measure) do
+        {:ok, results} -> results
         {:error, error} -> raise NIFError, error
       end
+    end)
+  end
 
-    case NIF.encrypt_message(session_ref, plaintext) do
-      {:ok, cyphertext} -> %{cyphertext: cyphertext, type: type}
+  @doc """
+  Encrypts a message using the session. The plaintext may be iodata.
+  """
+  def encrypt_message(session_ref, plaintext)
+      when is_reference(session_ref) and (is_binary(plaintext) or is_list(plaintext)) do
+    nif = fn ->
+      with {:ok, {type, cyphertext}} <- NIF.encrypt_message(session_ref, plaintext) do
+        {:ok, %{cyphertext: cyphertext, type: type}}
+      end
+    end
+
+    measure = fn
+      {:ok, %{type: type}} -> %{bytes: IO.iodata_length(plaintext), type: type}
+      _error -> %{bytes: IO.iodata_length(plaintext)}
+    end
+
+    case Telemetry.span([:session, :encrypt_message], %{}, nif, measure) do
+      {:ok, message} -> message
       {:error, error} -> raise NIFError, error
     end
   end
 
+  @doc """
+  Encrypts a list of messages using the session in a single NIF call.
+
+  Returns a list of `{type, cyphertext}` tuples in the same order as the plaintexts. Batches of
+  many or large plaintexts are encrypted on a dirty scheduler.
+
+  If a plaintext fails to encrypt, returns `{:error, reason, messages}` with the messages
+  encrypted before it. They've already moved the session's ratchet on, so they must still be
+  sent, or the session pickled before the batch restored.
+  """
+  def encrypt_many(session_ref, plaintexts)
+      when is_reference(session_ref) and is_list(plaintexts) do
+    nif = fn -> NIF.encrypt_messages(session_ref, plaintexts) end
+    measure = fn _result -> %{count: length(plaintexts)} end
+
+    case Telemetry.span([:session, :encrypt_many], %{}, nif, measure) do
+      {:ok, messages} -> messages
+      {:error, error, messages} -> {:error, error, messages}
+    end
+  end
+
+  @doc """
+  Encrypts one plaintext for each of a list of sessions, such as every device a room key is
+  shared with. The plaintext may be iodata.
+
+  Returns a list of `{session_ref, type, cyphertext}` tuples in the same order as the sessions.
+  The plaintext is read once for the whole list. Large lists are split into batches which are
+  encrypted in parallel on dirty schedulers.
+
+  If a session fails to encrypt, the rest of its batch is skipped but the other batches still
+  run, and this returns `{:error, reason, messages}` with every message which was encrypted.
+  Those sessions' ratchets have moved on, so their messages must still be sent.
+  """
+  def encrypt_to_many(session_refs, plaintext)
+      when is_list(session_refs) and (is_binary(plaintext) or is_list(plaintext)) do
+    plaintext = IO.iodata_to_binary(plaintext)
+
+    nif = fn -> session_refs |> Enum.chunk_every(@fan_out_batch_size) |> fan_out(plaintext) end
+    measure = fn _result -> %{bytes: byte_size(plaintext), count: length(session_refs)} end
+
+    case Telemetry.span([:session, :encrypt_to_many], %{}, nif, measure) do
+      {:ok, messages} -> messages
+      {:error, error, messages} -> {:error, error, messages}
+    end
+  end
+
+  defp fan_out([], _plaintext), do: {:ok, []}
+
+  defp fan_out([batch], plaintext), do: NIF.encrypt_to_sessions(batch, plaintext)
+
+  defp fan_out(batches, plaintext) do
+    results =
+      batches
+      |> Task.async_stream(&NIF.encrypt_to_sessions(&1, plaintext),
+        max_concurrency: :erlang.system_info(:dirty_cpu_schedulers_online),
+        timeout: :infinity
+      )
+      |> Enum.map(fn {:ok, result} -> result end)
+
+    messages =
+      Enum.flat_map(results, fn
+        {:ok, messages} -> messages
+        {:error, _error, messages} -> messages
+      end)
+
+    case Enum.find(results, &match?({:error, _error, _messages}, &1)) do
+      nil -> {:ok, messages}
+      {:error, error, _messages} -> {:error, error, messages}
+    end
+  end
+
   @doc """
   Decrypts a message using the session.
+
+  The plaintext is returned exactly as it was encrypted, whether it's text or any other binary.
+  To order or route messages before decrypting them, see `Olm.Message.inspect/2`.
   """
   def decrypt_message(session_ref, type, cyphertext)
       when is_reference(session_ref) and is_integer(type) do
-    case NIF.decrypt_message(session_ref, type, cyphertext) do
-      {:ok, plaintext} ->
-        plaintext
-        |> String.chunk(:printable)
-        |> List.first()
-
-      {error, error} ->
-        raise NIFError, error
+    nif = fn -> NIF.decrypt_message(session_ref, type, cyphertext) end
+    measure = fn _result -> %{bytes: IO.iodata_length(cyphertext), type: type} end
+
+    case Telemetry.span([:session, :decrypt_message], %{}, nif, measure) do
+      {:ok, plaintext} -> plaintext
+      {:error, error} -> raise NIFError, error
+    end
+  end
+
+  @doc """
+  Decrypts a list of `{type, cyphertext}` messages using the session in a single NIF call.
+
+  Messages are decrypted in order. Returns a list with an `{:ok, plaintext}` or
+  `{:error, reason}` entry per message; a message which fails to decrypt does not stop the rest
+  of the batch. Large batches are decrypted on a dirty scheduler.
+  """
+  def decrypt_many(session_ref, messages) when is_reference(session_ref) and is_list(messages) do
+    nif = fn -> NIF.decrypt_messages(session_ref, messages) end
+    measure = fn _result -> %{count: length(messages)} end
+
+    case Telemetry.span([:session, :decrypt_many], %{}, nif, measure) do
+      {:ok, results} -> results
+      {:error, error} -> raise NIFError, error
     end
   end
 end
@@ -0,0 +1,263 @@
+defmodule Olm.SessionCache do
+  @moduledoc """
+  Keeps recently used sessions live and evicts the rest to pickles.
+
+  Every live session holds `Olm.Session.memory/0` bytes of native memory, which adds up with a
+  session per device pair, while pickling after every message costs CPU on every message. The
+  cache keeps the most recently used sessions live up to a budget and pickles the least recently
+  used ones into a store when it's exceeded, unpickling them again the next time they're used.
+
+      {:ok, _pid} =
+        Olm.SessionCache.start_link(name: MyApp.Sessions, key: pickle_key, max_memory: 64_000_000)
+
+      :ok = Olm.SessionCache.put(MyApp.Sessions, {user_id, device_id}, session_ref)
+
+      {:ok, plaintext} =
+        Olm.SessionCache.with_session(MyApp.Sessions, {user_id, device_id}, fn session_ref ->
+          Olm.Session.decrypt_message(session_ref, type, cyphertext)
+        end)
+
+  ## Options
+
+    * `:name` - the atom the cache is registered under and called by. Required.
+    * `:key` - the key sessions are pickled with. Required.
+    * `:max_memory` - the native memory live sessions may hold, in bytes.
+    * `:max_live` - the number of sessions which may be live.
+    * `:store` - where evicted sessions are kept, as `{module, options}` for a module
+      implementing `Olm.SessionCache.Store`. Defaults to `{Olm.SessionCache.ETSStore, []}`.
+
+  One of `:max_memory` and `:max_live` is required. When the budget is exceeded, the least
+  recently used sessions are evicted until the cache is back to 90% of it, so eviction doesn't
+  run on every insert.
+
+  Using a live session only reads and updates a public ETS table from the caller's process; the
+  cache's process is only involved to bring an evicted session back and to evict. A session is
+  never evicted while a `with_session/3` function is using it, so the session reference must not
+  be kept after the function returns. Session ids may be any term.
+  """
+
+  use GenServer
+
+  alias Olm.Session
+
+  # Live sessions are {id, session_ref, users, last_used} rows in a table named after the cache.
+  @users 3
+  @last_used 4
+
+  # Indexes into the cache's :counters, which is kept in :persistent_term.
+  @hits 1
+  @misses 2
+  @evictions 3
+
+  @evict_to 0.9
+
+  @doc """
+  Starts a cache, see the options above.
+  """
+  def start_link(options) do
+    GenServer.start_link(__MODULE__, options, name: Keyword.fetch!(options, :name))
+  end
+
+  @doc """
+  Adds a live session to the cache, replacing any session stored under the same id.
+  """
+  def put(cache, id, session_ref) when is_atom(cache) and is_reference(session_ref) do
+    GenServer.call(cache, {:put, id, session_ref})
+  end
+
+  @doc """
+  Calls `fun` with the session stored under `id`, unpickling it first if it was evicted.
+
+  Returns `{:ok, result}` with the result of `fun`, or `:error` if there's no session with the id.
+  """
+  def with_session(cache, id, fun) when is_atom(cache) and is_function(fun, 1) do
+    case checkout(cache, id) do
+      {:ok, session_ref} ->
+        try do
+          {:ok, fun.(session_ref)}
+        after
+          checkin(cache, id)
+        end
+
+      :error ->
+        :error
+    end
+  end
+
+  @doc """
+  Removes a session from the cache, whether it's live or evicted.
+  """
+  def delete(cache, id) when is_atom(cache), do: GenServer.call(cache, {:delete, id})
+
+  @doc """
+  Returns the number of `with_session/3` calls which found their session live (`:hits`) and which
+  had to go to the store (`:misses`), the number of sessions evicted so far (`:evictions`) and the
+  number of sessions live right now (`:live`).
+  """
+  def stats(cache) when is_atom(cache) do
+    counters = counters(cache)
+
+    %{
+      hits: :counters.get(counters, @hits),
+      misses: :counters.get(counters, @misses),
+      evictions: :counters.get(counters, @evictions),
+      live: :ets.info(cache, :size)
+    }
+  end
+
+  defp checkout(cache, id) do
+    with :error <- checkout_live(cache, id) do
+      case GenServer.call(cache, {:checkout, id}) do
+        {:raise, exception} -> raise exception
+        reply -> reply
+      end
+    end
+  end
+
+  # Taking a use of the row before reading the session from it means the session can't be
+  # evicted in between.
+  defp checkout_live(cache, id) do
+    :ets.update_counter(cache, id, {@users, 1})
+
+    case :ets.lookup(cache, id) do
+      [{^id, session_ref, _users, _last_used}] ->
+        :counters.add(counters(cache), @hits, 1)
+        {:ok, session_ref}
+
+      [] ->
+        :error
+    end
+  rescue
+    ArgumentError -> :error
+  end
+
+  defp checkin(cache, id) do
+    :ets.update_element(cache, id, {@last_used, System.monotonic_time()})
+    :ets.update_counter(cache, id, {@users, -1})
+  rescue
+    # The session was deleted while it was in use.
+    ArgumentError -> :ok
+  end
+
+  defp counters(cache), do: :persistent_term.get({__MODULE__, cache})
+
+  @impl true
+  def init(options) do
+    name = Keyword.fetch!(options, :name)
+    {store, store_options} = Keyword.get(options, :store, {Olm.SessionCache.ETSStore, []})
+
+    :ets.new(name, [
+      :set,
+      :public,
+      :named_table,
+      read_concurrency: true,
+      write_concurrency: true
+    ])
+
+    :persistent_term.put({__MODULE__, name}, :counters.new(3, [:write_concurrency]))
+
+    state = %{
+      name: name,
+      key: Keyword.fetch!(options, :key),
+      max_live: max_live(options),
+      store: store,
+      store_state: store.init(store_options)
+    }
+
+    {:ok, state}
+  end
+
+  defp max_live(options) do
+    by_memory =
+      case Keyword.fetch(options, :max_memory) do
+        {:ok, max_memory} -> div(max_memory, Session.memory())
+        :error -> nil
+      end
+
+    case {Keyword.get(options, :max_live), by_memory} do
+      {nil, nil} -> raise ArgumentError, "one of :max_memory and :max_live is required"
+      {max_live, nil} -> max_live
+      {nil, max_live} -> max_live
+      {max_live, by_memory} -> min(max_live, by_memory)
+    end
+  end
+
+  @impl true
+  def handle_call({:put, id, session_ref}, _from, state) do
+    now = System.monotonic_time()
+
+    # A session already in use keeps its count of users.
+    unless :ets.update_element(state.name, id, [{2, session_ref}, {@last_used, now}]) do
+      :ets.insert(state.name, {id, session_ref, 0, now})
+    end
+
+    :ok = state.store.delete(state.store_state, id)
+    evict(state)
+
+    {:reply, :ok, state}
+  end
+
+  def handle_call({:checkout, id}, _from, state) do
+    # Another caller may have brought the session back while this one was waiting.
+    reply =
+      with :error <- checkout_live(state.name, id) do
+        load(state, id)
+      end
+
+    evict(state)
+
+    {:reply, reply, state}
+  end
+
+  def handle_call({:delete, id}, _from, state) do
+    :ets.delete(state.name, id)
+    :ok = state.store.delete(state.store_state, id)
+
+    {:reply, :ok, state}
+  end
+
+  # The pickle is removed from the store once the session is live again, so the store only ever
+  # holds evicted sessions.
+  defp load(state, id) do
+    :counters.add(counters(state.name), @misses, 1)
+
+    with {:ok, pickled_session} <- state.store.fetch(state.store_state, id) do
+      session_ref = Session.unpickle(pickled_session, state.key, :raw)
+
+      :ets.insert(state.name, {id, session_ref, 1, System.monotonic_time()})
+      :ok = state.store.delete(state.store_state, id)
+
+      {:ok, session_ref}
+    end
+  rescue
+    exception in Olm.NIFError -> {:raise, exception}
+  end
+
+  defp evict(%{name: name, max_live: max_live} = state) do
+    live = :ets.info(name, :size)
+
+    if live > max_live do
+      # Sessions in use are skipped; they were used last anyway.
+      name
+      |> :ets.select([{{:"$1", :"$2", 0, :"$3"}, [], [{{:"$3", :"$1", :"$2"}}]}])
+      |> Enum.sort()
+      |> Enum.take(live - trunc(max_live * @evict_to))
+      |> Enum.each(fn {_last_used, id, session_ref} -> evict(state, id, session_ref) end)
+    end
+  end
+
+  defp evict(state, id, session_ref) do
+    # Deleting the row only if it's still unused is atomic, so a caller which took a use of it
+    # since it was selected keeps it live.
+    # The id is matched in the guard, where it's taken literally, so an id like :_ can't match
+    # other rows.
+    match_spec = [{{:"$1", :_, 0, :_}, [{:"=:=", :"$1", {:const, id}}], [true]}]
+
+    if :ets.select_delete(state.name, match_spec) == 1 do
+      pickled_session = Session.pickle(session_ref, state.key, :raw)
+
+      :ok = state.store.put(state.store_state, id, pickled_session)
+      :counters.add(counters(state.name), @evictions, 1)
+    end
+  end
+end
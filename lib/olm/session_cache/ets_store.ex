@@ -0,0 +1,33 @@
+defmodule Olm.SessionCache.ETSStore do
+  @moduledoc """
+  The default `Olm.SessionCache.Store`, which keeps pickles in an ETS table owned by the cache.
+
+  A raw pickle is a fraction of the size of a live session, so this alone cuts the memory held
+  by cold sessions, but they're lost when the cache stops.
+  """
+
+  @behaviour Olm.SessionCache.Store
+
+  @impl true
+  def init(_options), do: :ets.new(__MODULE__, [:set, :private])
+
+  @impl true
+  def put(table, id, pickled_session) do
+    :ets.insert(table, {id, pickled_session})
+    :ok
+  end
+
+  @impl true
+  def fetch(table, id) do
+    case :ets.lookup(table, id) do
+      [{^id, pickled_session}] -> {:ok, pickled_session}
+      [] -> :error
+    end
+  end
+
+  @impl true
+  def delete(table, id) do
+    :ets.delete(table, id)
+    :ok
+  end
+end
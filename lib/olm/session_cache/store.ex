@@ -0,0 +1,31 @@
+defmodule Olm.SessionCache.Store do
+  @moduledoc """
+  Where an `Olm.SessionCache` keeps the sessions it has evicted, as raw pickles.
+
+  Every callback runs in the cache's process, so a store needs no locking of its own. The
+  default, `Olm.SessionCache.ETSStore`, keeps pickles in memory; a store backed by a database
+  keeps cold sessions across restarts too.
+  """
+
+  @type state :: term()
+
+  @doc """
+  Sets the store up with the options given as `{module, options}` to the cache.
+  """
+  @callback init(options :: keyword()) :: state()
+
+  @doc """
+  Stores the pickle of an evicted session, replacing any previous one.
+  """
+  @callback put(state(), id :: term(), pickled_session :: binary()) :: :ok
+
+  @doc """
+  Returns the pickle stored for a session.
+  """
+  @callback fetch(state(), id :: term()) :: {:ok, binary()} | :error
+
+  @doc """
+  Removes the pickle stored for a session, if there is one.
+  """
+  @callback delete(state(), id :: term()) :: :ok
+end
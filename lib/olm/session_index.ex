@@ -0,0 +1,92 @@
+defmodule Olm.SessionIndex do
+  @moduledoc """
+  Finds the inbound session a pre key message belongs to.
+
+  Until a sender hears back, every message it encrypts is a pre key message naming the keys its
+  session was created with. Finding the session by trying `Olm.Session.match_inbound/2` on each
+  of a peer's sessions decodes the message again for every one of them. An index reads the keys
+  out of the message once and goes straight to the session created with them.
+
+      index_ref = Olm.SessionIndex.new()
+
+      session_ref =
+        case Olm.SessionIndex.lookup(index_ref, cyphertext) do
+          {:ok, session_ref} ->
+            session_ref
+
+          :error ->
+            session_ref = Olm.Session.new_inbound(account_ref, cyphertext, peer_id_key)
+            :ok = Olm.SessionIndex.put(index_ref, session_ref)
+            session_ref
+        end
+
+      Olm.Session.decrypt_message(session_ref, 0, cyphertext)
+
+  A message is matched on the receiver's one time key and the sender's base and identity keys,
+  like `Olm.Session.match_inbound/2`. An index can be shared between processes, and holds on to
+  the sessions in it until they're deleted.
+  """
+
+  alias Olm.{NIF, NIFError}
+
+  @doc """
+  Creates a new, empty index.
+  """
+  def new() do
+    case NIF.create_session_index() do
+      {:ok, index_ref} -> index_ref
+      {:error, error} -> raise NIFError, error
+    end
+  end
+
+  @doc """
+  Adds an inbound session, under the keys of the pre key message it was created from.
+
+  Pickles don't keep those keys, so a session loaded from one has to be added with `put/3`.
+  A session already in the index under the same keys is replaced.
+  """
+  def put(index_ref, session_ref) when is_reference(index_ref) and is_reference(session_ref) do
+    case NIF.session_index_put(index_ref, session_ref) do
+      :ok -> :ok
+      {:error, error} -> raise NIFError, error
+    end
+  end
+
+  @doc """
+  Adds an inbound session under the keys of a pre key message for it.
+
+  Raises if the message isn't for the session.
+  """
+  def put(index_ref, session_ref, message)
+      when is_reference(index_ref) and is_reference(session_ref) and is_binary(message) do
+    case NIF.session_index_put(index_ref, session_ref, message) do
+      :ok -> :ok
+      {:error, error} -> raise NIFError, error
+    end
+  end
+
+  @doc """
+  Returns `{:ok, session_ref}` with the session a pre key message is for, or `:error` if there's
+  none in the index and the message starts a new inbound session.
+  """
+  def lookup(index_ref, message) when is_reference(index_ref) and is_binary(message) do
+    case NIF.session_index_lookup(index_ref, message) do
+      {:ok, session_ref} -> {:ok, session_ref}
+      {:error, :not_found} -> :error
+      {:error, error} -> raise NIFError, error
+    end
+  end
+
+  @doc """
+  Removes a session from the index, if it's in it.
+  """
+  def delete(index_ref, session_ref)
+      when is_reference(index_ref) and is_reference(session_ref) do
+    NIF.session_index_delete(index_ref, session_ref)
+  end
+
+  @doc """
+  The number of sessions in the index.
+  """
+  def size(index_ref) when is_reference(index_ref), do: NIF.session_index_size(index_ref)
+end
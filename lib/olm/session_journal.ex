@@ -0,0 +1,156 @@
+defmodule Olm.SessionJournal do
+  @moduledoc """
+  Keeps sessions in an append-only file, keyed by session id.
+
+  Writing every session to a database after every message it encrypts or decrypts costs a round
+  trip per message. A journal instead appends a raw pickle of the session to a local file and
+  returns once the file has been synced. Writers which arrive while a sync is running share the
+  next one, so many processes writing at once cost far fewer syncs than writes.
+
+      {:ok, journal} = Olm.SessionJournal.open("/var/lib/my_app/sessions.journal")
+
+      :ok = Olm.SessionJournal.put_session(journal, session_ref, pickle_key)
+
+      {:ok, session_ref} = Olm.SessionJournal.load_session(journal, session_id, pickle_key)
+
+  When a journal is opened, the file is mapped into memory and the latest record of every session
+  is indexed, but no session is unpickled until it's loaded. A record torn by a crash is found by
+  its checksum and cut off. Once most of a file larger than a few megabytes is records which have
+  been superseded, the next write copies the live ones into a new file which replaces it;
+  `compact/1` does so straight away.
+
+  A record can't be loaded until the sync it's written in has succeeded. If a sync fails, the
+  writes waiting for it and every later call with the journal fail with its error, such as
+  `:eio`, since the kernel may have dropped records it won't report again. Close the journal and
+  open it again to find out which records reached the file.
+
+  A journal can be shared between processes, and a file can only be open in one journal at a
+  time. Records are written in the byte order of the machine, so a file can't be moved to a
+  machine with a different one.
+
+  ## As a session cache store
+
+  A journal is also an `Olm.SessionCache.Store`, which keeps the sessions a cache evicts on disk:
+
+      Olm.SessionCache.start_link(
+        name: MyApp.Sessions,
+        key: pickle_key,
+        max_live: 10_000,
+        store: {Olm.SessionJournal, path: "/var/lib/my_app/evicted.journal"}
+      )
+
+  The cache's ids are stored as `:erlang.term_to_binary/1` of them. Open a journal with
+  `open/1` or use it as a store, not both, since the ids are stored differently.
+  """
+
+  @behaviour Olm.SessionCache.Store
+
+  alias Olm.{NIF, NIFError}
+
+  @doc """
+  Opens the journal at `path`, creating the file if it doesn't exist.
+
+  Returns `{:ok, journal_ref}`, or `{:error, reason}` with a reason like `:file`'s, such as
+  `:eacces`, or `:eagain` if the file is already open in another journal. An error `:file` has
+  no name for here is returned as `{:errno, code}`. A file which isn't a journal returns
+  `{:error, :bad_journal}`.
+  """
+  def open(path) when is_binary(path), do: NIF.journal_open(path)
+
+  @doc """
+  Appends a session, replacing any earlier record of it, and returns once it's synced.
+
+  The session is stored under `Olm.Session.id/1` and at its `Olm.Session.generation/1`.
+  """
+  def put_session(journal_ref, session_ref, key)
+      when is_reference(journal_ref) and is_reference(session_ref) and is_binary(key) do
+    case NIF.journal_put_session(journal_ref, session_ref, key) do
+      :ok -> :ok
+      {:error, error} -> raise NIFError, error
+    end
+  end
+
+  @doc """
+  Unpickles the latest session stored under a session id.
+
+  Returns `{:ok, session_ref}`, or `:error` if the journal has no session with the id. Like an
+  unpickled session, it starts at a generation of its own rather than the one it was stored at.
+  """
+  def load_session(journal_ref, session_id, key)
+      when is_reference(journal_ref) and is_binary(session_id) and is_binary(key) do
+    case NIF.journal_load_session(journal_ref, session_id, key) do
+      {:ok, session_ref} -> {:ok, session_ref}
+      {:error, :not_found} -> :error
+      {:error, error} -> raise NIFError, error
+    end
+  end
+
+  @doc """
+  Appends a record deleting the session stored under a session id, if there is one.
+  """
+  def delete_session(journal_ref, session_id)
+      when is_reference(journal_ref) and is_binary(session_id) do
+    case NIF.journal_delete(journal_ref, session_id) do
+      :ok -> :ok
+      {:error, error} -> raise NIFError, error
+    end
+  end
+
+  @doc """
+  Copies the live records into a new file which replaces the journal's, whether or not most of
+  it has been superseded.
+  """
+  def compact(journal_ref) when is_reference(journal_ref) do
+    case NIF.journal_compact(journal_ref) do
+      :ok -> :ok
+      {:error, error} -> raise NIFError, error
+    end
+  end
+
+  @doc """
+  Returns the number of sessions in the journal (`:sessions`), the bytes their latest records
+  take (`:live_bytes`) and the size of the file (`:file_bytes`).
+  """
+  def stats(journal_ref) when is_reference(journal_ref), do: NIF.journal_stats(journal_ref)
+
+  @doc """
+  Syncs and closes the file. The journal can't be used afterwards.
+  """
+  def close(journal_ref) when is_reference(journal_ref) do
+    case NIF.journal_close(journal_ref) do
+      :ok -> :ok
+      {:error, error} -> raise NIFError, error
+    end
+  end
+
+  @impl Olm.SessionCache.Store
+  def init(options) do
+    path = Keyword.fetch!(options, :path)
+
+    case open(path) do
+      {:ok, journal_ref} -> journal_ref
+      {:error, reason} -> raise File.Error, reason: reason, action: "open journal", path: path
+    end
+  end
+
+  # The cache's pickles are already raw, and carry no generation.
+  @impl Olm.SessionCache.Store
+  def put(journal_ref, id, pickled_session) do
+    case NIF.journal_put(journal_ref, :erlang.term_to_binary(id), 0, pickled_session) do
+      :ok -> :ok
+      {:error, error} -> raise NIFError, error
+    end
+  end
+
+  @impl Olm.SessionCache.Store
+  def fetch(journal_ref, id) do
+    case NIF.journal_fetch(journal_ref, :erlang.term_to_binary(id)) do
+      {:ok, pickled_session, _generation} -> {:ok, pickled_session}
+      {:error, :not_found} -> :error
+      {:error, error} -> raise NIFError, error
+    end
+  end
+
+  @impl Olm.SessionCache.Store
+  def delete(journal_ref, id), do: delete_session(journal_ref, :erlang.term_to_binary(id))
+end
@@ -0,0 +1,59 @@
+defmodule Olm.Telemetry do
+  @moduledoc ~S"""
+  Telemetry events emitted by Olm.
+
+  Every NIF call made by `Olm.Account`, `Olm.Session` and `Olm.Utility` runs inside a
+  `:telemetry.span/3`, which emits three events named after the module and function:
+
+    * `[:olm, module, function, :start]` with `:system_time` and `:monotonic_time` measurements.
+    * `[:olm, module, function, :stop]` with a `:duration` measurement in native time units.
+      When libolm returned an error, such as a message failing to decrypt, the metadata holds it
+      as `:error`, for example `:bad_message_mac`.
+    * `[:olm, module, function, :exception]` with a `:duration` measurement, when the call
+      raised, for example on a bad argument. The metadata holds the `:kind`, `:reason` and
+      `:stacktrace`.
+
+  `module` is `:account`, `:session` or `:utility` and `function` is the public function's name,
+  for example `[:olm, :session, :decrypt_message, :stop]`.
+
+  Calls working on a single payload also measure its size as `:bytes`: the plaintext when
+  encrypting, the cyphertext when decrypting, the message when signing and verifying, the input
+  when hashing and the pickle when pickling and unpickling. Encrypting and decrypting a single
+  message also measures its `:type`. Batch functions measure the number of items as `:count`;
+  `Olm.Session.encrypt_to_many/2` measures the plaintext's `:bytes` too.
+  `Olm.Session.pickle_many/2` and `Olm.Session.unpickle_many/2` emit a span per batch.
+
+  The incremental `Olm.Utility.sha256_*` functions run in `:crypto` and emit no events. Counters
+  kept inside the NIF, which cost less than attaching a handler, are read with `Olm.stats/0`.
+
+  ## Example
+
+      :telemetry.attach(
+        "log-decrypt-failures",
+        [:olm, :session, :decrypt_message, :stop],
+        fn
+          _event, _measurements, %{error: error}, _config ->
+            Logger.warning("decrypt failed: #{inspect(error)}")
+
+          _event, _measurements, _metadata, _config ->
+            :ok
+        end,
+        nil
+      )
+  """
+
+  @doc false
+  def span(event, metadata, fun, measure \\ fn _result -> %{} end) do
+    :telemetry.span([:olm | event], metadata, fn ->
+      result = fun.()
+      {result, measure.(result), put_error(metadata, result)}
+    end)
+  end
+
+  @doc false
+  def result_bytes({:ok, binary}) when is_binary(binary), do: %{bytes: byte_size(binary)}
+  def result_bytes(_result), do: %{}
+
+  defp put_error(metadata, {:error, reason}), do: Map.put(metadata, :error, reason)
+  defp put_error(metadata, _result), do: metadata
+end
@@ -3,26 +3,81 @@ defmodule Olm.Utility do
   Olm Utility functions.
   """
 
-  alias Olm.{NIF, NIFError}
+  alias Olm.{NIF, NIFError, Telemetry}
 
   @doc """
-  Calculates the SHA-256 hash of the input and encodes it as base64.
+  Calculates the SHA-256 hash of the input, which may be iodata, and encodes it as base64.
   """
-  def sha256(to_hash) when is_binary(to_hash) do
-    case NIF.utility_sha256(to_hash) do
+  def sha256(to_hash) when is_binary(to_hash) or is_list(to_hash) do
+    nif = fn -> NIF.utility_sha256(to_hash) end
+    measure = fn _result -> %{bytes: IO.iodata_length(to_hash)} end
+
+    case Telemetry.span([:utility, :sha256], %{}, nif, measure) do
       {:ok, hash} -> hash
       {:error, error} -> raise NIFError, error
     end
   end
 
+  @doc """
+  Starts an incremental SHA-256 hash, for input too large to hash in one call.
+
+  Feed it chunks with `sha256_update/2` and finish with `sha256_final/2`. libolm has no
+  incremental hash, so this uses `:crypto`, whose hash state works the same way and yields
+  between chunks.
+
+  ## Example
+
+      File.stream!(path, [], 65_536)
+      |> Enum.reduce(Utility.sha256_init(), &Utility.sha256_update(&2, &1))
+      |> Utility.sha256_final()
+  """
+  def sha256_init(), do: :crypto.hash_init(:sha256)
+
+  @doc """
+  Adds a chunk of iodata to an incremental SHA-256 hash.
+  """
+  def sha256_update(state, chunk), do: :crypto.hash_update(state, chunk)
+
+  @doc """
+  Finishes an incremental SHA-256 hash.
+
+  Returns the hash as unpadded base64, like `sha256/1`, or as raw bytes when the format is
+  `:raw`.
+  """
+  def sha256_final(state, format \\ :base64)
+
+  def sha256_final(state, :base64),
+    do: state |> :crypto.hash_final() |> Base.encode64(padding: false)
+
+  def sha256_final(state, :raw), do: :crypto.hash_final(state)
+
   @doc """
   Verifies an ed25519 signature.
   """
   def verify_ed25519(key, message, signature)
-      when is_binary(key) and is_binary(message) and is_binary(signature) do
-    case NIF.utility_ed25519_verify(key, message, signature) do
-      {:ok, _} -> {:ok, "verified"}
-      {:error, 'BAD_MESSAGE_MAC'} -> {:error, "bad message MAC"}
+      when is_binary(key) and (is_binary(message) or is_list(message)) and is_binary(signature) do
+    nif = fn -> NIF.utility_ed25519_verify(key, message, signature) end
+    measure = fn _result -> %{bytes: IO.iodata_length(message)} end
+
+    case Telemetry.span([:utility, :verify_ed25519], %{}, nif, measure) do
+      :ok -> {:ok, "verified"}
+      {:error, :bad_message_mac} -> {:error, "bad message MAC"}
+      {:error, error} -> raise NIFError, error
+    end
+  end
+
+  @doc """
+  Verifies a list of `{key, message, signature}` ed25519 signatures.
+
+  Returns a list of booleans, one per signature, in order. All the signatures are verified in
+  one call on a dirty scheduler.
+  """
+  def verify_ed25519_many(signatures) when is_list(signatures) do
+    nif = fn -> NIF.utility_ed25519_verify_many(signatures) end
+    measure = fn _result -> %{count: length(signatures)} end
+
+    case Telemetry.span([:utility, :verify_ed25519_many], %{}, nif, measure) do
+      {:ok, results} -> results
       {:error, error} -> raise NIFError, error
     end
   end
@@ -7,6 +7,7 @@ defmodule Olm.MixProject do
       version: "0.1.0-rc",
       elixir: "~> 1.10",
       start_permanent: Mix.env() == :prod,
+      elixirc_paths: elixirc_paths(Mix.env()),
       deps: deps(),
       compilers: [:olm_nifs] ++ Mix.compilers(),
       aliases: aliases(),
@@ -19,14 +20,19 @@ defmodule Olm.MixProject do
   # Run "mix help compile.app" to learn about applications.
   def application do
     [
-      extra_applications: [:logger]
+      extra_applications: [:logger, :crypto]
     ]
   end
 
+  # Test helpers shared between test modules are compiled with the library.
+  defp elixirc_paths(:test), do: ["lib", "test/support"]
+  defp elixirc_paths(_env), do: ["lib"]
+
   # Run "mix help deps" to learn about dependencies.
   defp deps do
     [
       {:jason, "~> 1.4"},
+      {:telemetry, "~> 1.1"},
       {:ex_doc, "~> 0.29", only: :dev, runtime: false}
     ]
   end
@@ -70,5 +76,44 @@ defmodule Mix.Tasks.Compile.OlmNifs do
     if File.exists?("priv/olm_nif.so") do
       File.rm!("priv/olm_nif.so")
     end
+
+    # The native benchmark and fuzzer built by `make bench` and `make fuzz`.
+    File.rm_rf!("priv/native")
+  end
+end
+
+defmodule Mix.Tasks.Olm.Bench do
+  use Mix.Task
+
+  @shortdoc "Runs the NIF benchmark suite and saves the results as JSON"
+
+  @moduledoc """
+  Runs the benchmark suite in `bench/suite.exs` and writes the results as JSON.
+
+      mix olm.bench [--output PATH] [--scale FLOAT] [--only NAME]
+
+    * `--output` - where to write the results, defaults to `bench/results/<timestamp>.json`
+    * `--scale` - multiplies the number of operations run per scenario, defaults to `1.0`
+    * `--only` - only runs scenarios whose name contains the given string
+  """
+
+  def run(args) do
+    {opts, _args} =
+      OptionParser.parse!(args, strict: [output: :string, scale: :float, only: :string])
+
+    Mix.Task.run("app.start")
+    Code.require_file("bench/suite.exs")
+
+    results = Olm.Bench.Suite.run(opts)
+    output = Keyword.get_lazy(opts, :output, &default_output/0)
+
+    File.mkdir_p!(Path.dirname(output))
+    File.write!(output, Jason.encode!(results, pretty: true))
+    Mix.shell().info("Results written to #{output}")
+  end
+
+  defp default_output() do
+    timestamp = DateTime.utc_now() |> DateTime.truncate(:second) |> DateTime.to_iso8601(:basic)
+    Path.join(["bench", "results", "#{timestamp}.json"])
   end
 end
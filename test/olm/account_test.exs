@@ -7,10 +7,28 @@ defmodule Olm.AccountTest do
   defp create_account(_context), do: %{account: Account.create()}
   defp pickle_account(context), do: %{pickled_account: Account.pickle(context.account, "key")}
 
+  # Starts an inbound session of the account from a peer which claimed one of its keys.
+  defp session_with(account, one_time_key) do
+    peer_account = Account.create()
+    %{curve25519: id_key} = Account.identity_keys(account)
+    %{curve25519: peer_id_key} = Account.identity_keys(peer_account)
+
+    outbound = Session.new_outbound(peer_account, id_key, one_time_key)
+    %{type: 0, cyphertext: cyphertext} = Session.encrypt_message(outbound, "hello")
+
+    inbound = Session.new_inbound(account, cyphertext, peer_id_key)
+    :ok = Account.remove_one_time_keys(account, inbound)
+    inbound
+  end
+
   describe "create/0:" do
     test "returns a reference to an account resource" do
       assert is_reference(Account.create())
     end
+
+    test "seeds every account with fresh randomness" do
+      assert Account.identity_keys(Account.create()) != Account.identity_keys(Account.create())
+    end
   end
 
   describe "pickle/2:" do
@@ -35,6 +53,34 @@ defmodule Olm.AccountTest do
     end
   end
 
+  describe "pickle_if_changed/3:" do
+    setup :create_account
+
+    test "pickles a new account, then only once its one time keys change", context do
+      assert {:ok, pickled, generation} = Account.pickle_if_changed(context.account, "key", 0)
+      assert {:ok, _account} = Account.unpickle(pickled, "key")
+
+      Account.identity_keys(context.account)
+      Account.sign(context.account, "message")
+      assert Account.pickle_if_changed(context.account, "key", generation) == :unchanged
+
+      Account.generate_one_time_keys(context.account, 1)
+      assert Account.generation(context.account) > generation
+      assert {:ok, _pickled, _} = Account.pickle_if_changed(context.account, "key", generation)
+    end
+
+    test "an unpickled account starts at a generation of its own", context do
+      pickled = Account.pickle(context.account, "key")
+      {:ok, account} = Account.unpickle(pickled, "key")
+      {:ok, other_account} = Account.unpickle(pickled, "key")
+      generation = Account.generation(account)
+
+      refute generation in [0, Account.generation(context.account)]
+      assert Account.pickle_if_changed(account, "key", generation) == :unchanged
+      assert {:ok, _pickled, _} = Account.pickle_if_changed(other_account, "key", generation)
+    end
+  end
+
   describe "identity_keys/1:" do
     setup :create_account
 
@@ -47,6 +93,21 @@ defmodule Olm.AccountTest do
       assert is_binary(keys.curve25519)
       assert is_binary(keys.ed25519)
     end
+
+    test "matches the keys in libolm's JSON", context do
+      {:ok, json} = Olm.NIF.account_identity_keys(context.account)
+
+      assert Account.identity_keys(context.account) == Jason.decode!(json, keys: :atoms)
+    end
+
+    test "returns the same keys after unpickling", context do
+      keys = Account.identity_keys(context.account)
+
+      assert context.account
+             |> Account.pickle("key")
+             |> Account.unpickle("key")
+             |> Account.identity_keys() == keys
+    end
   end
 
   describe "sign/2:" do
@@ -55,6 +116,11 @@ defmodule Olm.AccountTest do
     test "returns the message signed with the ed25519 key", context do
       assert context.account |> Account.sign("message") |> is_binary
     end
+
+    test "accepts iodata", context do
+      assert Account.sign(context.account, ["mes", ?s, ["age"]]) ==
+               Account.sign(context.account, "message")
+    end
   end
 
   describe "one_time_keys/1:" do
@@ -74,6 +140,25 @@ defmodule Olm.AccountTest do
     end
   end
 
+  describe "one_time_keys_list/1:" do
+    setup :create_account
+
+    test "returns an empty list when there are no unpublished keys", context do
+      assert Account.one_time_keys_list(context.account) == []
+    end
+
+    test "returns the same keys as one_time_keys/1", context do
+      :ok = Account.generate_one_time_keys(context.account, 3)
+      keys = Account.one_time_keys(context.account).curve25519
+
+      assert context.account |> Account.one_time_keys_list() |> length() == 3
+
+      for {key_id, key} <- Account.one_time_keys_list(context.account) do
+        assert keys[String.to_atom(key_id)] == key
+      end
+    end
+  end
+
   describe "mark_keys_as_published/1:" do
     setup :create_account
 
@@ -100,6 +185,65 @@ defmodule Olm.AccountTest do
     test "returns one time keys if return is set to true", context do
       assert context.account |> Account.generate_one_time_keys(3, true) |> is_map
     end
+
+    test "generates a large number of keys", context do
+      keys = Account.generate_one_time_keys(context.account, 50, true)
+      assert keys.curve25519 |> Map.keys() |> length() == 50
+    end
+  end
+
+  describe "replenish_one_time_keys/3:" do
+    setup :create_account
+
+    test "returns the generated keys as {key_id, key} binaries", context do
+      keys = Account.replenish_one_time_keys(context.account, 10, 0)
+      unpublished = Account.one_time_keys(context.account).curve25519
+
+      assert length(keys) == 10
+
+      for {key_id, key} <- keys do
+        assert unpublished[String.to_atom(key_id)] == key
+      end
+    end
+
+    test "only generates keys up to the watermark", context do
+      :ok = Account.generate_one_time_keys(context.account, 4)
+
+      assert context.account |> Account.replenish_one_time_keys(10, 0) |> length() == 6
+      assert Account.replenish_one_time_keys(context.account, 10, 0) == []
+    end
+
+    test "counts the published keys the server still holds", context do
+      Account.replenish_one_time_keys(context.account, 5, 0)
+      :ok = Account.mark_keys_as_published(context.account)
+
+      assert Account.replenish_one_time_keys(context.account, 5, 5) == []
+      assert context.account |> Account.replenish_one_time_keys(5, 2) |> length() == 3
+    end
+
+    test "is capped at max_one_time_keys/1", context do
+      max = Account.max_one_time_keys(context.account)
+
+      assert context.account |> Account.replenish_one_time_keys(max + 10, 0) |> length() == max
+      :ok = Account.mark_keys_as_published(context.account)
+
+      assert Account.replenish_one_time_keys(context.account, max + 10, max) == []
+    end
+
+    test "keeps the published keys peers can still claim", context do
+      max = Account.max_one_time_keys(context.account)
+      keys = Account.replenish_one_time_keys(context.account, max, 0)
+      :ok = Account.mark_keys_as_published(context.account)
+
+      # A peer claims one key, so the refill may only replace that one.
+      {_key_id, claimed_key} = List.keyfind(keys, "AAAAAg", 0)
+      session_with(context.account, claimed_key)
+
+      assert context.account |> Account.replenish_one_time_keys(max, max - 1) |> length() == 1
+
+      {_key_id, oldest_key} = List.keyfind(keys, "AAAAAQ", 0)
+      assert context.account |> session_with(oldest_key) |> is_reference()
+    end
   end
 
   describe "remove_one_time_keys/2:" do
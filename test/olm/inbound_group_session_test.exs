@@ -0,0 +1,80 @@
+defmodule Olm.InboundGroupSessionTest do
+  use ExUnit.Case
+  alias Olm.{InboundGroupSession, OutboundGroupSession}
+
+  doctest InboundGroupSession
+
+  defp create_sessions(_context) do
+    outbound_session = OutboundGroupSession.new()
+    session_key = OutboundGroupSession.session_key(outbound_session)
+
+    %{outbound_session: outbound_session, session: InboundGroupSession.new(session_key)}
+  end
+
+  describe "new/1:" do
+    test "returns a reference to an inbound group session" do
+      session_key = OutboundGroupSession.new() |> OutboundGroupSession.session_key()
+      assert is_reference(InboundGroupSession.new(session_key))
+    end
+
+    test "raises for a bad session key" do
+      assert_raise Olm.NIFError, ~r/:bad_session_key/, fn ->
+        InboundGroupSession.new("bad key")
+      end
+    end
+  end
+
+  describe "pickle/2:" do
+    setup :create_sessions
+
+    test "returns the pickled session as a base64 string", context do
+      assert context.session |> InboundGroupSession.pickle("key") |> is_binary()
+    end
+  end
+
+  describe "unpickle/2:" do
+    setup :create_sessions
+
+    test "returns a reference to the unpickled session", context do
+      pickled = InboundGroupSession.pickle(context.session, "key")
+      assert pickled |> InboundGroupSession.unpickle("key") |> is_reference()
+    end
+
+    test "raises with libolm's error for the wrong key", context do
+      pickled = InboundGroupSession.pickle(context.session, "key")
+
+      assert_raise Olm.NIFError, ~r/:bad_account_key/, fn ->
+        InboundGroupSession.unpickle(pickled, "wrong key")
+      end
+    end
+  end
+
+  describe "id/1:" do
+    setup :create_sessions
+
+    test "returns the id of the outbound session", context do
+      assert InboundGroupSession.id(context.session) ==
+               OutboundGroupSession.id(context.outbound_session)
+    end
+  end
+
+  describe "first_known_index/1:" do
+    setup :create_sessions
+
+    test "returns the first index the session can decrypt", context do
+      assert InboundGroupSession.first_known_index(context.session) == 0
+    end
+  end
+
+  describe "decrypt_message/2:" do
+    setup :create_sessions
+
+    test "returns the decrypted message and its index", context do
+      first = OutboundGroupSession.encrypt_message(context.outbound_session, "first")
+      second = OutboundGroupSession.encrypt_message(context.outbound_session, "second")
+
+      assert InboundGroupSession.decrypt_message(context.session, second) == {"second", 1}
+      assert InboundGroupSession.decrypt_message(context.session, first) == {"first", 0}
+    end
+  end
+end
@@ -0,0 +1,60 @@
+defmodule Olm.MessageTest do
+  use ExUnit.Case
+  import Olm.Test.Sessions
+  alias Olm.{Message, Session}
+
+  describe "inspect/2:" do
+    setup [:create_accounts, :create_session_pair]
+
+    test "reads the keys of a pre key message", context do
+      %{type: 0, cyphertext: cyphertext} = context.first_message
+
+      assert %{
+               type: 0,
+               chain_index: 0,
+               one_time_key: one_time_key,
+               identity_key: identity_key,
+               base_key: base_key
+             } = Message.inspect(0, cyphertext)
+
+      assert one_time_key == context.one_time_key
+      assert identity_key == context.id_key
+      assert byte_size(base_key) == 43
+    end
+
+    test "counts up the chain index of messages sent with one ratchet key", context do
+      %{type: 0, cyphertext: cyphertext} = context.first_message
+      %{ratchet_key: ratchet_key, base_key: base_key} = Message.inspect(0, cyphertext)
+
+      for chain_index <- 1..3 do
+        %{type: 0, cyphertext: cyphertext} = Session.encrypt_message(context.outbound, "again")
+
+        assert %{ratchet_key: ^ratchet_key, chain_index: ^chain_index, base_key: ^base_key} =
+                 Message.inspect(0, cyphertext)
+      end
+    end
+
+    test "reads a new ratchet key once the sender has had a reply", context do
+      %{type: 0, cyphertext: cyphertext} = context.first_message
+      %{ratchet_key: first_ratchet_key} = Message.inspect(0, cyphertext)
+      Session.decrypt_message(context.inbound, 0, cyphertext)
+
+      %{type: 1, cyphertext: reply} = Session.encrypt_message(context.inbound, "reply")
+      assert %{chain_index: 0, ratchet_key: reply_ratchet_key} = Message.inspect(1, reply)
+      assert Session.decrypt_message(context.outbound, 1, reply) == "reply"
+
+      %{type: 1, cyphertext: cyphertext} = Session.encrypt_message(context.outbound, "next")
+      assert %{chain_index: 0, ratchet_key: ratchet_key} = Message.inspect(1, cyphertext)
+
+      refute ratchet_key in [first_ratchet_key, reply_ratchet_key]
+      assert Session.decrypt_message(context.inbound, 1, cyphertext) == "next"
+    end
+
+    test "raises on a message which isn't of the type", context do
+      %{type: 0, cyphertext: cyphertext} = context.first_message
+
+      assert_raise Olm.NIFError, fn -> Message.inspect(1, cyphertext) end
+      assert_raise Olm.NIFError, fn -> Message.inspect(0, "not a message") end
+    end
+  end
+end
@@ -0,0 +1,81 @@
+defmodule Olm.OutboundGroupSessionTest do
+  use ExUnit.Case
+  alias Olm.OutboundGroupSession
+
+  doctest OutboundGroupSession
+
+  defp create_session(_context), do: %{session: OutboundGroupSession.new()}
+
+  describe "new/0:" do
+    test "returns a reference to an outbound group session" do
+      assert is_reference(OutboundGroupSession.new())
+    end
+  end
+
+  describe "pickle/2:" do
+    setup :create_session
+
+    test "returns the pickled session as a base64 string", context do
+      assert context.session |> OutboundGroupSession.pickle("key") |> is_binary()
+    end
+  end
+
+  describe "unpickle/2:" do
+    setup :create_session
+
+    test "returns a reference to the unpickled session", context do
+      pickled = OutboundGroupSession.pickle(context.session, "key")
+      session = OutboundGroupSession.unpickle(pickled, "key")
+
+      assert is_reference(session)
+      assert OutboundGroupSession.id(session) == OutboundGroupSession.id(context.session)
+    end
+
+    test "raises with libolm's error for the wrong key", context do
+      pickled = OutboundGroupSession.pickle(context.session, "key")
+
+      assert_raise Olm.NIFError, ~r/:bad_account_key/, fn ->
+        OutboundGroupSession.unpickle(pickled, "wrong key")
+      end
+    end
+  end
+
+  describe "id/1:" do
+    setup :create_session
+
+    test "returns the session id", context do
+      assert context.session |> OutboundGroupSession.id() |> is_binary()
+    end
+  end
+
+  describe "session_key/1:" do
+    setup :create_session
+
+    test "returns the session key", context do
+      assert context.session |> OutboundGroupSession.session_key() |> is_binary()
+    end
+  end
+
+  describe "message_index/1:" do
+    setup :create_session
+
+    test "returns the index of the next message", context do
+      assert OutboundGroupSession.message_index(context.session) == 0
+      OutboundGroupSession.encrypt_message(context.session, "message")
+      assert OutboundGroupSession.message_index(context.session) == 1
+    end
+  end
+
+  describe "encrypt_message/2:" do
+    setup :create_session
+
+    test "returns base64 encoded cyphertext", context do
+      assert context.session |> OutboundGroupSession.encrypt_message("message") |> is_binary()
+    end
+
+    test "accepts iodata", context do
+      cyphertext = OutboundGroupSession.encrypt_message(context.session, ["mess", "age"])
+      assert is_binary(cyphertext)
+    end
+  end
+end
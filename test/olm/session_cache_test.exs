@@ -0,0 +1,99 @@
+defmodule Olm.SessionCacheTest do
+  use ExUnit.Case
+  import Olm.Test.Sessions
+  alias Olm.{Session, SessionCache}
+
+  defp start_cache(context) do
+    name = :"#{inspect(__MODULE__)}-#{context.test}"
+    start_supervised!({SessionCache, name: name, key: "key", max_live: 2})
+
+    %{cache: name}
+  end
+
+  describe "with_session/3:" do
+    setup [:create_accounts, :create_sessions, :start_cache]
+
+    test "calls the function with a live session", context do
+      [{outbound, _inbound} | _] = context.sessions
+      :ok = SessionCache.put(context.cache, :a, outbound)
+
+      assert {:ok, ^outbound} = SessionCache.with_session(context.cache, :a, & &1)
+      assert %{hits: 1, misses: 0, evictions: 0, live: 1} = SessionCache.stats(context.cache)
+    end
+
+    test "returns :error for an unknown session", context do
+      assert SessionCache.with_session(context.cache, :a, & &1) == :error
+      assert %{hits: 0, misses: 1} = SessionCache.stats(context.cache)
+    end
+
+    test "evicts the least recently used sessions beyond the limit", context do
+      [{a, _}, {b, _}, {c, _}] = context.sessions
+      :ok = SessionCache.put(context.cache, :a, a)
+      :ok = SessionCache.put(context.cache, :b, b)
+      {:ok, _} = SessionCache.with_session(context.cache, :a, & &1)
+      :ok = SessionCache.put(context.cache, :c, c)
+
+      assert %{evictions: 2, live: 1} = SessionCache.stats(context.cache)
+      assert {:ok, ^c} = SessionCache.with_session(context.cache, :c, & &1)
+    end
+
+    test "brings an evicted session back", context do
+      [{a, inbound}, {b, _}, {c, _}] = context.sessions
+      id = Session.id(a)
+      :ok = SessionCache.put(context.cache, :a, a)
+      :ok = SessionCache.put(context.cache, :b, b)
+      :ok = SessionCache.put(context.cache, :c, c)
+
+      {:ok, %{type: type, cyphertext: cyphertext}} =
+        SessionCache.with_session(context.cache, :a, fn session ->
+          assert Session.id(session) == id
+          Session.encrypt_message(session, "still works")
+        end)
+
+      assert Session.decrypt_message(inbound, type, cyphertext) == "still works"
+      assert %{misses: 1} = SessionCache.stats(context.cache)
+    end
+
+    test "doesn't evict a session in use", context do
+      [{a, _}, {b, _}, {c, _}] = context.sessions
+      :ok = SessionCache.put(context.cache, :a, a)
+
+      {:ok, :ok} =
+        SessionCache.with_session(context.cache, :a, fn _session ->
+          :ok = SessionCache.put(context.cache, :b, b)
+          :ok = SessionCache.put(context.cache, :c, c)
+        end)
+
+      assert {:ok, ^a} = SessionCache.with_session(context.cache, :a, & &1)
+    end
+
+    test "evicts only the session under an id which looks like a match variable", context do
+      [{a, _}, {b, _}, {c, _}] = context.sessions
+      :ok = SessionCache.put(context.cache, :_, a)
+      :ok = SessionCache.put(context.cache, {:"$1"}, b)
+      :ok = SessionCache.put(context.cache, :c, c)
+
+      assert %{evictions: 2, live: 1} = SessionCache.stats(context.cache)
+      assert {:ok, ^c} = SessionCache.with_session(context.cache, :c, & &1)
+      assert {:ok, _} = SessionCache.with_session(context.cache, :_, & &1)
+      assert {:ok, _} = SessionCache.with_session(context.cache, {:"$1"}, & &1)
+    end
+  end
+
+  describe "delete/2:" do
+    setup [:create_accounts, :create_sessions, :start_cache]
+
+    test "removes live and evicted sessions", context do
+      [{a, _}, {b, _}, {c, _}] = context.sessions
+      :ok = SessionCache.put(context.cache, :a, a)
+      :ok = SessionCache.put(context.cache, :b, b)
+      :ok = SessionCache.put(context.cache, :c, c)
+
+      :ok = SessionCache.delete(context.cache, :a)
+      :ok = SessionCache.delete(context.cache, :c)
+
+      assert SessionCache.with_session(context.cache, :a, & &1) == :error
+      assert SessionCache.with_session(context.cache, :c, & &1) == :error
+    end
+  end
+end
@@ -0,0 +1,104 @@
+defmodule Olm.SessionIndexTest do
+  use ExUnit.Case
+  import Olm.Test.Sessions
+  alias Olm.{Session, SessionIndex}
+
+  describe "lookup/2:" do
+    setup :create_accounts
+
+    test "finds the session a later pre key message is for", context do
+      index_ref = SessionIndex.new()
+
+      sessions =
+        for _i <- 1..20 do
+          {outbound, cyphertext} = send_pre_key_message(context)
+          inbound = receive_pre_key_message(context, cyphertext)
+          :ok = SessionIndex.put(index_ref, inbound)
+          {outbound, inbound}
+        end
+
+      assert SessionIndex.size(index_ref) == 20
+
+      for {outbound, inbound} <- sessions do
+        %{type: 0, cyphertext: cyphertext} = Session.encrypt_message(outbound, "again")
+
+        assert {:ok, ^inbound} = SessionIndex.lookup(index_ref, cyphertext)
+        assert Session.decrypt_message(inbound, 0, cyphertext) == "again"
+      end
+    end
+
+    test "returns :error for a message starting a new session", context do
+      index_ref = SessionIndex.new()
+      {_outbound, cyphertext} = send_pre_key_message(context)
+      :ok = SessionIndex.put(index_ref, receive_pre_key_message(context, cyphertext))
+
+      {_outbound, cyphertext} = send_pre_key_message(context)
+
+      assert SessionIndex.lookup(index_ref, cyphertext) == :error
+    end
+
+    test "raises on a message which isn't a pre key message" do
+      index_ref = SessionIndex.new()
+
+      assert_raise Olm.NIFError, fn -> SessionIndex.lookup(index_ref, "not a message") end
+    end
+  end
+
+  describe "put/2:" do
+    setup :create_accounts
+
+    test "raises for an outbound session", context do
+      {outbound, _cyphertext} = send_pre_key_message(context)
+
+      assert_raise Olm.NIFError, fn -> SessionIndex.put(SessionIndex.new(), outbound) end
+    end
+  end
+
+  describe "put/3:" do
+    setup :create_accounts
+
+    test "adds an unpickled session under the keys of a message for it", context do
+      index_ref = SessionIndex.new()
+      {outbound, cyphertext} = send_pre_key_message(context)
+
+      inbound =
+        context
+        |> receive_pre_key_message(cyphertext)
+        |> Session.pickle("key")
+        |> Session.unpickle("key")
+
+      assert_raise Olm.NIFError, fn -> SessionIndex.put(index_ref, inbound) end
+
+      :ok = SessionIndex.put(index_ref, inbound, cyphertext)
+      %{type: 0, cyphertext: cyphertext} = Session.encrypt_message(outbound, "again")
+
+      assert {:ok, ^inbound} = SessionIndex.lookup(index_ref, cyphertext)
+    end
+
+    test "raises if the message isn't for the session", context do
+      {_outbound, cyphertext} = send_pre_key_message(context)
+      inbound = receive_pre_key_message(context, cyphertext)
+      {_outbound, other_cyphertext} = send_pre_key_message(context)
+
+      assert_raise Olm.NIFError, fn ->
+        SessionIndex.put(SessionIndex.new(), inbound, other_cyphertext)
+      end
+    end
+  end
+
+  describe "delete/2:" do
+    setup :create_accounts
+
+    test "removes the session", context do
+      index_ref = SessionIndex.new()
+      {_outbound, cyphertext} = send_pre_key_message(context)
+      inbound = receive_pre_key_message(context, cyphertext)
+      :ok = SessionIndex.put(index_ref, inbound)
+
+      :ok = SessionIndex.delete(index_ref, inbound)
+
+      assert SessionIndex.size(index_ref) == 0
+      assert SessionIndex.lookup(index_ref, cyphertext) == :error
+    end
+  end
+end
@@ -0,0 +1,174 @@
+defmodule Olm.SessionJournalTest do
+  use ExUnit.Case
+  import Olm.Test.Sessions
+  alias Olm.{Session, SessionCache, SessionJournal}
+
+  defp journal_path(context) do
+    path = Path.join(System.tmp_dir!(), "olm-#{System.unique_integer([:positive])}.journal")
+    on_exit(fn -> File.rm(path) end)
+
+    Map.put(context, :path, path)
+  end
+
+  describe "load_session/3:" do
+    setup [:create_accounts, :create_sessions, :journal_path]
+
+    test "loads the latest session stored under an id", context do
+      [{outbound, inbound} | _] = context.sessions
+      {:ok, journal} = SessionJournal.open(context.path)
+
+      :ok = SessionJournal.put_session(journal, outbound, "key")
+      %{type: type, cyphertext: cyphertext} = Session.encrypt_message(outbound, "again")
+      :ok = SessionJournal.put_session(journal, outbound, "key")
+
+      {:ok, loaded} = SessionJournal.load_session(journal, Session.id(outbound), "key")
+
+      refute Session.generation(loaded) == Session.generation(outbound)
+      assert Session.decrypt_message(inbound, type, cyphertext) == "again"
+
+      %{type: type, cyphertext: cyphertext} = Session.encrypt_message(loaded, "loaded")
+      assert Session.decrypt_message(inbound, type, cyphertext) == "loaded"
+    end
+
+    test "returns :error for an unknown id", context do
+      {:ok, journal} = SessionJournal.open(context.path)
+
+      assert SessionJournal.load_session(journal, "unknown", "key") == :error
+    end
+
+    test "raises on the wrong key", context do
+      [{outbound, _inbound} | _] = context.sessions
+      {:ok, journal} = SessionJournal.open(context.path)
+      :ok = SessionJournal.put_session(journal, outbound, "key")
+
+      assert_raise Olm.NIFError, ~r/:bad_account_key/, fn ->
+        SessionJournal.load_session(journal, Session.id(outbound), "wrong key")
+      end
+    end
+  end
+
+  describe "open/1:" do
+    setup [:create_accounts, :create_sessions, :journal_path]
+
+    test "indexes the sessions already in the file", context do
+      [{a, _}, {b, _}, {c, _}] = context.sessions
+      {:ok, journal} = SessionJournal.open(context.path)
+
+      for session <- [a, b, c, a], do: :ok = SessionJournal.put_session(journal, session, "key")
+      :ok = SessionJournal.delete_session(journal, Session.id(b))
+      :ok = SessionJournal.close(journal)
+
+      {:ok, journal} = SessionJournal.open(context.path)
+
+      assert %{sessions: 2} = SessionJournal.stats(journal)
+      assert {:ok, _session} = SessionJournal.load_session(journal, Session.id(a), "key")
+      assert SessionJournal.load_session(journal, Session.id(b), "key") == :error
+    end
+
+    test "cuts off a torn record at the end of the file", context do
+      [{a, _}, {b, _} | _] = context.sessions
+      {:ok, journal} = SessionJournal.open(context.path)
+      :ok = SessionJournal.put_session(journal, a, "key")
+      %{file_bytes: file_bytes} = SessionJournal.stats(journal)
+      :ok = SessionJournal.put_session(journal, b, "key")
+      :ok = SessionJournal.close(journal)
+
+      {:ok, file} = File.open(context.path, [:read, :write])
+      {:ok, _position} = :file.position(file, file_bytes + 10)
+      :ok = :file.truncate(file)
+      :ok = File.close(file)
+
+      {:ok, journal} = SessionJournal.open(context.path)
+
+      assert %{sessions: 1, file_bytes: ^file_bytes} = SessionJournal.stats(journal)
+      assert {:ok, _session} = SessionJournal.load_session(journal, Session.id(a), "key")
+      assert File.stat!(context.path).size == file_bytes
+    end
+
+    test "returns an error if the file is open in another journal", context do
+      {:ok, journal} = SessionJournal.open(context.path)
+
+      assert SessionJournal.open(context.path) == {:error, :eagain}
+
+      :ok = SessionJournal.close(journal)
+    end
+
+    test "returns an error for a file which isn't a journal", context do
+      File.write!(context.path, "not a journal")
+
+      assert SessionJournal.open(context.path) == {:error, :bad_journal}
+    end
+  end
+
+  describe "put_session/3:" do
+    setup [:create_accounts, :create_sessions, :journal_path]
+
+    test "stores sessions written from many processes at once", context do
+      {:ok, journal} = SessionJournal.open(context.path)
+
+      context.sessions
+      |> Enum.flat_map(fn {outbound, inbound} -> List.duplicate([outbound, inbound], 10) end)
+      |> List.flatten()
+      |> Task.async_stream(&SessionJournal.put_session(journal, &1, "key"), max_concurrency: 8)
+      |> Enum.each(fn result -> assert result == {:ok, :ok} end)
+
+      assert %{sessions: 3} = SessionJournal.stats(journal)
+    end
+
+    test "raises once the journal is closed", context do
+      [{outbound, _inbound} | _] = context.sessions
+      {:ok, journal} = SessionJournal.open(context.path)
+      :ok = SessionJournal.close(journal)
+
+      assert_raise Olm.NIFError, fn -> SessionJournal.put_session(journal, outbound, "key") end
+    end
+  end
+
+  describe "compact/1:" do
+    setup [:create_accounts, :create_sessions, :journal_path]
+
+    test "drops superseded records", context do
+      [{a, _}, {b, _} | _] = context.sessions
+      {:ok, journal} = SessionJournal.open(context.path)
+
+      for _i <- 1..20, do: :ok = SessionJournal.put_session(journal, a, "key")
+      :ok = SessionJournal.put_session(journal, b, "key")
+      :ok = SessionJournal.delete_session(journal, Session.id(b))
+
+      :ok = SessionJournal.compact(journal)
+
+      %{sessions: 1, live_bytes: live_bytes, file_bytes: file_bytes} =
+        SessionJournal.stats(journal)
+
+      assert file_bytes == live_bytes + 8
+      assert File.stat!(context.path).size == file_bytes
+      assert {:ok, _session} = SessionJournal.load_session(journal, Session.id(a), "key")
+
+      :ok = SessionJournal.put_session(journal, b, "key")
+      :ok = SessionJournal.close(journal)
+      {:ok, journal} = SessionJournal.open(context.path)
+
+      assert %{sessions: 2} = SessionJournal.stats(journal)
+    end
+  end
+
+  describe "as a session cache store:" do
+    setup [:create_accounts, :create_sessions, :journal_path]
+
+    test "keeps evicted sessions in the file", context do
+      [{a, inbound}, {b, _}, {c, _}] = context.sessions
+      options = [name: :journal_cache, key: "key", max_live: 1]
+      start_supervised!({SessionCache, [store: {SessionJournal, path: context.path}] ++ options})
+
+      :ok = SessionCache.put(:journal_cache, :a, a)
+      :ok = SessionCache.put(:journal_cache, :b, b)
+      :ok = SessionCache.put(:journal_cache, :c, c)
+
+      {:ok, %{type: type, cyphertext: cyphertext}} =
+        SessionCache.with_session(:journal_cache, :a, &Session.encrypt_message(&1, "evicted"))
+
+      assert Session.decrypt_message(inbound, type, cyphertext) == "evicted"
+      assert %{misses: 1} = SessionCache.stats(:journal_cache)
+    end
+  end
+end
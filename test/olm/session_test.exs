@@ -63,6 +63,12 @@ defmodule Olm.SessionTest do
                )
              )
     end
+
+    test "raises with libolm's error for a bad one time key", context do
+      assert_raise Olm.NIFError, ~r/:invalid_base64/, fn ->
+        Session.new_outbound(context.account, context.peer_id_key, "not a key")
+      end
+    end
   end
 
   describe "new_inbound/3" do
@@ -82,6 +88,16 @@ defmodule Olm.SessionTest do
       inbound_session = Session.new_inbound(context.peer_account, pre_key_msg.cyphertext)
       assert is_reference(inbound_session)
     end
+
+    test "raises with libolm's error for a message which isn't base64", context do
+      assert_raise Olm.NIFError, ~r/:invalid_base64/, fn ->
+        Session.new_inbound(context.peer_account, "not a message", context.id_key)
+      end
+
+      assert_raise Olm.NIFError, ~r/:invalid_base64/, fn ->
+        Session.new_inbound(context.peer_account, "not a message")
+      end
+    end
   end
 
   describe "id/1:" do
@@ -139,6 +155,133 @@ defmodule Olm.SessionTest do
     test "returns a reference to the unpickle session", context do
       assert is_reference(Session.unpickle(context.pickled_session, "key"))
     end
+
+    test "raises with libolm's error for the wrong key", context do
+      assert_raise Olm.NIFError, ~r/:bad_account_key/, fn ->
+        Session.unpickle(context.pickled_session, "wrong key")
+      end
+    end
+
+    test "round trips the raw format", context do
+      raw = Session.pickle(context.outbound_session, "key", :raw)
+      session = Session.unpickle(raw, "key", :raw)
+
+      assert Session.id(session) == Session.id(context.outbound_session)
+    end
+
+    test "raw pickles are the base64 pickle decoded", context do
+      raw = Session.pickle(context.outbound_session, "key", :raw)
+
+      assert byte_size(raw) == div(byte_size(context.pickled_session) * 3, 4)
+      assert Base.encode64(raw, padding: false) |> Session.unpickle("key") |> is_reference()
+
+      assert context.pickled_session
+             |> Base.decode64!(padding: false)
+             |> Session.unpickle("key", :raw)
+             |> is_reference()
+    end
+
+    test "raises on a raw pickle with the wrong key", context do
+      raw = Session.pickle(context.outbound_session, "key", :raw)
+
+      assert_raise Olm.NIFError, ~r/:bad_account_key/, fn ->
+        Session.unpickle(raw, "wrong key", :raw)
+      end
+    end
+  end
+
+  describe "pickle_if_changed/4:" do
+    setup [:create_account, :create_peer_account, :create_outbound_session]
+
+    test "pickles a new session, then only once its ratchet moves", context do
+      session = context.outbound_session
+
+      assert {:ok, pickled, generation} = Session.pickle_if_changed(session, "key", 0)
+      assert Session.id(Session.unpickle(pickled, "key")) == Session.id(session)
+
+      Session.id(session)
+      assert Session.pickle_if_changed(session, "key", generation) == :unchanged
+
+      Session.encrypt_message(session, "message")
+      assert Session.generation(session) > generation
+
+      assert {:ok, raw, _generation} = Session.pickle_if_changed(session, "key", generation, :raw)
+      assert is_reference(Session.unpickle(raw, "key", :raw))
+    end
+
+    test "a generation read from another session never matches", context do
+      pickled = Session.pickle(context.outbound_session, "key")
+      session = Session.unpickle(pickled, "key")
+      other_session = Session.unpickle(pickled, "key")
+      generation = Session.generation(session)
+
+      refute generation in [0, Session.generation(context.outbound_session)]
+      assert Session.pickle_if_changed(session, "key", generation) == :unchanged
+      assert {:ok, _pickled, _} = Session.pickle_if_changed(other_session, "key", generation)
+    end
+
+    test "a message which fails to decrypt leaves the generation alone", context do
+      %{cyphertext: cyphertext} = Session.encrypt_message(context.outbound_session, "first")
+      inbound = Session.new_inbound(context.peer_account, cyphertext, context.id_key)
+      generation = Session.generation(inbound)
+
+      assert_raise Olm.NIFError, fn -> Session.decrypt_message(inbound, 1, "AwogYm9ndXM") end
+      assert Session.generation(inbound) == generation
+
+      Session.decrypt_message(inbound, 0, cyphertext)
+      assert Session.generation(inbound) > generation
+    end
+  end
+
+  describe "pickle_many/2:" do
+    setup [:create_account, :create_peer_account, :create_outbound_session]
+
+    test "returns a pickle per session, in order", context do
+      sessions = [context.outbound_session, context.outbound_session]
+
+      assert [{:ok, pickled}, {:ok, pickled}] = Session.pickle_many(sessions, "key")
+      assert Session.id(Session.unpickle(pickled, "key")) == Session.id(context.outbound_session)
+    end
+
+    test "accepts a stream", context do
+      sessions = Stream.repeatedly(fn -> context.outbound_session end) |> Stream.take(1_500)
+
+      assert sessions |> Session.pickle_many("key") |> length() == 1_500
+    end
+  end
+
+  describe "unpickle_many/2:" do
+    setup [:create_account, :create_peer_account, :create_outbound_session, :pickle_session]
+
+    test "returns a session per pickle, in order", context do
+      pickles = List.duplicate(context.pickled_session, 3)
+      id = Session.id(context.outbound_session)
+
+      results = Session.unpickle_many(pickles, "key")
+
+      assert length(results) == 3
+      assert Enum.all?(results, fn {:ok, session} -> Session.id(session) == id end)
+    end
+
+    test "reports errors per pickle", context do
+      pickles = [context.pickled_session, "not a pickle", context.pickled_session]
+
+      assert [{:ok, _}, {:error, _}, {:ok, _}] = Session.unpickle_many(pickles, "key")
+    end
+
+    test "reports a wrong key per pickle", context do
+      assert [{:error, :bad_account_key}] =
+               Session.unpickle_many([context.pickled_session], "wrong key")
+    end
+
+    test "leaves the pickles untouched", context do
+      pickle = context.pickled_session
+      copy = :binary.copy(pickle)
+
+      Session.unpickle_many([pickle], "key")
+
+      assert pickle == copy
+    end
   end
 
   describe "encrypt_message/2:" do
@@ -151,6 +294,120 @@ defmodule Olm.SessionTest do
     end
   end
 
+  describe "encrypt_many/2:" do
+    setup [:create_account, :create_peer_account, :create_outbound_session]
+
+    test "returns a {type, cyphertext} tuple per plaintext, in order", context do
+      plaintexts = for n <- 1..40, do: "message #{n}"
+      messages = Session.encrypt_many(context.outbound_session, plaintexts)
+
+      assert length(messages) == length(plaintexts)
+      assert Enum.all?(messages, fn {type, cyphertext} ->
+               type === 0 and is_binary(cyphertext)
+             end)
+
+      [{_type, first} | _] = messages
+      inbound_session = Session.new_inbound(context.peer_account, first, context.id_key)
+
+      decrypted =
+        Enum.map(messages, fn {type, cyphertext} ->
+          Session.decrypt_message(inbound_session, type, cyphertext)
+        end)
+
+      assert decrypted == plaintexts
+    end
+
+    test "returns an empty list for an empty batch", context do
+      assert Session.encrypt_many(context.outbound_session, []) == []
+    end
+  end
+
+  describe "encrypt_to_many/2:" do
+    setup [:create_account, :create_peer_account]
+
+    test "returns a {session_ref, type, cyphertext} tuple per session, in order", context do
+      # Enough sessions to be split into several batches.
+      sessions =
+        for _n <- 1..600 do
+          Session.new_outbound(context.account, context.peer_id_key, context.peer_one_time_key)
+        end
+
+      messages = Session.encrypt_to_many(sessions, ["room ", "key"])
+
+      assert Enum.map(messages, &elem(&1, 0)) == sessions
+
+      for {_session, type, cyphertext} <- Enum.take_every(messages, 50) do
+        inbound_session = Session.new_inbound(context.peer_account, cyphertext, context.id_key)
+
+        assert Session.decrypt_message(inbound_session, type, cyphertext) == "room key"
+      end
+    end
+
+    test "returns an empty list for no sessions" do
+      assert Session.encrypt_to_many([], "room key") == []
+    end
+  end
+
+  describe "encrypt_message/2 (concurrent callers):" do
+    setup [:create_account, :create_peer_account, :create_outbound_session]
+
+    test "keeps the ratchet consistent when shared between processes", context do
+      messages =
+        1..4
+        |> Enum.map(fn n ->
+          Task.async(fn ->
+            for m <- 1..10 do
+              plaintext = "message #{n}-#{m}"
+              {plaintext, Session.encrypt_message(context.outbound_session, plaintext)}
+            end
+          end)
+        end)
+        |> Enum.flat_map(&Task.await/1)
+
+      [{_, first} | _] = messages
+      inbound_session =
+        Session.new_inbound(context.peer_account, first.cyphertext, context.id_key)
+
+      for {plaintext, message} <- messages do
+        assert Session.decrypt_message(inbound_session, message.type, message.cyphertext) ==
+                 plaintext
+      end
+    end
+
+    test "returns the type of the message it encrypted while a reply is decrypted", context do
+      first = Session.encrypt_message(context.outbound_session, "first")
+
+      inbound_session =
+        Session.new_inbound(context.peer_account, first.cyphertext, context.id_key)
+
+      reply = Session.encrypt_message(inbound_session, "reply")
+
+      decrypt =
+        Task.async(fn ->
+          Session.decrypt_message(context.outbound_session, reply.type, reply.cyphertext)
+        end)
+
+      messages =
+        1..4
+        |> Enum.map(fn n ->
+          Task.async(fn ->
+            for m <- 1..10 do
+              plaintext = "message #{n}-#{m}"
+              {plaintext, Session.encrypt_message(context.outbound_session, plaintext)}
+            end
+          end)
+        end)
+        |> Enum.flat_map(&Task.await/1)
+
+      assert Task.await(decrypt) == "reply"
+
+      for {plaintext, message} <- messages do
+        assert Session.decrypt_message(inbound_session, message.type, message.cyphertext) ==
+                 plaintext
+      end
+    end
+  end
+
   describe "decrypt_message/3" do
     setup [
       :create_account,
@@ -168,5 +425,82 @@ defmodule Olm.SessionTest do
                context.pre_key_msg.cyphertext
              ) == "This is a message"
     end
+
+    test "leaves the cyphertext untouched", context do
+      cyphertext = context.pre_key_msg.cyphertext
+      copy = :binary.copy(cyphertext)
+
+      Session.decrypt_message(context.inbound_session, context.pre_key_msg.type, cyphertext)
+
+      assert cyphertext == copy
+    end
+
+    test "decrypts a message encrypted from iodata", context do
+      message = Session.encrypt_message(context.outbound_session, ["io", ?d, ["ata"]])
+
+      assert Session.decrypt_message(context.inbound_session, message.type, message.cyphertext) ==
+               "iodata"
+    end
+
+    test "returns binary plaintext unchanged", context do
+      plaintext = <<0, 1, 2, 255, 0, "text", 0xC3, 0x28, 0>>
+      message = Session.encrypt_message(context.outbound_session, plaintext)
+
+      assert Session.decrypt_message(context.inbound_session, message.type, message.cyphertext) ==
+               plaintext
+    end
+
+    test "returns a plaintext of exactly the decrypted length", context do
+      plaintext = :crypto.strong_rand_bytes(1000)
+      message = Session.encrypt_message(context.outbound_session, plaintext)
+
+      decrypted =
+        Session.decrypt_message(context.inbound_session, message.type, message.cyphertext)
+
+      assert decrypted == plaintext
+      assert :binary.referenced_byte_size(decrypted) == byte_size(plaintext)
+    end
+
+    test "raises on a type which isn't a non-negative integer", context do
+      cyphertext = context.pre_key_msg.cyphertext
+
+      assert_raise ArgumentError, fn ->
+        Session.decrypt_message(context.inbound_session, -1, cyphertext)
+      end
+
+      assert_raise ArgumentError, fn ->
+        Olm.NIF.decrypt_message(context.inbound_session, :pre_key, cyphertext)
+      end
+    end
+  end
+
+  describe "decrypt_many/2:" do
+    setup [:create_account, :create_peer_account, :create_outbound_session]
+
+    test "returns an {:ok, plaintext} entry per message, in order", context do
+      plaintexts = for n <- 1..40, do: "message #{n}"
+      messages = Session.encrypt_many(context.outbound_session, plaintexts)
+
+      [{_type, first} | _] = messages
+      inbound_session = Session.new_inbound(context.peer_account, first, context.id_key)
+
+      assert Session.decrypt_many(inbound_session, messages) ==
+               Enum.map(plaintexts, &{:ok, &1})
+    end
+
+    test "returns an error entry for a bad message without stopping the batch", context do
+      [first, second] = Session.encrypt_many(context.outbound_session, ["one", "two"])
+      {_type, cyphertext} = first
+      inbound_session = Session.new_inbound(context.peer_account, cyphertext, context.id_key)
+
+      assert [{:ok, "one"}, {:error, _}, {:ok, "two"}] =
+               Session.decrypt_many(inbound_session, [first, {1, "not a message"}, second])
+    end
+
+    test "returns error entries for empty cyphertexts", context do
+      assert Session.decrypt_many(context.outbound_session, []) == []
+      assert [{:error, _}, {:error, _}] =
+               Session.decrypt_many(context.outbound_session, [{1, ""}, {0, ""}])
+    end
   end
 end
@@ -0,0 +1,68 @@
+defmodule Olm.TelemetryTest do
+  use ExUnit.Case
+  alias Olm.{Account, Session, Utility}
+
+  defp attach(context) do
+    handler_id = "#{inspect(__MODULE__)}-#{context.test}"
+    parent = self()
+
+    :telemetry.attach_many(
+      handler_id,
+      [
+        [:olm, :session, :encrypt_message, :stop],
+        [:olm, :utility, :verify_ed25519, :stop],
+        [:olm, :utility, :sha256, :exception]
+      ],
+      fn event, measurements, metadata, _config ->
+        send(parent, {:telemetry, event, measurements, metadata})
+      end,
+      nil
+    )
+
+    on_exit(fn -> :telemetry.detach(handler_id) end)
+  end
+
+  defp create_session(_context) do
+    account = Account.create()
+    peer_account = Account.create()
+
+    %{curve25519: peer_id_key} = Account.identity_keys(peer_account)
+    [{_key_id, one_time_key}] = Account.replenish_one_time_keys(peer_account, 1, 0)
+
+    %{account: account, session: Session.new_outbound(account, peer_id_key, one_time_key)}
+  end
+
+  describe "span/4:" do
+    setup [:attach, :create_session]
+
+    test "measures the duration, bytes and type of an encrypted message", context do
+      Session.encrypt_message(context.session, "hello")
+
+      assert_receive {:telemetry, [:olm, :session, :encrypt_message, :stop], measurements, _}
+      assert %{bytes: 5, type: 0, duration: duration} = measurements
+      assert is_integer(duration) and duration >= 0
+    end
+
+    test "puts the libolm error in the stop metadata", context do
+      %{ed25519: key} = Account.identity_keys(context.account)
+      signature = Account.sign(context.account, "message")
+
+      assert {:error, _} = Utility.verify_ed25519(key, "other message", signature)
+
+      assert_receive {:telemetry, [:olm, :utility, :verify_ed25519, :stop], %{bytes: 13},
+                      %{error: :bad_message_mac}}
+
+      assert {:ok, _} = Utility.verify_ed25519(key, "message", signature)
+
+      assert_receive {:telemetry, [:olm, :utility, :verify_ed25519, :stop], _, metadata}
+      refute Map.has_key?(metadata, :error)
+    end
+
+    test "emits an exception event and reraises when the call raises" do
+      assert_raise ArgumentError, fn -> Utility.sha256([:not_iodata]) end
+
+      assert_receive {:telemetry, [:olm, :utility, :sha256, :exception], %{duration: _},
+                      %{kind: :error, reason: :badarg}}
+    end
+  end
+end
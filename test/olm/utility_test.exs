@@ -12,6 +12,41 @@ defmodule Olm.UtilityTest do
     test "returns a hash of the input string" do
       assert "input" |> Utility.sha256() |> is_binary
     end
+
+    test "returns the same hash on every call" do
+      assert Utility.sha256("input") == Utility.sha256("input")
+      refute Utility.sha256("input") == Utility.sha256("other input")
+    end
+
+    test "accepts iodata" do
+      assert Utility.sha256(["in", ?p, ["ut"]]) == Utility.sha256("input")
+    end
+  end
+
+  describe "sha256_init/0, sha256_update/2, sha256_final/2:" do
+    test "matches sha256/1" do
+      hash =
+        ["in", "put"]
+        |> Enum.reduce(Utility.sha256_init(), &Utility.sha256_update(&2, &1))
+        |> Utility.sha256_final()
+
+      assert hash == Utility.sha256("input")
+    end
+
+    test "accepts iodata chunks" do
+      hash =
+        Utility.sha256_init()
+        |> Utility.sha256_update(["i", ?n, ["pu" | "t"]])
+        |> Utility.sha256_final()
+
+      assert hash == Utility.sha256("input")
+    end
+
+    test "returns raw bytes" do
+      hash = Utility.sha256_init() |> Utility.sha256_update("input") |> Utility.sha256_final(:raw)
+
+      assert Base.encode64(hash, padding: false) == Utility.sha256("input")
+    end
   end
 
   describe "verify_ed25519/3:" do
@@ -30,5 +65,48 @@ defmodule Olm.UtilityTest do
 
       assert msg == "bad message MAC"
     end
+
+    test "verifies after a failed verification", context do
+      key = context.identity_keys.ed25519
+
+      for _ <- 1..3 do
+        assert {:error, _} = Utility.verify_ed25519(key, "bad_msg", context.signature)
+        assert {:ok, _} = Utility.verify_ed25519(key, "test", context.signature)
+      end
+    end
+  end
+
+  describe "verify_ed25519_many/1:" do
+    setup [:create_account, :identity_keys, :sign]
+
+    test "returns a boolean per signature, in order", context do
+      key = context.identity_keys.ed25519
+
+      signatures = [
+        {key, "test", context.signature},
+        {key, "bad_msg", context.signature},
+        {key, "test", "not a signature"},
+        {key, "test", context.signature}
+      ]
+
+      assert Utility.verify_ed25519_many(signatures) == [true, false, false, true]
+    end
+
+    test "returns an empty list for no signatures" do
+      assert Utility.verify_ed25519_many([]) == []
+    end
+
+    test "leaves the signatures untouched", context do
+      signature = context.signature
+      copy = :binary.copy(signature)
+
+      Utility.verify_ed25519_many([{context.identity_keys.ed25519, "test", signature}])
+
+      assert signature == copy
+    end
+
+    test "raises on badly shaped elements" do
+      assert_raise ArgumentError, fn -> Utility.verify_ed25519_many([{"key", "message"}]) end
+    end
   end
 end
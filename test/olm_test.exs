@@ -6,4 +6,20 @@ defmodule OlmTest do
   test "version/0" do
     assert String.first(Olm.version()) == "3"
   end
+
+  test "stats/0 counts operations and errors" do
+    before = Olm.stats()
+
+    account = Olm.Account.create()
+    pickled = Olm.Account.pickle(account, "key")
+    Olm.Utility.sha256("hello")
+    {:error, _} = Olm.Account.unpickle(pickled, "wrong key")
+
+    stats = Olm.stats()
+
+    assert stats.sha256.calls == before.sha256.calls + 1
+    assert stats.sha256.bytes_in == before.sha256.bytes_in + 5
+    assert stats.pickle.bytes_out == before.pickle.bytes_out + byte_size(pickled)
+    assert stats.errors.bad_account_key == Map.get(before.errors, :bad_account_key, 0) + 1
+  end
 end
@@ -0,0 +1,59 @@
+defmodule Olm.Test.Sessions do
+  @moduledoc false
+
+  # Setup steps for tests which need sessions between two accounts. Import the module and compose
+  # them, e.g. `setup [:create_accounts, :create_sessions]`.
+
+  alias Olm.{Account, Session}
+
+  def create_accounts(_context) do
+    account = Account.create()
+    peer_account = Account.create()
+
+    %{curve25519: id_key} = Account.identity_keys(account)
+    %{curve25519: peer_id_key} = Account.identity_keys(peer_account)
+
+    %{account: account, peer_account: peer_account, id_key: id_key, peer_id_key: peer_id_key}
+  end
+
+  def create_session_pair(context) do
+    {outbound, first_message, one_time_key} = send_first_message(context)
+
+    %{
+      outbound: outbound,
+      inbound: receive_pre_key_message(context, first_message.cyphertext),
+      first_message: first_message,
+      one_time_key: one_time_key
+    }
+  end
+
+  def create_sessions(context) do
+    sessions =
+      for _i <- 1..3 do
+        {outbound, cyphertext} = send_pre_key_message(context)
+        {outbound, receive_pre_key_message(context, cyphertext)}
+      end
+
+    %{sessions: sessions}
+  end
+
+  # Returns an outbound session of the account and the first pre key message it sends.
+  def send_pre_key_message(context) do
+    {outbound, %{type: 0, cyphertext: cyphertext}, _one_time_key} = send_first_message(context)
+    {outbound, cyphertext}
+  end
+
+  def receive_pre_key_message(context, cyphertext) do
+    inbound = Session.new_inbound(context.peer_account, cyphertext, context.id_key)
+    Account.remove_one_time_keys(context.peer_account, inbound)
+    inbound
+  end
+
+  defp send_first_message(context) do
+    [{_key_id, one_time_key}] = Account.replenish_one_time_keys(context.peer_account, 1, 0)
+    Account.mark_keys_as_published(context.peer_account)
+
+    outbound = Session.new_outbound(context.account, context.peer_id_key, one_time_key)
+    {outbound, Session.encrypt_message(outbound, "hello"), one_time_key}
+  end
+end